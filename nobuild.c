@@ -11,6 +11,7 @@ int main(int argc, char **argv)
     Cstr tool_path = PATH("./main.c");
     #ifndef _WIN32
         CMD("cc", CFLAGS, "-o", "tabellinator", "tabellinator.c", LIBS);
+        CMD("cc", CFLAGS, "-o", "tabellinator-client", "tabellinator-client.c");
     #else
         // CMD("cl.exe", "main.c");
     #endif
@@ -0,0 +1,129 @@
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends a GPX file to `tabellinator --serve=<socket>` and writes what it answers,
+// to try the server out from the shell.
+
+#define MAX_SOURCE_LEN 64 * 1000 * 1000
+
+void print_usage(const char* program) {
+    printf("UTILIZZO: %s <socket> <path/to/file.gpx> [opzioni]\n", program);
+    printf("\n");
+    printf("Opzioni:    --output=<tipo>\n");
+    printf("                        Cosa chiedere al server: csv, json, bin, tex, pdf o\n");
+    printf("                        direct-pdf (predefinito: csv).\n");
+    printf("            --factor=<kms/h>, --start=<hh:mm>, --pauses=<hh:mm>,..., --map\n");
+    printf("                        Come per tabellinator.\n");
+    printf("            -o <file>   Scrive la risposta nel file invece che sull'output.\n");
+    printf("            -h,--help   Stampa il messaggio di aiuto, poi termina.\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* program = *argv;
+    const char* socket_path = NULL;
+    const char* file_path = NULL;
+    const char* out_path = NULL;
+    char header[1024] = {0};
+    size_t header_len = 0;
+
+    while (--argc > 0) {
+        argv++;
+
+        if (strcmp(*argv, "-h") == 0 || strcmp(*argv, "--help") == 0) {
+            print_usage(program);
+            return 0;
+        } else if (strcmp(*argv, "-o") == 0 && argc > 1) {
+            argc--;
+            out_path = *++argv;
+        } else if (strcmp(*argv, "--map") == 0) {
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, "map\n");
+        } else if (strncmp(*argv, "--", 2) == 0 && strchr(*argv, '=') != NULL) {
+            // --<field>=<value> becomes a "<field> <value>" line of the request
+            const char* value = strchr(*argv, '=');
+            header_len += snprintf(header + header_len, sizeof(header) - header_len, "%.*s %s\n", (int) (value - *argv - 2), *argv + 2, value + 1);
+        } else if (socket_path == NULL) {
+            socket_path = *argv;
+        } else if (file_path == NULL) {
+            file_path = *argv;
+        } else {
+            fprintf(stderr, "[ERRORE] Comando non riconosciuto: '%s'.\n", *argv);
+            print_usage(program);
+            return 1;
+        }
+        if (header_len >= sizeof(header)) {
+            fprintf(stderr, "[ERRORE] Troppe opzioni.\n");
+            return 1;
+        }
+    }
+
+    if (socket_path == NULL || file_path == NULL) {
+        fprintf(stderr, "[ERRORE] Non è stato dato alcun socket o file GPX.\n");
+        print_usage(program);
+        return 1;
+    }
+
+    FILE* fp = fopen(file_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "[ERROR] Could not open file `%s`.\n", file_path);
+        return 1;
+    }
+    char* source = malloc(MAX_SOURCE_LEN);
+    const size_t source_size = fread(source, 1, MAX_SOURCE_LEN, fp);
+    fclose(fp);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "[ERROR] Could not connect to `%s`\n", socket_path);
+        return 1;
+    }
+
+    // the server may answer with an error before reading the whole file
+    signal(SIGPIPE, SIG_IGN);
+    FILE* in = fdopen(server, "rb");
+    FILE* to_server = fdopen(dup(server), "wb");
+    fprintf(to_server, "%slength %ld\n\n", header, source_size);
+    fwrite(source, 1, source_size, to_server);
+    fclose(to_server);
+    free(source);
+
+    char status[512] = {0};
+    if (fgets(status, sizeof(status), in) == NULL) {
+        fprintf(stderr, "[ERROR] The server closed the connection without answering\n");
+        return 1;
+    }
+    if (strncmp(status, "OK ", 3) != 0) {
+        fprintf(stderr, "[ERROR] %s", strncmp(status, "ERROR ", 6) == 0 ? status + 6 : status);
+        return 1;
+    }
+
+    FILE* out = out_path != NULL ? fopen(out_path, "wb") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "[ERROR] Could not open file `%s`.\n", out_path);
+        return 1;
+    }
+    const size_t size = strtoull(status + 3, NULL, 10);
+    size_t received = 0, n = 0;
+    char buf[64 * 1024];
+    while (received < size && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+        received += n;
+    }
+    if (out != stdout) fclose(out);
+    fclose(in);
+
+    if (received != size) {
+        fprintf(stderr, "[ERROR] Answer cut short: %ld of %ld bytes\n", received, size);
+        return 1;
+    }
+    return 0;
+}
@@ -2,12 +2,128 @@
 #include <float.h>
 #include <locale.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 
+#ifdef _WIN32
+    #include <direct.h>
+    #include <process.h>
+    #include <sys/utime.h>
+#else
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/file.h>
+    #include <sys/resource.h>
+    #include <sys/socket.h>
+    #include <sys/time.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    #include <utime.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
+
+// Allocations counted for --timings, the XML parser's included. Only the size asked for
+// is known, so the bytes are the ones allocated over the run, not the ones in use.
+uint64_t alloc_count = 0;
+uint64_t alloc_bytes = 0;
+
+void* counted_malloc(const size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return malloc(size);
+}
+
+void* counted_calloc(const size_t n, const size_t size) {
+    alloc_count++;
+    alloc_bytes += n * size;
+    return calloc(n, size);
+}
+
+void* counted_realloc(void* p, const size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return realloc(p, size);
+}
+
+#define malloc(size) counted_malloc(size)
+#define calloc(n, size) counted_calloc(n, size)
+#define realloc(p, size) counted_realloc(p, size)
+
 #include "xml.c"
 
+// The stages of a run timed for --timings. Work done in forked workers (the map sheets
+// of an atlas, the prefetch) only shows in the time of the stage that started them.
+typedef enum {
+    STAGE_LOAD,
+    STAGE_XML_PARSE,
+    STAGE_EXTRACT,
+    STAGE_SEGMENTS,
+    STAGE_LATEX_DOCUMENT,
+    STAGE_MAP,
+    STAGE_MAP_SHEETS,
+    STAGE_MAP_DOWNLOAD,
+    STAGE_MAP_CROP,
+    STAGE_MAP_STITCH,
+    STAGE_COMPILE,
+    STAGES_COUNT,
+} Stage;
+
+const char* stage_names[STAGES_COUNT] = {
+    "load source", "xml parse", "extraction", "segments", "latex document",
+    "map", "map sheets", "map download", "map crop", "map stitch", "xelatex",
+};
+
+typedef struct {
+    uint64_t calls;
+    double seconds;
+    uint64_t allocs, bytes;
+} StageTiming;
+
+typedef struct {
+    double start;
+    uint64_t allocs, bytes;
+} StageMark;
+
+StageTiming stage_timings[STAGES_COUNT] = {0};
+int TIMINGS = 0; // 1 to print the timings at the end of the run, 2 to write them as JSON
+double run_started = 0; // s, monotonic
+
+double monotonic_seconds() {
+#ifndef _WIN32
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+StageMark stage_begin() {
+    return (StageMark) { monotonic_seconds(), alloc_count, alloc_bytes };
+}
+
+// Adds the time and the allocations since `mark` to the stage. Nested stages count
+// in the stage around them too.
+void stage_end(const Stage stage, const StageMark* mark) {
+    StageTiming* timing = &stage_timings[stage];
+    timing->calls++;
+    timing->seconds += monotonic_seconds() - mark->start;
+    timing->allocs += alloc_count - mark->allocs;
+    timing->bytes += alloc_bytes - mark->bytes;
+}
+
 #ifndef M_PI
     #define M_PI 3.14159265358979323846
 #endif
@@ -19,6 +135,22 @@
 #define TILE_WIDTH 17500
 #define TILE_HEIGHT 12000
 
+#define STITCH_CMD_CAP 16 * 1024
+
+#define TILE_METERS_PER_PIXEL 1.25 // full resolution of the sheets
+
+#define CROP_FORMAT_VERSION 2 // bump when the way crops are produced changes
+
+#define HASH_SEED 0xcbf29ce484222325
+
+#ifdef _WIN32
+    #define OPEN_PAREN "("
+    #define CLOSE_PAREN ")"
+#else
+    #define OPEN_PAREN "\\("
+    #define CLOSE_PAREN "\\)"
+#endif
+
 typedef struct {
     double e; // lv95
     double n;
@@ -41,6 +173,16 @@ typedef struct {
 double FACTOR = 5.0; // kms/h
 double ADJUSTMENT_FACTOR = 1.2; // because of too much precision
 uint64_t START_TIME =  0 * 60 + 0; // min
+uint64_t CACHE_SIZE = 1024; // MB, for cropped and stitched maps
+uint64_t TARGET_DPI = 300; // print resolution of the map
+uint64_t JPEG_QUALITY = 85; // of the map embedded in the document
+int RASTER_ROUTE = 0; // draw the route into the map image instead of with TikZ
+int NATIVE_PROFILE = 0; // include the profile as a PDF drawn by the program instead of with TikZ
+uint64_t MEMORY_LIMIT = 1024; // MB, for converting and cropping the map sheets
+uint64_t JOBS = 4; // map sheets and pages prepared in parallel
+uint64_t ATLAS_SCALE = 0; // 1:ATLAS_SCALE pages along the route, 0 to fit the route on one page
+#define ATLAS_SCALE_MIN 1000 // finer than this the sheets are only blown up
+int WATCH = 0; // keep the work of the previous run in memory and tell what is reused
 
 char out_file_path[128] = {0};
 
@@ -48,9 +190,6 @@ char out_file_path[128] = {0};
 char source[MAX_SOURCE_LEN+1] = {0};
 size_t source_size = 0;
 
-char out_tex[MAX_SOURCE_LEN+1] = {0};
-size_t tex_size = 0;
-
 #define MAX_STR_SIZE 128
 char name[MAX_STR_SIZE+1] = {0};
 
@@ -149,6 +288,138 @@ double dsum_return(double asum[2048]) {
     return sum;
 }
 
+// FNV-1a, chained by passing the previous result as `hash`
+uint64_t hash_bytes(uint64_t hash, const void* data, const size_t size) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// A growable buffer the document is assembled in, to write it out in one go.
+typedef struct {
+    char* items;
+    size_t count;
+    size_t capacity;
+} String_Builder;
+
+void sb_reserve(String_Builder* sb, const size_t size) {
+    if (sb->count + size <= sb->capacity) return;
+    size_t capacity = sb->capacity == 0 ? 64 * 1024 : sb->capacity;
+    while (sb->count + size > capacity) capacity *= 2;
+    sb->items = realloc(sb->items, capacity);
+    assert(sb->items != NULL && "Out of memory");
+    sb->capacity = capacity;
+}
+
+void sb_append_buf(String_Builder* sb, const char* buf, const size_t size) {
+    sb_reserve(sb, size);
+    memcpy(sb->items + sb->count, buf, size);
+    sb->count += size;
+}
+
+void sb_append_cstr(String_Builder* sb, const char* cstr) {
+    sb_append_buf(sb, cstr, strlen(cstr));
+}
+
+// printf-style, with the numbers of the table formatted by the locale
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+void sb_appendf(String_Builder* sb, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int size = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    assert(size >= 0);
+
+    // one more for the terminator vsnprintf writes
+    sb_reserve(sb, (size_t) size + 1);
+    va_start(args, fmt);
+    vsnprintf(sb->items + sb->count, (size_t) size + 1, fmt, args);
+    va_end(args);
+    sb->count += (size_t) size;
+}
+
+void sb_append_u64(String_Builder* sb, uint64_t n) {
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    sb_append_buf(sb, digits + sizeof(digits) - len, len);
+}
+
+// `x` with `decimals` digits after the point, like "%.*f" in the C locale: the
+// coordinates of TikZ always take a point, whatever the locale of the table.
+void sb_append_fixed(String_Builder* sb, const double x, const size_t decimals) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    assert(decimals < sizeof(powers) / sizeof(powers[0]));
+
+    const double scaled = round(fabs(x) * powers[decimals]);
+    if (!isfinite(x) || scaled >= 1e18) {
+        sb_appendf(sb, "%.*f", (int) decimals, x);
+        return;
+    }
+
+    if (signbit(x)) sb_append_buf(sb, "-", 1);
+    uint64_t n = (uint64_t) scaled;
+    const uint64_t unit = (uint64_t) powers[decimals];
+    sb_append_u64(sb, n / unit);
+    if (decimals == 0) return;
+
+    char fraction[10] = {0};
+    n %= unit;
+    fraction[0] = '.';
+    for (size_t k = decimals; k > 0; k--) {
+        fraction[k] = '0' + n % 10;
+        n /= 10;
+    }
+    sb_append_buf(sb, fraction, decimals + 1);
+}
+
+// The shortest text of `x` rounded to `decimals` digits: no trailing zeros, and no
+// point when nothing is left after it.
+void sb_append_short(String_Builder* sb, const double x, const size_t decimals) {
+    const size_t start = sb->count;
+    sb_append_fixed(sb, x, decimals);
+    if (decimals == 0 || memchr(sb->items + start, '.', sb->count - start) == NULL) return;
+
+    while (sb->items[sb->count - 1] == '0') sb->count--;
+    if (sb->items[sb->count - 1] == '.') sb->count--;
+    // what rounded to zero has no sign
+    if (sb->count - start == 2 && memcmp(sb->items + start, "-0", 2) == 0) {
+        sb->items[start] = '0';
+        sb->count--;
+    }
+}
+
+#define PLOT_RESOLUTION 0.01 // cm, finer than the pen draws
+
+// How many decimals the coordinates of a picture with units of `unit` cm need
+// to stay within PLOT_RESOLUTION on paper.
+size_t plot_decimals(const double unit) {
+    const double decimals = ceil(log10(unit / PLOT_RESOLUTION) - 1e-9);
+    return decimals < 0.0 ? 0 : (size_t) decimals;
+}
+
+// a TikZ coordinate, "(x, y)"
+void sb_append_point(String_Builder* sb, const double x, const double y, const size_t decimals) {
+    sb_append_buf(sb, "(", 1);
+    sb_append_short(sb, x, decimals);
+    sb_append_buf(sb, ", ", 2);
+    sb_append_short(sb, y, decimals);
+    sb_append_buf(sb, ")", 1);
+}
+
+void sb_free(String_Builder* sb) {
+    free(sb->items);
+    *sb = (String_Builder) {0};
+}
+
 inline static double map(const double n, const double nmin, const double nmax, const double min, const double max) {
     return ((n - nmin) * (max-min))/(nmax-nmin) + min;
 }
@@ -223,6 +494,7 @@ int file_exists(const char *path) {
 }
 
 int load_source(const char* path) {
+    const StageMark mark = stage_begin();
     FILE *fp = fopen(path, "r");
 
     if (fp != NULL) {
@@ -230,6 +502,7 @@ int load_source(const char* path) {
         if (ferror( fp ) != 0) {
             fprintf(stderr, "[ERROR] Could not load source from `%s`.\n", path);
             fclose(fp);
+            stage_end(STAGE_LOAD, &mark);
             return -1;
         } else {
             source[source_size++] = '\0';
@@ -238,8 +511,11 @@ int load_source(const char* path) {
         fclose(fp);
     } else {
         fprintf(stderr, "[ERROR] Could not open file `%s`.\n", path);
+        stage_end(STAGE_LOAD, &mark);
+        return -1;
     }
 
+    stage_end(STAGE_LOAD, &mark);
     return 0;
 }
 
@@ -407,6 +683,7 @@ double calculate_kms(double dst, double dh) {
 }
 
 void calculate_path_segments_data() {
+    const StageMark mark = stage_begin();
     assert(waypoints_len >= 2);
     waypoints[0].idx = 0;
     size_t wp_idx = 1;
@@ -438,9 +715,6 @@ void calculate_path_segments_data() {
             dsum_clear(dst_sum);
             dsum_clear(dh_sum);
             dsum_clear(kms_sum);
-            double time = 60.0 * (ps->kms / (FACTOR * ADJUSTMENT_FACTOR));
-            ps->t = (uint64_t) round(time);
-            (ps+1)->pause = pauses[wp_idx];
 
             waypoints[wp_idx].idx = i;
 
@@ -462,15 +736,32 @@ void calculate_path_segments_data() {
     }
 
     waypoints[waypoints_len-1].idx = path_len-1;
+    stage_end(STAGE_SEGMENTS, &mark);
+}
+
+// The times of the segments from their kms, and the pauses at their start: the only
+// part of the table that changes with the factor and the pauses.
+void calculate_segment_times() {
+    const StageMark mark = stage_begin();
+    for (size_t k = 0; k < segments_len; k++) {
+        PathSegmentData* ps = &segments[k];
+        double time = 60.0 * (ps->kms / (FACTOR * ADJUSTMENT_FACTOR));
+        ps->t = (uint64_t) round(time);
+        ps->pause = k > 0 ? pauses[k] : 0;
+    }
+    stage_end(STAGE_SEGMENTS, &mark);
 }
 
 void parse_gpx(uint8_t* src, const char* file_path) {
+    const StageMark parse_mark = stage_begin();
     struct xml_document* document = xml_parse_document(src, strlen((char*) src));
+    stage_end(STAGE_XML_PARSE, &parse_mark);
     if (!document) {
 		fprintf(stderr, "[ERROR] Could not parse file `%s`.\n", file_path);
 		exit(EXIT_FAILURE);
 	}
 
+    const StageMark mark = stage_begin();
     struct xml_node* root = xml_document_root(document);
 
     size_t children = xml_node_children(root);
@@ -484,18 +775,6 @@ void parse_gpx(uint8_t* src, const char* file_path) {
     // printf("Numero di waypoints: %ld\n", waypoints_len);
     pauses_len = waypoints_len;
 
-    char wp_name[2] = {0};
-    for (size_t i = 1; i < waypoints_len-1; i++) {
-        uint64_t hours = 0, mins = 0;
-        size_t wp_name_len = waypoint_name(i, wp_name);
-
-        printf(" - Pausa al punto '%.*s' (%ld/%ld) [hh:mm]: ", (int) wp_name_len, wp_name, i + 1, waypoints_len);
-        scanf("%zu:%zu", &hours, &mins);
-
-        if ((int64_t) hours >= 0 && (int64_t) mins >= 0)
-            pauses[i] = hours * 60 + mins;
-    }
-
     // Retrieve path
     struct xml_node* track_container = xml_node_child(root, children-1);
     size_t track_container_children = xml_node_children(track_container);
@@ -514,11 +793,47 @@ void parse_gpx(uint8_t* src, const char* file_path) {
     }
     // printf("Path element count: %ld\n", path_len);
 
-    // Calculate distance and difference in altitude between Waypoints
-    // Calculate kms
-    // Calculate time
-    // Set pauses
-    calculate_path_segments_data();
+    // everything needed was copied out, the buffer is `source`
+    xml_document_free(document, false);
+    stage_end(STAGE_EXTRACT, &mark);
+}
+
+void ask_pauses() {
+    char wp_name[2] = {0};
+    for (size_t i = 1; i < waypoints_len-1; i++) {
+        uint64_t hours = 0, mins = 0;
+        size_t wp_name_len = waypoint_name(i, wp_name);
+
+        printf(" - Pausa al punto '%.*s' (%ld/%ld) [hh:mm]: ", (int) wp_name_len, wp_name, i + 1, waypoints_len);
+        scanf("%zu:%zu", &hours, &mins);
+
+        if ((int64_t) hours >= 0 && (int64_t) mins >= 0)
+            pauses[i] = hours * 60 + mins;
+    }
+}
+
+// The pauses at the waypoints between the first and the last one, in order: "h:mm,h:mm,...".
+void parse_pauses(const char* list) {
+    const char* p = list;
+    uint64_t hours = 0, mins = 0;
+    int read = 0;
+    for (size_t i = 1; i < PAUSES_CAPACITY && sscanf(p, "%lu:%lu%n", &hours, &mins, &read) == 2; i++) {
+        pauses[i] = hours * 60 + mins;
+        p += read;
+        if (*p != ',') break;
+        p++;
+    }
+}
+
+// forgets the parsed track, so another file can be parsed
+void reset_track() {
+    memset(name, 0, sizeof(name));
+    waypoints_len = 0;
+    pauses_len = 0;
+    path_len = 0;
+    segments_len = 0;
+    memset(pauses, 0, sizeof(pauses));
+    memset(segments, 0, sizeof(segments));
 }
 
 uint64_t lv95_to_tileid(const uint64_t E, const uint64_t N) {
@@ -537,770 +852,4968 @@ void tileid_coord(const uint64_t id, uint64_t* E, uint64_t* N) { // south west
     // return 1000 + y * 20 + x;
 }
 
+// returns 0 for ids without a sheet
 uint64_t get_year(const uint64_t id) {
-    switch (id) {case 1056:    return 1984;case 1035:    return 1988;case 1282:    return 1992;case 2220:    return 2003;case 1157:    return 2014;case 1159:    return 2014;case 1176:    return 2014;case 1177:    return 2014;case 1178:    return 2014;case 1179:    return 2014;case 1196:    return 2014;case 1197:    return 2014;case 1198:    return 2014;case 1199:    return 2014;case 2180:    return 2014;case 2200:    return 2014;case 1216:    return 2015;case 1217:    return 2015;case 1218:    return 2015;case 1219:    return 2015;case 1236:    return 2015;case 1237:    return 2015;case 1238:    return 2015;case 1239:    return 2015;case 1255:    return 2015;case 1256:    return 2015;case 1257:    return 2015;case 1258:    return 2015;case 1275:    return 2015;case 1276:    return 2015;case 1277:    return 2015;case 1278:    return 2015;case 1295:    return 2015;case 1296:    return 2015;case 1298:    return 2015;case 1318:    return 2015;case 1328:    return 2015;case 1329:    return 2015;case 1348:    return 2015;case 1349:    return 2015;case 1368:    return 2015;case 2240:    return 2015;case 2260:    return 2015;case 1166:    return 2016;case 1167:    return 2016;case 1187:    return 2016;case 1207:    return 2016;case 1213:    return 2016;case 1214:    return 2016;case 1215:    return 2016;case 1227:    return 2016;case 1230:    return 2016;case 1234:    return 2016;case 1235:    return 2016;case 1247:    return 2016;case 1263:    return 2016;case 1266:    return 2016;case 1267:    return 2016;case 1283:    return 2016;case 1286:    return 2016;case 1287:    return 2016;case 1303:    return 2016;case 1306:    return 2016;case 1307:    return 2016;case 1324:    return 2016;case 1325:    return 2016;case 1326:    return 2016;case 1327:    return 2016;case 1344:    return 2016;case 1345:    return 2016;case 1346:    return 2016;case 1347:    return 2016;case 1365:    return 2016;case 1366:    return 2016;case 1064:    return 2017;case 1065:    return 2017;case 1084:    return 2017;case 1085:    return 2017;case 1104:    return 2017;case 1105:    return 2017;case 1288:    return 2017;case 1289:    return 2017;case 1308:    return 2017;case 1309:    return 2017;case 1310:    return 2017;case 1047:    return 2018;case 1066:    return 2018;case 1067:    return 2018;case 1086:    return 2018;case 1087:    return 2018;case 1106:    return 2018;case 1126:    return 2018;case 1127:    return 2018;case 1146:    return 2018;case 1147:    return 2018;case 1208:    return 2018;case 1228:    return 2018;case 1229:    return 2018;case 1248:    return 2018;case 1249:    return 2018;case 1250:    return 2018;case 1268:    return 2018;case 1269:    return 2018;case 1270:    return 2018;case 1290:    return 2018;case 1011:    return 2019;case 1012:    return 2019;case 1031:    return 2019;case 1032:    return 2019;case 1033:    return 2019;case 1034:    return 2019;case 1052:    return 2019;case 1053:    return 2019;case 1054:    return 2019;case 1055:    return 2019;case 1071:    return 2019;case 1072:    return 2019;case 1073:    return 2019;case 1074:    return 2019;case 1075:    return 2019;case 1076:    return 2019;case 1092:    return 2019;case 1093:    return 2019;case 1094:    return 2019;case 1095:    return 2019;case 1096:    return 2019;case 1112:    return 2019;case 1113:    return 2019;case 1114:    return 2019;case 1115:    return 2019;case 1116:    return 2019;case 1132:    return 2019;case 1133:    return 2019;case 1134:    return 2019;case 1135:    return 2019;case 1136:    return 2019;case 1152:    return 2019;case 1153:    return 2019;case 1154:    return 2019;case 1155:    return 2019;case 1156:    return 2019;case 1174:    return 2019;case 1175:    return 2019;case 1194:    return 2019;case 1195:    return 2019;case 1123:    return 2020;case 1124:    return 2020;case 1125:    return 2020;case 1143:    return 2020;case 1144:    return 2020;case 1145:    return 2020;case 1162:    return 2020;case 1163:    return 2020;case 1164:    return 2020;case 1165:    return 2020;case 1182:    return 2020;case 1183:    return 2020;case 1184:    return 2020;case 1185:    return 2020;case 1186:    return 2020;case 1201:    return 2020;case 1202:    return 2020;case 1203:    return 2020;case 1204:    return 2020;case 1205:    return 2020;case 1206:    return 2020;case 1221:    return 2020;case 1222:    return 2020;case 1223:    return 2020;case 1224:    return 2020;case 1225:    return 2020;case 1226:    return 2020;case 1240:    return 2020;case 1241:    return 2020;case 1242:    return 2020;case 1243:    return 2020;case 1244:    return 2020;case 1245:    return 2020;case 1246:    return 2020;case 1260:    return 2020;case 1261:    return 2020;case 1262:    return 2020;case 1264:    return 2020;case 1265:    return 2020;case 1280:    return 2020;case 1281:    return 2020;case 1284:    return 2020;case 1285:    return 2020;case 1300:    return 2020;case 1301:    return 2020;case 1304:    return 2020;case 1305:    return 2020;case 1320:    return 2020;case 1048:    return 2021;case 1049:    return 2021;case 1050:    return 2021;case 1051:    return 2021;case 1068:    return 2021;case 1069:    return 2021;case 1070:    return 2021;case 1088:    return 2021;case 1089:    return 2021;case 1090:    return 2021;case 1091:    return 2021;case 1107:    return 2021;case 1108:    return 2021;case 1109:    return 2021;case 1110:    return 2021;case 1111:    return 2021;case 1128:    return 2021;case 1129:    return 2021;case 1130:    return 2021;case 1131:    return 2021;case 1148:    return 2021;case 1149:    return 2021;case 1150:    return 2021;case 1151:    return 2021;case 1168:    return 2021;case 1169:    return 2021;case 1170:    return 2021;case 1171:    return 2021;case 1172:    return 2021;case 1173:    return 2021;case 1188:    return 2021;case 1189:    return 2021;case 1190:    return 2021;case 1191:    return 2021;case 1192:    return 2021;case 1193:    return 2021;case 1209:    return 2021;case 1210:    return 2021;case 1211:    return 2021;case 1212:    return 2021;case 1231:    return 2021;case 1232:    return 2021;case 1233:    return 2021;case 1251:    return 2021;case 1252:    return 2021;case 1253:    return 2021;case 1254:    return 2021;case 1271:    return 2021;case 1272:    return 2021;case 1273:    return 2021;case 1274:    return 2021;case 1291:    return 2021;case 1292:    return 2021;case 1293:    return 2021;case 1294:    return 2021;case 1311:    return 2021;case 1312:    return 2021;case 1313:    return 2021;case 1314:    return 2021;case 1332:    return 2021;case 1333:    return 2021;case 1334:    return 2021;case 1352:    return 2021;case 1353:    return 2021;case 1354:    return 2021;case 1373:    return 2021;case 1374:    return 2021;default:    assert(0 && "unreachable");}
+    switch (id) {case 1056:    return 1984;case 1035:    return 1988;case 1282:    return 1992;case 2220:    return 2003;case 1157:    return 2014;case 1159:    return 2014;case 1176:    return 2014;case 1177:    return 2014;case 1178:    return 2014;case 1179:    return 2014;case 1196:    return 2014;case 1197:    return 2014;case 1198:    return 2014;case 1199:    return 2014;case 2180:    return 2014;case 2200:    return 2014;case 1216:    return 2015;case 1217:    return 2015;case 1218:    return 2015;case 1219:    return 2015;case 1236:    return 2015;case 1237:    return 2015;case 1238:    return 2015;case 1239:    return 2015;case 1255:    return 2015;case 1256:    return 2015;case 1257:    return 2015;case 1258:    return 2015;case 1275:    return 2015;case 1276:    return 2015;case 1277:    return 2015;case 1278:    return 2015;case 1295:    return 2015;case 1296:    return 2015;case 1298:    return 2015;case 1318:    return 2015;case 1328:    return 2015;case 1329:    return 2015;case 1348:    return 2015;case 1349:    return 2015;case 1368:    return 2015;case 2240:    return 2015;case 2260:    return 2015;case 1166:    return 2016;case 1167:    return 2016;case 1187:    return 2016;case 1207:    return 2016;case 1213:    return 2016;case 1214:    return 2016;case 1215:    return 2016;case 1227:    return 2016;case 1230:    return 2016;case 1234:    return 2016;case 1235:    return 2016;case 1247:    return 2016;case 1263:    return 2016;case 1266:    return 2016;case 1267:    return 2016;case 1283:    return 2016;case 1286:    return 2016;case 1287:    return 2016;case 1303:    return 2016;case 1306:    return 2016;case 1307:    return 2016;case 1324:    return 2016;case 1325:    return 2016;case 1326:    return 2016;case 1327:    return 2016;case 1344:    return 2016;case 1345:    return 2016;case 1346:    return 2016;case 1347:    return 2016;case 1365:    return 2016;case 1366:    return 2016;case 1064:    return 2017;case 1065:    return 2017;case 1084:    return 2017;case 1085:    return 2017;case 1104:    return 2017;case 1105:    return 2017;case 1288:    return 2017;case 1289:    return 2017;case 1308:    return 2017;case 1309:    return 2017;case 1310:    return 2017;case 1047:    return 2018;case 1066:    return 2018;case 1067:    return 2018;case 1086:    return 2018;case 1087:    return 2018;case 1106:    return 2018;case 1126:    return 2018;case 1127:    return 2018;case 1146:    return 2018;case 1147:    return 2018;case 1208:    return 2018;case 1228:    return 2018;case 1229:    return 2018;case 1248:    return 2018;case 1249:    return 2018;case 1250:    return 2018;case 1268:    return 2018;case 1269:    return 2018;case 1270:    return 2018;case 1290:    return 2018;case 1011:    return 2019;case 1012:    return 2019;case 1031:    return 2019;case 1032:    return 2019;case 1033:    return 2019;case 1034:    return 2019;case 1052:    return 2019;case 1053:    return 2019;case 1054:    return 2019;case 1055:    return 2019;case 1071:    return 2019;case 1072:    return 2019;case 1073:    return 2019;case 1074:    return 2019;case 1075:    return 2019;case 1076:    return 2019;case 1092:    return 2019;case 1093:    return 2019;case 1094:    return 2019;case 1095:    return 2019;case 1096:    return 2019;case 1112:    return 2019;case 1113:    return 2019;case 1114:    return 2019;case 1115:    return 2019;case 1116:    return 2019;case 1132:    return 2019;case 1133:    return 2019;case 1134:    return 2019;case 1135:    return 2019;case 1136:    return 2019;case 1152:    return 2019;case 1153:    return 2019;case 1154:    return 2019;case 1155:    return 2019;case 1156:    return 2019;case 1174:    return 2019;case 1175:    return 2019;case 1194:    return 2019;case 1195:    return 2019;case 1123:    return 2020;case 1124:    return 2020;case 1125:    return 2020;case 1143:    return 2020;case 1144:    return 2020;case 1145:    return 2020;case 1162:    return 2020;case 1163:    return 2020;case 1164:    return 2020;case 1165:    return 2020;case 1182:    return 2020;case 1183:    return 2020;case 1184:    return 2020;case 1185:    return 2020;case 1186:    return 2020;case 1201:    return 2020;case 1202:    return 2020;case 1203:    return 2020;case 1204:    return 2020;case 1205:    return 2020;case 1206:    return 2020;case 1221:    return 2020;case 1222:    return 2020;case 1223:    return 2020;case 1224:    return 2020;case 1225:    return 2020;case 1226:    return 2020;case 1240:    return 2020;case 1241:    return 2020;case 1242:    return 2020;case 1243:    return 2020;case 1244:    return 2020;case 1245:    return 2020;case 1246:    return 2020;case 1260:    return 2020;case 1261:    return 2020;case 1262:    return 2020;case 1264:    return 2020;case 1265:    return 2020;case 1280:    return 2020;case 1281:    return 2020;case 1284:    return 2020;case 1285:    return 2020;case 1300:    return 2020;case 1301:    return 2020;case 1304:    return 2020;case 1305:    return 2020;case 1320:    return 2020;case 1048:    return 2021;case 1049:    return 2021;case 1050:    return 2021;case 1051:    return 2021;case 1068:    return 2021;case 1069:    return 2021;case 1070:    return 2021;case 1088:    return 2021;case 1089:    return 2021;case 1090:    return 2021;case 1091:    return 2021;case 1107:    return 2021;case 1108:    return 2021;case 1109:    return 2021;case 1110:    return 2021;case 1111:    return 2021;case 1128:    return 2021;case 1129:    return 2021;case 1130:    return 2021;case 1131:    return 2021;case 1148:    return 2021;case 1149:    return 2021;case 1150:    return 2021;case 1151:    return 2021;case 1168:    return 2021;case 1169:    return 2021;case 1170:    return 2021;case 1171:    return 2021;case 1172:    return 2021;case 1173:    return 2021;case 1188:    return 2021;case 1189:    return 2021;case 1190:    return 2021;case 1191:    return 2021;case 1192:    return 2021;case 1193:    return 2021;case 1209:    return 2021;case 1210:    return 2021;case 1211:    return 2021;case 1212:    return 2021;case 1231:    return 2021;case 1232:    return 2021;case 1233:    return 2021;case 1251:    return 2021;case 1252:    return 2021;case 1253:    return 2021;case 1254:    return 2021;case 1271:    return 2021;case 1272:    return 2021;case 1273:    return 2021;case 1274:    return 2021;case 1291:    return 2021;case 1292:    return 2021;case 1293:    return 2021;case 1294:    return 2021;case 1311:    return 2021;case 1312:    return 2021;case 1313:    return 2021;case 1314:    return 2021;case 1332:    return 2021;case 1333:    return 2021;case 1334:    return 2021;case 1352:    return 2021;case 1353:    return 2021;case 1354:    return 2021;case 1373:    return 2021;case 1374:    return 2021;default:    return 0;}
 }
 
-// UNFINISHED
-void print_map(FILE* sink) {
-    fprintf(sink, "\n");
-    fprintf(sink, "\\pagebreak\n");
-    fprintf(sink, "\n");
-
-    fprintf(sink, "    \\begin{center}\n");
-    fprintf(sink, "        \\textsc{\\Large %s}\n", name);
-    fprintf(sink, "\n");
-    fprintf(sink, "        \\vspace{0.5ex}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "\\textsc{\\small Carta topografica}\n");
-    fprintf(sink, "    \\end{center}\n");
+#define CACHE_DIR "tabellinator-cache"
 
-    fprintf(sink, "\n");
-    fprintf(sink, "\\vspace{2ex}\n");
-    fprintf(sink, "\n");
+#define COG_HEADER_SIZE (64 * 1024)
+#define COG_HEADER_MAX_SIZE (16 * 1024 * 1024)
+#define COG_MERGE_GAP (64 * 1024)
+#define COG_MAX_IFDS 8
+#define COG_MAX_ENTRIES 32
 
-    {
-        uint64_t minE = 1000000000, maxE = 0, minN = 1000000000, maxN = 0;
-        uint64_t E = 0, N = 0;
-        for (size_t i = 0; i < path_len; i++) {
-            E = path[i].e;
-            N = path[i].n;
-            if (E < minE) minE = E;
-            if (E > maxE) maxE = E;
-            if (N < minN) minN = N;
-            if (N > maxN) maxN = N;
-        }
-
-        uint64_t width = (maxE - minE);
-        uint64_t height = (maxN - minN);
-
-
-        uint64_t new_height = height, new_width = width;
-        const double rel_width = 34.6;
-        const double rel_height = 21.75;
-        const double rel_ratio = rel_width / rel_height;
-        if (width > height) {
-            if((double) width / (double) height > rel_ratio) {
-                new_height = width * rel_height / rel_width;
-                minN -= (new_height - height)/2;
-                maxN += (new_height - height)/2;
-            } else if ((double) width / (double) height < rel_ratio) {
-                new_width = height * rel_width / rel_height;
-                minE -= (new_width - width) /2;
-                maxE += (new_width - width)/2;
-            }
-        } else {
-            if((double) height / (double) width > rel_ratio) {
-                new_width = height * rel_height / rel_width;
-                minE -= (new_width - width) / 2;
-                maxE += (new_width - width) / 2;
-            } else if ((double) height / (double) width < rel_ratio) {
-                new_height = width * rel_width / rel_height;
-                minN -= (new_height - height) / 2;
-                maxN += (new_height - height) / 2;
-            }
-        }
+#define DOWNLOAD_ATTEMPTS 5
 
-        width = new_width;
-        height = new_height;
+// keeps the pixel cache of magick within MEMORY_LIMIT, it spills to disk beyond it
+#define MAGICK "magick -limit memory %ldMiB -limit map %ldMiB"
+#define MAGICK_LIMITS MEMORY_LIMIT / 2, MEMORY_LIMIT / 2
 
-        width = width * 12 / 10;
-        height = height * 12 / 10;
+#define LANCZOS_SUPPORT 3.0
 
-        minE -= width / 12;
-        maxE += width / 12;
-        minN -= height / 12;
-        maxN += height / 12;
+#ifdef _WIN32
+    #define PIPE_READ "rb"
+    #define PIPE_WRITE "wb"
+#else
+    #define PIPE_READ "r"
+    #define PIPE_WRITE "w"
+#endif
 
-        // printf("MIN %ld %ld\n", minE, minN);
-        // printf("MAX %ld %ld\n", maxE, maxN);
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint8_t value[4]; // inline value or offset, in file byte order
+} TiffEntry;
 
-        // double scalex = (double) TILE_WIDTH / (double) width;
-        // double scaley = (double) TILE_HEIGHT / (double) height;
+typedef struct {
+    uint32_t width, height;
+    uint32_t tile_width, tile_height;
+    uint32_t tiles_across, tiles_down;
+    TiffEntry* tile_offsets;
+    TiffEntry* tile_byte_counts;
+    TiffEntry entries[COG_MAX_ENTRIES];
+    size_t entries_len;
+} CogIfd;
+
+// Header and directories of a remote Cloud Optimized GeoTIFF. Only the leading
+// bytes of the file (where a COG keeps all of its IFDs) are ever downloaded.
+typedef struct {
+    uint64_t id;
+    int big_endian;
+    uint8_t* header;
+    size_t header_size;
+    CogIfd ifds[COG_MAX_IFDS];
+    size_t ifds_len;
+} Cog;
 
-        // double scale = (scalex < scaley ? scalex : scaley);
-        // if (scale < 1.0) {
-        //     scale = 1.0;
-        // }
+typedef struct {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t size;
+} CogTile;
 
-        const double cell_size = 0.8;
-        fprintf(sink, "\\begin{center}\n\\begin{tikzpicture}[x=%lfcm,y=%lfcm, step=%lfcm", cell_size, cell_size, cell_size);
-        if (height > width) {
-            fprintf(sink, ", rotate=270, transform shape");
-        }
-        fprintf(sink, "] \n");
+void make_dir(const char* path) {
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+}
 
-        double max_size = 0.0;
-        if (height < width) {
-            max_size = (double) rel_height;
-            if (max_size / height * width > (double) rel_width) {
-                max_size = rel_width / width * height;
-            }
-        } else {
-            max_size = (double) rel_width;
-            if (max_size / height * width > (double) rel_height) {
-                max_size = (double) rel_width / width * height;
-            }
-        }
+size_t file_size(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    return (size_t) st.st_size;
+}
 
-        double scale = (double) height / (max_size * cell_size * 0.01);
-        printf("Map scale: 1:%ld\n", (uint64_t) round(scale));
-        // fprintf(sink, "\\draw[very thin,color=black!10] (0.0,0.0) grid (%.1lf,-%.1lf);\n", 30.0+0.5, 20.0+0.5);
+// marks a cached file as recently used
+void cache_touch(const char* path) {
+    utime(path, NULL);
+}
 
-        const uint64_t dimension = width > height ? width : height;
-        double resolution_kinda = round(log2((double)dimension / TILE_WIDTH + 1.0));
-        resolution_kinda = resolution_kinda < 0.0 ? 0.0 : resolution_kinda;
+// Writes the name under which `path` is written before it is moved in place,
+// `<path>.<pid>.part`: processes making the same file at once (the workers of --serve,
+// the jobs of an atlas) each write their own, and the last rename wins.
+void part_name(char* part_path, const size_t part_path_size, const char* path) {
+    snprintf(part_path, part_path_size, "%s.%d.part", path, (int) getpid());
+}
 
-        uint64_t resolution_id = (uint64_t) resolution_kinda < 5 ? (uint64_t) resolution_kinda : 5;
+// moves the part of `path` in place, so a file is either complete or missing
+int rename_part(const char* path) {
+    char part_path[272] = {0};
+    part_name(part_path, 272, path);
+    if (rename(part_path, path) != 0) {
+        remove(part_path);
+        return -1;
+    }
+    return 0;
+}
 
-        uint64_t full_image_size_x = 0, full_image_size_y = 0;
+typedef struct {
+    char path[256];
+    size_t size;
+    time_t mtime;
+} CacheEntry;
+
+int cache_entry_cmp(const void* a, const void* b) {
+    const CacheEntry* ea = a;
+    const CacheEntry* eb = b;
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
 
-        switch (resolution_id)
-        {
-        case 0:
-            full_image_size_x = 14000;
-            full_image_size_y = 9600;
-            break;
-        case 1:
-            full_image_size_x = 7000;
-            full_image_size_y = 4800;
-            break;
-        case 2:
-            full_image_size_x = 3500;
-            full_image_size_y = 2400;
-            break;
-        case 3:
-            full_image_size_x = 1750;
-            full_image_size_y = 1200;
-            break;
-        case 4:
-            full_image_size_x = 875;
-            full_image_size_y = 600;
-            break;
-        case 5:
-            full_image_size_x = 438;
-            full_image_size_y = 300;
-            break;
-        default:
-            assert(0 && "Unreacheable");
-            break;
+// Removes the least recently used files of `dir` until it fits in CACHE_SIZE.
+// Files used since `keep_since` are never removed.
+void cache_gc(const char* dir, const time_t keep_since) {
+#ifndef _WIN32
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+
+    size_t entries_len = 0, entries_cap = 64;
+    CacheEntry* entries = malloc(entries_cap * sizeof(CacheEntry));
+    size_t total = 0;
+
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        if (entries_len == entries_cap) {
+            entries_cap *= 2;
+            entries = realloc(entries, entries_cap * sizeof(CacheEntry));
         }
+        CacheEntry* entry = &entries[entries_len];
+        snprintf(entry->path, 256, "%.64s/%.180s", dir, ent->d_name);
+
+        struct stat st;
+        if (stat(entry->path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        total += entry->size;
+        entries_len++;
+    }
+    closedir(d);
+
+    qsort(entries, entries_len, sizeof(CacheEntry), cache_entry_cmp);
+    const size_t cap = CACHE_SIZE * 1024 * 1024;
+    size_t removed = 0;
+    for (size_t i = 0; i < entries_len && total > cap && entries[i].mtime < keep_since; i++) {
+        if (remove(entries[i].path) == 0) {
+            total -= entries[i].size;
+            removed++;
+        }
+    }
+    if (removed > 0) printf("[INFO] Removed %ld old files from `%s`\n", removed, dir);
 
-        printf("[INFO] Chosen resolution: %ld (%ldx%ldpx)\n", resolution_id, full_image_size_x, full_image_size_y);
-
-        size_t t = time(NULL);
-
-        size_t checked_ids_size = 0;
-        uint64_t checked_ids[32] = {0};
-        size_t frame_id = 0;
-
-        const uint64_t min_dimension = width < height ? width : height;
-        uint64_t step = min_dimension / 32;
-        step = step < 100 ? step : 100;
+    free(entries);
+#else
+    (void) dir;
+    (void) keep_since;
+#endif
+}
 
-        for (uint64_t e = minE; e <= maxE; e += step) {
-            for (uint64_t n = maxN; n >= minN; n -= step) {
-                uint64_t id = lv95_to_tileid(e, n);
-                uint64_t e2 = 0, n2 = 0;
-                tileid_coord(id, &e2, &n2);
-                // printf("%ld %ld -> %ld %ld\n", e, n, e2, n2);
-                // printf("    %ld %ld -> %ld %ld\n", e - e2, n - n2, TILE_WIDTH, TILE_HEIGHT);
-                // printf("    %ld %ld\n", id, lv95_to_tileid(e2+1, n2+1));
+// The parsed track is kept next to the GPX file as `<file>.trk`, so that later runs on
+// the same file skip reading and parsing the XML: a header, then the LV95 coordinates
+// and altitudes of the path and of the waypoints, each as a column of doubles in the
+// byte order of the machine. The file is trusted when the GPX has the size and the
+// modification time it had when it was written; with another time only if the hash
+// of the GPX still matches.
+#define TRACK_MAGIC "TBLTRACK"
+#define TRACK_FORMAT_VERSION 1 // bump when the layout or the parsing changes
 
-                int checked = 0;
-                for (size_t i = 0; i < checked_ids_size; i++) {
-                    if (checked_ids[i] == id) checked = 1;
-                }
-                if (checked) continue;
-                checked_ids[checked_ids_size++] = id;
-
-                char tiff_file[16] = {0};
-                char jpg_file[16] = {0};
-                char map_file[24] = {0};
-                snprintf(tiff_file, 15, "%ld.tif", id);
-                snprintf(jpg_file, 15, "%ld-%ld.jpg", id, resolution_id);
-                snprintf(map_file, 24, "map-%ld-%05ld.jpg", id, t%100000);
-
-                uint64_t year = get_year(id);
-
-                if (!file_exists(tiff_file)) {
-                    char get_url_cmd[256] = {0};
-                    snprintf(get_url_cmd, 255, "curl https://data.geo.admin.ch/ch.swisstopo.pixelkarte-farbe-pk25.noscale/swiss-map-raster25_%ld_%ld/swiss-map-raster25_%ld_%ld_krel_1.25_2056.tif > %s"
-    #ifdef _WIN32
-                        " > nul"
-    #else
-                        " 2> /dev/null"
-    #endif
-                    , year, id, year, id, tiff_file);
-                    printf("[INFO] Donwloading map [id=%ld]... ", id);
-                    fflush(stdout);
-                    system(get_url_cmd);
-                    printf("done!\n");
-                }
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_size; // bytes
+    int64_t source_mtime; // ns
+    uint64_t source_hash; // of `source` as loaded
+    uint64_t path_len;
+    uint64_t waypoints_len;
+    char name[136]; // room for `name`, padded to 8 bytes
+} TrackHeader;
+
+#ifndef _WIN32
+// to the nanosecond, an edit in the same second as the last one changes it too
+int64_t stat_mtime(const struct stat* st) {
+#ifdef __APPLE__
+    return (int64_t) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+#endif
 
-                if (!file_exists(jpg_file)) {
-
-                    char convert_cmd[256] = {0};
-                    snprintf(convert_cmd, 255, "magick %s %.*s.jpg"
-    #ifdef _WIN32
-                        " > nul"
-    #else
-                        " 2> /dev/null"
-    #endif
-                    , tiff_file, (int) strlen(tiff_file)-4, tiff_file);
-                    printf("[INFO] Converting map  [id=%ld]... ", id);
-                    fflush(stdout);
-                    system(convert_cmd);
-                    printf("done!\n");
-                }
+void track_file(const char* gpx_path, char* path, const size_t path_size) {
+    snprintf(path, path_size, "%.*s.trk", (int) strlen(gpx_path)-4, gpx_path);
+}
 
-                // get the coordinates contained in the map
-                int64_t mapMinE = 0, mapMinN = 0;
-                int64_t mapMaxE = 0, mapMaxN = 0;
-
-                tileid_coord(id, (uint64_t*) &mapMinE, (uint64_t*) &mapMinN);
-                mapMaxE = mapMinE + TILE_WIDTH;
-                mapMaxN = mapMinN + TILE_HEIGHT;
-                // printf("MAP: %ld %ld %ld %ld\n", mapMinE, mapMinN, mapMaxE, mapMaxN);
-                // printf("MINIMAP: %ld %ld %ld %ld\n", minE, minN, maxE, maxN);
-
-                int64_t min_contained_E = 0, min_contained_N = 0;
-                int64_t max_contained_E = 0, max_contained_N = 0;
-
-                min_contained_E = mapMinE > (int64_t) minE ? (int64_t) mapMinE : (int64_t) minE;
-                max_contained_E = mapMaxE < (int64_t) maxE ? (int64_t) mapMaxE : (int64_t) maxE;
-                min_contained_N = mapMinN > (int64_t) minN ? (int64_t) mapMinN : (int64_t) minN;
-                max_contained_N = mapMaxN < (int64_t) maxN ? (int64_t) mapMaxN : (int64_t) maxN;
-                // printf("MIN MIN / MAX MAX: %ld %ld %ld %ld\n", mapMinE, mapMinN, mapMaxE, mapMaxN);
-                // printf("MIN MIN / MAX MAX: %ld %ld %ld %ld\n", min_contained_E, min_contained_N, max_contained_E, max_contained_N);
-
-                // get the size of the cropped image in pixels
-                double cropped_map_width = (double) (max_contained_E - min_contained_E) / (double) TILE_WIDTH;
-                double cropped_map_height = (double) (max_contained_N - min_contained_N) /  (double) TILE_HEIGHT;
-                uint64_t cropped_image_width =  (uint64_t) ((double) full_image_size_x * cropped_map_width);
-                uint64_t cropped_image_height = (uint64_t) ((double) full_image_size_y * cropped_map_height);
-                // printf("WIDTH / HEIGHT: %ld %ld\n", cropped_image_width, cropped_image_height);
-
-                if (cropped_image_width == 0 || cropped_image_height == 0) continue;
-
-                // get the offset from the center of the image
-                double coord_offset_x = (double) (min_contained_E - mapMinE) / (double) TILE_WIDTH;
-                double coord_offset_y = (double) (mapMaxN - max_contained_N) / (double) TILE_HEIGHT;
-                // printf("COORD OFFSETS: %f %f\n", coord_offset_x * TILE_WIDTH, coord_offset_y * TILE_HEIGHT);
-                
-                int64_t pixel_offset_x = (int64_t) (coord_offset_x * (double)full_image_size_x);
-                int64_t pixel_offset_y = (int64_t)  (coord_offset_y * (double)full_image_size_y);
-                // printf("PX OFFSETS: %ld %ld\n", pixel_offset_x, pixel_offset_y);
-                // printf("\n");
-
-                //construct command
-                char crop_cmd[256] = {0};
-                snprintf(crop_cmd, 256, "magick %s -crop %ldx%ld%+ld%+ld %s", jpg_file, cropped_image_width, cropped_image_height, pixel_offset_x, pixel_offset_y, map_file);
-                // printf("[CROP] %s\n", crop_cmd);
-                printf("[INFO] Cropping map    [id=%ld]... ", id);
-                fflush(stdout);
-                system(crop_cmd);
-                printf("done!\n");
-                // call command
-
-                // assert images are only one
-                // put image in latex
-
-                // find coordinates in page
-                uint64_t center_N = (max_contained_N + min_contained_N) / 2;
-                uint64_t center_E = (max_contained_E + min_contained_E) / 2;
-                // double ax = ((min_contained_E - (double) minE) / (double) height) * 20.0;
-                // double ay = (((double) maxN - max_contained_N) / (double) height) * 20.0;
-                // double bx = ((max_contained_E - (double) minE) / (double) height) * 20.0;
-                // double by = (((double) maxN - min_contained_N) / (double) height) * 20.0;
-                // printf("1: %lf %lf %lf %lf", (double) minE, (double) minE+height, 0.0, max_size);
-                double x = map(center_E, minE, minE + height, 0.0, max_size);
-                double y = map(center_N, maxN, minN, 0.0, max_size);
-
-                // find dimensions
-                double w = (((double) (max_contained_E - min_contained_E) / (double) height)) * cell_size * max_size;
-                double h = (((double) (max_contained_N - min_contained_N) / (double) height)) * cell_size * max_size;
-                
-                fprintf(sink, "\\node[inner sep=0pt] (russel) at (%lf, -%lf) {\\includegraphics[width=%lfcm, height=%lfcm]{%s}};\n", x, y, w, h, map_file);
-                // fprintf(sink, "\\filldraw[black] (%lf, -%lf) circle (2pt) node[anchor=south west]{%s};\n", x, y, map_file);
-
-                frame_id += 1;
-
-                // draw path
-                // draw waypoints
-
-                // printf("%s\n", url);
+// Writes the track just parsed from `gpx_path`.
+void track_store(const char* gpx_path, const uint64_t source_hash) {
+#ifndef _WIN32
+    struct stat st;
+    if (stat(gpx_path, &st) != 0) return;
+
+    TrackHeader header = {0};
+    memcpy(header.magic, TRACK_MAGIC, 8);
+    header.version = TRACK_FORMAT_VERSION;
+    header.header_size = sizeof(TrackHeader);
+    header.source_size = (uint64_t) st.st_size;
+    header.source_mtime = stat_mtime(&st);
+    header.source_hash = source_hash;
+    header.path_len = path_len;
+    header.waypoints_len = waypoints_len;
+    memcpy(header.name, name, sizeof(name));
+
+    char track_path[256] = {0}, part_path[272] = {0};
+    track_file(gpx_path, track_path, 256);
+    part_name(part_path, 272, track_path);
+    FILE* fp = fopen(part_path, "wb");
+    if (fp == NULL) return;
+    fwrite(&header, sizeof(header), 1, fp);
+    const Point* sets[] = { path, waypoints };
+    const size_t lens[] = { path_len, waypoints_len };
+    for (size_t set = 0; set < 2; set++) {
+        for (size_t column = 0; column < 3; column++) {
+            for (size_t i = 0; i < lens[set]; i++) {
+                const Point* p = &sets[set][i];
+                const double x = column == 0 ? p->e : column == 1 ? p->n : p->ele;
+                fwrite(&x, sizeof(x), 1, fp);
             }
         }
+    }
+    const int failed = ferror(fp);
+    fclose(fp);
+    if (failed || rename_part(track_path) != 0) remove(part_path);
+#else
+    (void) gpx_path;
+    (void) source_hash;
+#endif
+}
 
-        fprintf(sink, "\\begin{scope}[transparency group, opacity=0.50]\n");
+// Loads the track of `gpx_path` from its `.trk` file if that is still valid, and
+// gives the hash of the GPX file it was made from. Returns 1 if it did.
+int track_load(const char* gpx_path, uint64_t* source_hash) {
+#ifndef _WIN32
+    struct stat gpx_st, st;
+    char track_path[256] = {0};
+    track_file(gpx_path, track_path, 256);
+    if (stat(gpx_path, &gpx_st) != 0) return 0;
+    const int fd = open(track_path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TrackHeader)) {
+        close(fd);
+        return 0;
+    }
+    const uint8_t* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    const TrackHeader* header = (const TrackHeader*) data;
+    int valid = memcmp(header->magic, TRACK_MAGIC, 8) == 0
+        && header->version == TRACK_FORMAT_VERSION
+        && header->header_size == sizeof(TrackHeader)
+        && header->path_len <= PATH_CAPACITY
+        && header->waypoints_len <= WAYPOINTS_CAPACITY
+        && (size_t) st.st_size == sizeof(TrackHeader) + 3 * sizeof(double) * (header->path_len + header->waypoints_len)
+        && header->source_size == (uint64_t) gpx_st.st_size;
+    const int touched = header->source_mtime != stat_mtime(&gpx_st);
+    if (valid && touched) {
+        // the same size with another time: only the content can tell
+        valid = load_source(gpx_path) == 0 && hash_bytes(HASH_SEED, source, source_size) == header->source_hash;
+        printf("[INFO] `%s` was modified, %s the parsed track\n", gpx_path, valid ? "but still matches" : "discarding");
+    }
 
-        fprintf(sink, "\\draw[red, line width=1.5pt] plot[smooth] coordinates{");
-        // printf("2: %lf %lf %lf %lf", (double) minE, (double) minE+height, 0.0, max_size);
-        size_t index_step = max(path_len / GRAPH_POINTS_COUNT, 1);
-        for (size_t i = 0; i < path_len; i ++) {
-            if (i % index_step == 0 || i == path_len - 1)
-                fprintf(sink, "(%lf, %lf) ",
-                    map(path[i].e, minE, minE+height, 0.0, max_size),
-                    map(path[i].n, maxN, minN, 0.0, -max_size));
+    if (valid) {
+        *source_hash = header->source_hash;
+        memcpy(name, header->name, sizeof(name) - 1);
+        path_len = header->path_len;
+        waypoints_len = header->waypoints_len;
+        pauses_len = waypoints_len;
+        const double* columns = (const double*) (data + sizeof(TrackHeader));
+        for (size_t i = 0; i < path_len; i++) {
+            path[i] = (Point) { columns[i], columns[path_len + i], columns[2 * path_len + i], 0 };
         }
-        fprintf(sink, "};\n");
+        columns += 3 * path_len;
         for (size_t i = 0; i < waypoints_len; i++) {
-            fprintf(sink, "\\filldraw[red] (%lf,%lf) circle (2.25pt);\n",
-                map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-                map(waypoints[i].n, maxN, minN, 0.0, -max_size));
-
+            waypoints[i] = (Point) { columns[i], columns[waypoints_len + i], columns[2 * waypoints_len + i], 0 };
         }
+        printf("[INFO] Track read from `%s`\n", track_path);
+    }
+    munmap((void*) data, (size_t) st.st_size);
 
-        fprintf(sink, "\\end{scope}\n");
+    // written again with the new time, so the next run needs no hash
+    if (valid && touched) track_store(gpx_path, *source_hash);
+    return valid;
+#else
+    (void) gpx_path;
+    (void) source_hash;
+    return 0;
+#endif
+}
 
-        // fprintf(sink, "\\begin{scope}[transparency group, opacity=1.0]\n");
+// The track of `gpx_path`, from its `.trk` file or parsed from the GPX file.
+int load_track(const char* gpx_path, uint64_t* source_hash) {
+    if (track_load(gpx_path, source_hash)) return 0;
+    if (load_source(gpx_path) != 0) return -1;
+    *source_hash = hash_bytes(HASH_SEED, source, source_size);
+    parse_gpx(fix_source((uint8_t*) source+1), gpx_path);
+    track_store(gpx_path, *source_hash);
+    return 0;
+}
 
-        char wp_name[2] = {0};
-        for (size_t i = 0; i < waypoints_len; i++) {
-            size_t wp_name_len = waypoint_name(i, wp_name);
-            // printf("%.*s (%ld/%ld)\n", 2, wp_name, waypoints[i].idx, path_len);
-            // TODO: anchor based on path (calculate the angle before and angle after, take average, opposite shall be the letter)
-
-            const int64_t step = 1;
-            const int64_t max_samples = 25;
-            
-            Vec2d direction_vec = {0};
-            char* direction_str = NULL;
-            Vec2d forward_vec = {0};
-            Vec2d backward_vec = {0};
-            
-            size_t path_idx = waypoints[i].idx;
-            // printf("WAYPOINT PATH IDX: %ld\n", waypoints[i].idx);
-
-            uint64_t x = waypoints[i].e, y = waypoints[i].n;
-            double sum_x = 0.0, sum_y = 0.0;
-            int64_t n = 0, count = 0;
-            for (int64_t j = path_idx-1; j > (int64_t) path_idx - step * max_samples && j >= 0; j--) {
-                // printf("    (%ld) %lf %lf\n", j, sum_x, sum_y);
-                sum_x += (path[j].e - x) * (max_samples - n + 1);
-                sum_y += (path[j].n - y) * (max_samples - n + 1);
-                n ++;
-                count += max_samples - count + 1;
-            }
-            // printf("BACKWARD COUNT: %ld\n", count);
-            count = count <= 0 ? 1 : count;
-            backward_vec = (Vec2d) {
-                sum_x / (double) count, sum_y / (double) count
-            };
-            backward_vec = vec2d_normalized(backward_vec);
-            // printf("BACKWARD %lf %lf\n", backward_vec.x, backward_vec.y);
-
-            sum_x = 0.0; sum_y = 0.0; count = 0; n = 0;
-            for (int64_t j = path_idx+1; j < path_idx + step * max_samples && j < path_len; j++) {
-                sum_x += (path[j].e - x) * (max_samples - n + 1);
-                sum_y += (path[j].n - y) * (max_samples - n + 1);
-                n ++;
-                count += max_samples - count + 1;
-            }
-            // printf("FORWARD COUNT: %ld\n", count);
-            count = count <= 0 ? 1 : count;
-            forward_vec = (Vec2d) {
-                sum_x / (double) count, sum_y / (double) count
-            };
-            forward_vec = vec2d_normalized(forward_vec);
-            // printf("FORWARD %lf %lf\n", forward_vec.x, forward_vec.y);
+// Runs `job(0)` ... `job(jobs_len-1)` in at most `workers` processes at once,
+// returns the number of failed jobs.
+size_t parallel_run(const size_t jobs_len, int (*job)(size_t), const size_t workers) {
+    size_t failed = 0;
+#ifndef _WIN32
+    size_t running = 0;
+    int status = 0;
+    for (size_t i = 0; i < jobs_len; i++) {
+        if (running == workers) {
+            wait(&status);
+            failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            running--;
+        }
 
-            if (vec2d_length(forward_vec) < 0.001) {
-                forward_vec = backward_vec;
-                // printf("FORWARD IS SHORT\n");
-            }
-            if (vec2d_length(backward_vec) < 0.001) {
-                backward_vec = forward_vec;
-                // printf("BACKWARD IS SHORT\n");
-            }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int result = job(i);
+            fflush(stdout);
+            _exit(result == 0 ? 0 : 1);
+        } else if (pid < 0) {
+            failed += job(i) != 0;
+        } else {
+            running++;
+        }
+    }
+    while (running-- > 0) {
+        wait(&status);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+#else
+    (void) workers;
+    for (size_t i = 0; i < jobs_len; i++) failed += job(i) != 0;
+#endif
+    return failed;
+}
 
-            if (vec2d_dot(forward_vec, backward_vec) < -1.0 + 0.001) {
-                // printf("Very opposite! %lf\n", vec2d_dot(forward_vec, backward_vec));
-                double center_x = (maxE - minE)/2.0;
-                double center_y = (maxN - minN)/2.0;
-                Vec2d ray_from_center = vec2d_normalized((Vec2d) {
-                    x - center_x,
-                    y - center_y,
-                });
-                direction_vec = (Vec2d) {
-                    -forward_vec.y,
-                    forward_vec.x,
-                };
-                if (vec2d_dot(direction_vec, ray_from_center) < 0.0) {
-                    direction_vec = vec2d_invert(direction_vec);
-                }
-            } else {
-                direction_vec = vec2d_invert(vec2d_add(forward_vec, backward_vec));
-            }
+// size in pixels of a whole sheet at a pyramid level
+void level_image_size(const uint64_t level, uint64_t* x, uint64_t* y) {
+    switch (level)
+    {
+    case 0:
+        *x = 14000;
+        *y = 9600;
+        break;
+    case 1:
+        *x = 7000;
+        *y = 4800;
+        break;
+    case 2:
+        *x = 3500;
+        *y = 2400;
+        break;
+    case 3:
+        *x = 1750;
+        *y = 1200;
+        break;
+    case 4:
+        *x = 875;
+        *y = 600;
+        break;
+    case 5:
+        *x = 438;
+        *y = 300;
+        break;
+    default:
+        assert(0 && "Unreacheable");
+        break;
+    }
+}
 
-            direction_vec = vec2d_normalized(direction_vec);
-            for (size_t k = 0; k < DIRECTIONS_COUNT; k++) {
-                // printf("DIFFERENCE OF DISTANCE: %lf\n", vec2d_dot(directions_vectors[k], direction_vec) - 0.923);
-                if (vec2d_dot(directions_vectors[k], direction_vec) > 0.923) {
-                    direction_str = directions_labels[k];
-                    // fprintf(sink, "\\draw[green] [->, ultra thick] (%lf, %lf) -- (%lf, %lf);\n",
-                    //     map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-                    //     map(waypoints[i].n, maxN, minN, 0.0, -max_size),
-                    //     map(waypoints[i].e, minE, minE+height, 0.0, max_size) + directions_vectors[k].x,
-                    //     map(waypoints[i].n, maxN, minN, 0.0, -max_size) + directions_vectors[k].y);
-                    break;
-                }
-            }
-            assert(direction_str != NULL);
-            
-            // printf("DIRECTION %lf %lf, `%s`\n", direction_vec.x, direction_vec.y, direction_str);
+void tile_url(const uint64_t id, char* url, const size_t url_size) {
+    const char* base = getenv("TABELLINATOR_TILES_URL");
+    if (base == NULL) base = "https://data.geo.admin.ch/ch.swisstopo.pixelkarte-farbe-pk25.noscale";
+    uint64_t year = get_year(id);
+    snprintf(url, url_size, "%s/swiss-map-raster25_%ld_%ld/swiss-map-raster25_%ld_%ld_krel_1.25_2056.tif", base, year, id, year, id);
+}
 
-            fprintf(sink, "\\filldraw[red!90!black, fill opacity=0.0, draw opacity=0.0, text opacity=1.0] (%lf,%lf) circle (2.25pt) node[anchor=%s, inner sep=2.5mm]{\\textbf{\\contour{white}{\\small %.*s}}};\n",
-                map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-                map(waypoints[i].n, maxN, minN, 0.0, -max_size),
-                direction_str,
-                wp_name_len, wp_name);
+// Writes `arg` as one word of a shell command. The URL of the sheets comes from the
+// environment, so it may hold anything.
+void shell_quote(char* quoted, const size_t quoted_size, const char* arg) {
+    size_t len = 0;
+#ifndef _WIN32
+    const char open = '\'', close = '\'';
+#else
+    const char open = '"', close = '"';
+#endif
+    if (quoted_size < 3) return;
+    quoted[len++] = open;
+    for (const char* c = arg; *c != '\0' && len + 5 < quoted_size; c++) {
+#ifndef _WIN32
+        if (*c == '\'') {
+            // close the quotes, an escaped quote, open them again
+            memcpy(quoted + len, "'\\''", 4);
+            len += 4;
+            continue;
+        }
+#endif
+        quoted[len++] = *c;
+    }
+    quoted[len++] = close;
+    quoted[len] = '\0';
+}
 
-            // fprintf(sink, "\\draw[black] [->, ultra thick] (%lf, %lf) -- (%lf, %lf);\n",
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size),
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size) + backward_vec.x,
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size) + backward_vec.y);
-            // fprintf(sink, "\\draw[blue] [->, ultra thick] (%lf, %lf) -- (%lf, %lf);\n",
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size),
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size) + forward_vec.x,
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size) + forward_vec.y);
-            // fprintf(sink, "\\draw[orange] [->, ultra thick] (%lf, %lf) -- (%lf, %lf);\n",
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size),
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size),
-            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size) + direction_vec.x,
-            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size) + direction_vec.y);
+// Downloads the bytes [from, to] of `url` into `out_path`.
+int http_get_range(const char* url, const uint64_t from, const uint64_t to, const char* out_path) {
+    char cmd[1024] = {0};
+    char quoted_url[512] = {0}, quoted_path[160] = {0};
+    shell_quote(quoted_url, 512, url);
+    shell_quote(quoted_path, 160, out_path);
+    snprintf(cmd, 1024, "curl -s -f -r %ld-%ld -o %s %s", from, to, quoted_path, quoted_url);
+    if (system(cmd) != 0) return -1;
+
+    // a server ignoring the range header would send the whole file
+    if (file_size(out_path) != to - from + 1) {
+        fprintf(stderr, "[ERROR] Range request %ld-%ld on `%s` failed.\n", from, to, url);
+        remove(out_path);
+        return -1;
+    }
+    return 0;
+}
 
-        }
+uint16_t cog_u16(const Cog* cog, const uint8_t* p) {
+    return cog->big_endian ? (uint16_t) (p[0] << 8 | p[1]) : (uint16_t) (p[1] << 8 | p[0]);
+}
 
-        fprintf(sink, "\\draw[black] (%lf, %lf) rectangle (%lf, %lf);\n",
-            map(minE, minE, minE+height, 0.0, max_size), map(minN, maxN, minN, 0.0, -max_size),
-            map(maxE, minE, minE+height, 0.0, max_size), map(maxN, maxN, minN, 0.0, -max_size)
-        );
+uint32_t cog_u32(const Cog* cog, const uint8_t* p) {
+    return cog->big_endian
+        ? (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3]
+        : (uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0];
+}
 
-        // NORTH ARROW
-        // fprintf(sink, "\\draw [-stealth, ultra thick, white]  (%lf,%lf) -- (%lf,%lf);\n",
-        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
-        //     map(maxN, maxN, minN, 0, -max_size) - 1.5,
-        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
-        //     map(maxN, maxN, minN, 0, -max_size) - 0.5);
-        // fprintf(sink, "\\draw [-stealth, thick, black]  (%lf,%lf) -- (%lf,%lf);\n",
-        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
-        //     map(maxN, maxN, minN, 0, -max_size) - 1.45,
-        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
-        //     map(maxN, maxN, minN, 0, -max_size) - 0.55);
-        // fprintf(sink, "\\filldraw[red] (%lf,%lf) circle (8pt) node[anchor=south west]{%s};\n", 0.0, 0.0, "B");
-        // fprintf(sink, "\\filldraw[red] (%lf,%lf) circle (2pt) node[anchor=south west]{%s};\n", 0.0, -20.0, "C");
-        // fprintf(sink, "\\filldraw[red] (%lf,%lf) circle (2pt) node[anchor=south west]{%s};\n", 20.0, -20.0, "D");
-        //  fprintf(sink, "\\end{scope}\n");
+void cog_put_u16(const Cog* cog, uint8_t* p, const uint16_t v) {
+    if (cog->big_endian) { p[0] = v >> 8; p[1] = v; }
+    else                 { p[0] = v; p[1] = v >> 8; }
+}
+
+void cog_put_u32(const Cog* cog, uint8_t* p, const uint32_t v) {
+    if (cog->big_endian) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+    else                 { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+}
 
-        fprintf(sink, "\\end{tikzpicture}\n");
-        fprintf(sink, "\\end{center}\n");
+size_t tiff_type_size(const uint16_t type) {
+    switch (type) {
+    case 1: case 2: case 6: case 7: return 1;
+    case 3: case 8:                 return 2;
+    case 4: case 9: case 11:        return 4;
+    case 5: case 10: case 12:       return 8;
+    default:                        return 0;
     }
+}
 
+size_t tiff_entry_size(const TiffEntry* entry) {
+    return tiff_type_size(entry->type) * entry->count;
 }
 
-void print_latex_document(FILE* sink, int include_map) {
-    #define DOC_MARGIN 1.0
-    setlocale(LC_NUMERIC, "");
+// returns the offset in the file of the entry's out of line data, if any
+uint32_t cog_entry_data_offset(const Cog* cog, const TiffEntry* entry) {
+    return tiff_entry_size(entry) > 4 ? cog_u32(cog, entry->value) : 0;
+}
 
-    fprintf(sink, "\\documentclass[a4paper,10pt,landscape]{article}\n");
-    fprintf(sink, "\\usepackage[outline,copies]{contour}\n");
-    fprintf(sink, "\\usepackage{multirow}\n");
-    fprintf(sink, "\\usepackage[margin=%.0fcm]{geometry}\n", DOC_MARGIN);
-    fprintf(sink, "\\usepackage{microtype}\n");
-    fprintf(sink, "\\usepackage{longtable}\n");
-    fprintf(sink, "\\usepackage{graphicx}\n");
-    fprintf(sink, "\\usepackage{tikz}\n");
-    fprintf(sink, "\\usepgflibrary{plotmarks}\n");
-    fprintf(sink, "\\usepgflibrary{shapes.geometric}\n");
-    fprintf(sink, "\\usetikzlibrary{positioning}\n");
-
-    fprintf(sink, "\n");
-    fprintf(sink, "\\begin{document}\n");
-    fprintf(sink, "    \\pagenumbering{gobble}\n");
-    fprintf(sink, "    \\contourlength{0.5pt}\n");
-    fprintf(sink, "    \\contournumber{16}\n");
-    fprintf(sink, "    \\begin{center}\n");
-    fprintf(sink, "        \\textsc{\\Huge %s}\n", name);
-    fprintf(sink, "\n");
-    fprintf(sink, "        \\vspace{2ex}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "\\textsc{\\large Tabella di marcia}\n");
-    fprintf(sink, "    \\end{center}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "\\vspace{2ex}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "    \\begin{center}\\begin{tabular}{|c|c|}\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "        \\multirow{2}{*}{Fattore di marcia:} & \\multirow{2}{*}{$%0.1f \\hphantom{a} \\frac{kms}{h}$}\\\\\n", FACTOR);
-    fprintf(sink, "        &\\\\\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "    \\end{tabular}\\end{center}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "    \\begin{longtable}{|c|c|c|c|c|c|c|c|c|c|c|c|c|l|}\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "        \\multirow{2}{*}{Nome} & \\multirow{2}{*}{Coord. (LV95)} & \\multirow{2}{*}{Alt. [m]} & \\multirow{2}{*}{$\\Delta h$ [hm]} & \\multirow{2}{*}{$\\Delta s$ [km]} & \\multirow{2}{*}{$\\Delta kms$} & \\multirow{2}{*}{$\\Delta t$ [hh:mm]} & \\multirow{2}{*}{$s$ [km]} & \\multirow{2}{*}{$kms$} & \\multirow{2}{*}{$t$ [hh:mm]} & \\multirow{2}{*}{$t$ [hh:mm]} & \\multirow{2}{*}{Pausa [hh:mm]} & \\multirow{2}{*}{Osservazioni \\hphantom{aaaaaaaaaa}} \\\\\n");
-    fprintf(sink, "        &&&&&&&&&&&&\\\\\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "        \\hline\n");
+uint32_t cog_entry_get(const Cog* cog, const TiffEntry* entry, const size_t i) {
+    const size_t type_size = tiff_type_size(entry->type);
+    const uint8_t* data = tiff_entry_size(entry) > 4
+        ? cog->header + cog_entry_data_offset(cog, entry)
+        : entry->value;
+    return type_size == 2 ? cog_u16(cog, data + i * 2) : cog_u32(cog, data + i * 4);
+}
 
-    char wp_name[2] = "  ";
-    double km = 0, kms = 0;
-    uint64_t t = START_TIME;
-    // assert(waypoints_len == segments_len + 1);
-    for (size_t i = 0; i < waypoints_len; i++) {
-        Point wp = waypoints[i];
-        PathSegmentData psd = segments[i];
-        waypoint_name(i, wp_name);
-        fprintf(sink, "\\multirow{2}{*}{%.*s} & ", 2, wp_name);
-        fprintf(sink, "\\multirow{2}{*}{%'ld %'ld} & ", (uint64_t) round(wp.e), (uint64_t) round(wp.n));
-        fprintf(sink, "\\multirow{2}{*}{%'.0f} & ", round(wp.ele));
-        fprintf(sink, " & & & & ");
-        fprintf(sink, "\\multirow{2}{*}{%.1f} &", km);
-        fprintf(sink, "\\multirow{2}{*}{%.1f} &", kms);
-        fprintf(sink, "\\multirow{2}{*}{%02ld:%02ld} &", (t / 60)%24, t % 60);
-        fprintf(sink, "\\multirow{2}{*}{} &");
-        if (i < waypoints_len-1 && i > 0 && psd.pause > 0) {
-            fprintf(sink, "\\multirow{2}{*}{%02ld:%02ld} &", psd.pause / 60, psd.pause % 60);
-        } else {
-            fprintf(sink, "\\multirow{2}{*}{} &");
+// returns 0 on success, 1 if more header bytes are needed, -1 if the file can not be read by range
+int cog_parse(Cog* cog) {
+    if (cog->header_size < 8) return -1;
+    if (cog->header[0] == 'I' && cog->header[1] == 'I') cog->big_endian = 0;
+    else if (cog->header[0] == 'M' && cog->header[1] == 'M') cog->big_endian = 1;
+    else return -1;
+    if (cog_u16(cog, cog->header + 2) != 42) return -1; // BigTIFF is not needed for our sheets
+
+    cog->ifds_len = 0;
+    uint32_t ifd_offset = cog_u32(cog, cog->header + 4);
+    while (ifd_offset != 0 && cog->ifds_len < COG_MAX_IFDS) {
+        if (ifd_offset + 2 > cog->header_size) return 1;
+        uint16_t entries_count = cog_u16(cog, cog->header + ifd_offset);
+        if (ifd_offset + 2 + entries_count * 12 + 4 > cog->header_size) return 1;
+
+        CogIfd* ifd = &cog->ifds[cog->ifds_len++];
+        memset(ifd, 0, sizeof(*ifd));
+        for (size_t i = 0; i < entries_count; i++) {
+            const uint8_t* p = cog->header + ifd_offset + 2 + i * 12;
+            if (ifd->entries_len >= COG_MAX_ENTRIES) return -1;
+            TiffEntry* entry = &ifd->entries[ifd->entries_len++];
+            entry->tag = cog_u16(cog, p);
+            entry->type = cog_u16(cog, p + 2);
+            entry->count = cog_u32(cog, p + 4);
+            memcpy(entry->value, p + 8, 4);
+
+            if (tiff_entry_size(entry) > 4 && cog_entry_data_offset(cog, entry) + tiff_entry_size(entry) > cog->header_size) return 1;
+
+            switch (entry->tag) {
+            case 256: ifd->width = cog_entry_get(cog, entry, 0); break;
+            case 257: ifd->height = cog_entry_get(cog, entry, 0); break;
+            case 322: ifd->tile_width = cog_entry_get(cog, entry, 0); break;
+            case 323: ifd->tile_height = cog_entry_get(cog, entry, 0); break;
+            case 324: ifd->tile_offsets = entry; break;
+            case 325: ifd->tile_byte_counts = entry; break;
+            }
         }
-        fprintf(sink, "\\multirow{2}{*}{}\\\\\n");
-        fprintf(sink, "        \\cline{4-7} \n");
-        if (i < waypoints_len-1) {
-            fprintf(sink, " & & & ");
-            fprintf(sink, "\\multirow{2}{*}{%.1f} & ", psd.dh/100.0);
-            fprintf(sink, " \\multirow{2}{*}{%.1f} &", psd.dst);
-            fprintf(sink, " \\multirow{2}{*}{%.1f} &", psd.kms);
-            fprintf(sink, "\\multirow{2}{*}{%02ld:%02ld}&&&&&& \\\\\n", psd.t / 60, psd.t % 60);
-
-            km += psd.dst;
-            kms += psd.kms;
-            t += psd.t + psd.pause;
-
-            // fprintf(sink, "&&&&&&&&& \\\\\n");
-            fprintf(sink, "        \\cline{1-3}\\cline{8-13} \n");
-        } else {
-            fprintf(sink, "&&&&&&&&&&&&\\\\\n");
-            fprintf(sink, "\\hline\n");
+
+        if (ifd->tile_width == 0 || ifd->tile_height == 0 || ifd->tile_offsets == NULL || ifd->tile_byte_counts == NULL) return -1; // striped, not a COG
+        ifd->tiles_across = (ifd->width + ifd->tile_width - 1) / ifd->tile_width;
+        ifd->tiles_down = (ifd->height + ifd->tile_height - 1) / ifd->tile_height;
+        if (ifd->tile_offsets->count < ifd->tiles_across * ifd->tiles_down) return -1; // planar configuration not supported
+
+        ifd_offset = cog_u32(cog, cog->header + ifd_offset + 2 + entries_count * 12);
+    }
+
+    return cog->ifds_len > 0 ? 0 : -1;
+}
+
+int cog_open(Cog* cog, const uint64_t id) {
+    char url[256] = {0};
+    char header_file[64] = {0};
+    tile_url(id, url, 256);
+    snprintf(header_file, 64, CACHE_DIR"/cog/%ld.hdr", id);
+
+    memset(cog, 0, sizeof(*cog));
+    cog->id = id;
+
+    size_t wanted_size = COG_HEADER_SIZE;
+    while (1) {
+        if (file_size(header_file) < wanted_size) {
+            printf("[INFO] Reading map header [id=%ld]... ", id);
+            fflush(stdout);
+            char part_file[80] = {0};
+            part_name(part_file, 80, header_file);
+            if (http_get_range(url, 0, wanted_size - 1, part_file) != 0 || rename_part(header_file) != 0) {
+                printf("failed!\n");
+                return -1;
+            }
+            printf("done!\n");
+        }
+
+        cog->header_size = file_size(header_file);
+        cog->header = realloc(cog->header, cog->header_size);
+        FILE* fp = fopen(header_file, "rb");
+        if (fp == NULL) return -1;
+        cog->header_size = fread(cog->header, 1, cog->header_size, fp);
+        fclose(fp);
+
+        int result = cog_parse(cog);
+        if (result == 0) return 0;
+        if (result < 0 || wanted_size >= COG_HEADER_MAX_SIZE) break;
+        wanted_size = cog->header_size * 4;
+    }
+
+    free(cog->header);
+    cog->header = NULL;
+    return -1;
+}
+
+void cog_close(Cog* cog) {
+    free(cog->header);
+    cog->header = NULL;
+}
+
+// returns the directory whose resolution is the closest to `width`
+size_t cog_level_ifd(const Cog* cog, const uint64_t width) {
+    size_t best = 0;
+    for (size_t i = 1; i < cog->ifds_len; i++) {
+        if (llabs((int64_t) cog->ifds[i].width - (int64_t) width) < llabs((int64_t) cog->ifds[best].width - (int64_t) width))
+            best = i;
+    }
+    return best;
+}
+
+int cog_tile_cmp(const void* a, const void* b) {
+    const CogTile* ta = a;
+    const CogTile* tb = b;
+    return (ta->offset > tb->offset) - (ta->offset < tb->offset);
+}
+
+void cog_tile_file(const Cog* cog, const size_t ifd_idx, const uint32_t index, char* path, const size_t path_size) {
+    snprintf(path, path_size, CACHE_DIR"/cog/%ld-%ld-%d.bin", cog->id, ifd_idx, index);
+}
+
+// Downloads the missing tiles, merging neighbouring ones into a single range request.
+int cog_fetch_tiles(const Cog* cog, const size_t ifd_idx, CogTile* tiles, const size_t tiles_len) {
+    char url[256] = {0};
+    char path[64] = {0};
+    char range_file[64] = {0};
+    snprintf(range_file, 64, CACHE_DIR"/cog/range-%ld.%d.part", cog->id, (int) getpid());
+    tile_url(cog->id, url, 256);
+
+    size_t missing_len = 0;
+    CogTile* missing = calloc(tiles_len, sizeof(CogTile));
+    for (size_t i = 0; i < tiles_len; i++) {
+        cog_tile_file(cog, ifd_idx, tiles[i].index, path, 64);
+        if (tiles[i].size > 0 && !file_exists(path)) missing[missing_len++] = tiles[i];
+    }
+    qsort(missing, missing_len, sizeof(CogTile), cog_tile_cmp);
+
+    int result = 0;
+    size_t requests = 0;
+    for (size_t first = 0; first < missing_len && result == 0;) {
+        uint64_t from = missing[first].offset;
+        uint64_t to = from + missing[first].size;
+        size_t last = first + 1;
+        while (last < missing_len && missing[last].offset <= to + COG_MERGE_GAP) {
+            uint64_t end = missing[last].offset + missing[last].size;
+            to = end > to ? end : to;
+            last++;
+        }
+
+        requests++;
+        if (http_get_range(url, from, to - 1, range_file) != 0) {
+            result = -1;
+            break;
+        }
+
+        uint8_t* data = malloc(to - from);
+        FILE* fp = fopen(range_file, "rb");
+        if (fp == NULL || fread(data, 1, to - from, fp) != to - from) result = -1;
+        if (fp != NULL) fclose(fp);
+
+        // a block is cached only once it is complete, a cut one would be read again forever
+        for (size_t i = first; i < last && result == 0; i++) {
+            cog_tile_file(cog, ifd_idx, missing[i].index, path, 64);
+            char part_path[80] = {0};
+            part_name(part_path, 80, path);
+            FILE* tile_fp = fopen(part_path, "wb");
+            if (tile_fp == NULL) { result = -1; break; }
+            const int written = fwrite(data + (missing[i].offset - from), 1, missing[i].size, tile_fp) == missing[i].size;
+            if (fclose(tile_fp) != 0 || !written || rename_part(path) != 0) {
+                remove(part_path);
+                result = -1;
+            }
+        }
+
+        free(data);
+        remove(range_file);
+        first = last;
+    }
+
+    if (missing_len > 0) printf("[INFO] Fetched %ld map blocks in %ld requests [id=%ld]\n", missing_len, requests, cog->id);
+    free(missing);
+    return result;
+}
+
+// Writes a tiled TIFF holding the tiles of directory `ifd_idx` that overlap the
+// pixel window. `origin_x` and `origin_y` receive the position of the first tile.
+int cog_read_window(const Cog* cog, const size_t ifd_idx, int64_t x, int64_t y, int64_t w, int64_t h, const char* out_path, int64_t* origin_x, int64_t* origin_y) {
+    const CogIfd* ifd = &cog->ifds[ifd_idx];
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (w <= 0 || h <= 0 || x >= ifd->width || y >= ifd->height) return -1;
+
+    uint32_t tx0 = x / ifd->tile_width;
+    uint32_t ty0 = y / ifd->tile_height;
+    uint32_t tx1 = (x + w - 1) / ifd->tile_width;
+    uint32_t ty1 = (y + h - 1) / ifd->tile_height;
+    tx1 = tx1 < ifd->tiles_across ? tx1 : ifd->tiles_across - 1;
+    ty1 = ty1 < ifd->tiles_down ? ty1 : ifd->tiles_down - 1;
+    const uint32_t across = tx1 - tx0 + 1;
+    const uint32_t down = ty1 - ty0 + 1;
+
+    size_t tiles_len = 0;
+    CogTile* tiles = calloc(across * down, sizeof(CogTile));
+    for (uint32_t ty = ty0; ty <= ty1; ty++) {
+        for (uint32_t tx = tx0; tx <= tx1; tx++) {
+            CogTile* tile = &tiles[tiles_len++];
+            tile->index = ty * ifd->tiles_across + tx;
+            tile->offset = cog_entry_get(cog, ifd->tile_offsets, tile->index);
+            tile->size = cog_entry_get(cog, ifd->tile_byte_counts, tile->index);
+        }
+    }
+
+    if (cog_fetch_tiles(cog, ifd_idx, tiles, tiles_len) != 0) {
+        free(tiles);
+        return -1;
+    }
+
+    // header, directory and out of line values, then tile offsets and byte counts, then the tiles
+    size_t entries_len = 0;
+    TiffEntry entries[COG_MAX_ENTRIES];
+    size_t extra_size = 0;
+    for (size_t i = 0; i < ifd->entries_len; i++) {
+        const TiffEntry* entry = &ifd->entries[i];
+        if (entry->tag == 254 || (entry->tag >= 33550 && entry->tag <= 34737)) continue; // subfile type and georeferencing
+        entries[entries_len++] = *entry;
+        if (tiff_entry_size(entry) > 4 && entry->tag != 324 && entry->tag != 325) extra_size += (tiff_entry_size(entry) + 1) & ~1;
+    }
+
+    const size_t ifd_size = 2 + entries_len * 12 + 4;
+    const size_t arrays_offset = 8 + ifd_size + extra_size;
+    const size_t head_size = arrays_offset + tiles_len * 8;
+    size_t data_offset = head_size;
+    uint8_t* head = calloc(head_size, 1);
+
+    head[0] = head[1] = cog->big_endian ? 'M' : 'I';
+    cog_put_u16(cog, head + 2, 42);
+    cog_put_u32(cog, head + 4, 8);
+    cog_put_u16(cog, head + 8, entries_len);
+
+    for (size_t i = 0; i < tiles_len; i++) {
+        cog_put_u32(cog, head + arrays_offset + i * 4, tiles[i].size > 0 ? data_offset : 0);
+        cog_put_u32(cog, head + arrays_offset + (tiles_len + i) * 4, tiles[i].size);
+        data_offset += tiles[i].size;
+    }
+
+    size_t extra_offset = 8 + ifd_size;
+    for (size_t i = 0; i < entries_len; i++) {
+        TiffEntry* entry = &entries[i];
+        uint8_t* p = head + 10 + i * 12;
+        switch (entry->tag) {
+        case 256:
+            entry->type = 4;
+            cog_put_u32(cog, entry->value, across * ifd->tile_width);
+            break;
+        case 257:
+            entry->type = 4;
+            cog_put_u32(cog, entry->value, down * ifd->tile_height);
+            break;
+        case 324:
+        case 325: {
+            const size_t array_offset = arrays_offset + (entry->tag == 325) * tiles_len * 4;
+            entry->type = 4;
+            entry->count = tiles_len;
+            if (tiles_len == 1) memcpy(entry->value, head + array_offset, 4); // a single value is kept inline
+            else cog_put_u32(cog, entry->value, array_offset);
+        } break;
+        default:
+            if (tiff_entry_size(entry) > 4) {
+                memcpy(head + extra_offset, cog->header + cog_entry_data_offset(cog, entry), tiff_entry_size(entry));
+                cog_put_u32(cog, entry->value, extra_offset);
+                extra_offset += (tiff_entry_size(entry) + 1) & ~1;
+            }
+        }
+        cog_put_u16(cog, p, entry->tag);
+        cog_put_u16(cog, p + 2, entry->type);
+        cog_put_u32(cog, p + 4, entry->count);
+        memcpy(p + 8, entry->value, 4);
+    }
+
+    int result = 0;
+    FILE* fp = fopen(out_path, "wb");
+    if (fp == NULL) result = -1;
+    else fwrite(head, 1, head_size, fp);
+
+    char path[64] = {0};
+    for (size_t i = 0; i < tiles_len && result == 0; i++) {
+        if (tiles[i].size == 0) continue;
+        cog_tile_file(cog, ifd_idx, tiles[i].index, path, 64);
+        FILE* tile_fp = fopen(path, "rb");
+        if (tile_fp == NULL) { result = -1; break; }
+        uint8_t* data = malloc(tiles[i].size);
+        size_t read = fread(data, 1, tiles[i].size, tile_fp);
+        fwrite(data, 1, read, fp);
+        if (read != tiles[i].size) result = -1;
+        free(data);
+        fclose(tile_fp);
+    }
+    if (fp != NULL) fclose(fp);
+
+    *origin_x = (int64_t) tx0 * ifd->tile_width;
+    *origin_y = (int64_t) ty0 * ifd->tile_height;
+    free(head);
+    free(tiles);
+    return result;
+}
+
+// Returns the size announced by the server, 0 if unknown.
+uint64_t remote_size(const char* url) {
+    char cmd[600] = {0};
+    char quoted_url[512] = {0};
+    shell_quote(quoted_url, 512, url);
+    snprintf(cmd, 600, "curl -s -f -I -L %s", quoted_url);
+    FILE* fp = popen(cmd, "r");
+    if (fp == NULL) return 0;
+
+    // the last header wins, after redirects
+    uint64_t size = 0;
+    char line[256] = {0};
+    while (fgets(line, 256, fp) != NULL) {
+        unsigned long long value = 0;
+        if (sscanf(line, "Content-Length: %llu", &value) == 1 || sscanf(line, "content-length: %llu", &value) == 1)
+            size = value;
+    }
+    // a failed request still prints its headers, the length is that of the error page
+    if (pclose(fp) != 0) return 0;
+    return size;
+}
+
+// reads the SHORT or LONG values of an entry from the file, NULL if they lie outside of it
+uint32_t* tiff_read_array(FILE* fp, const Cog* tiff, const TiffEntry* entry, const size_t size) {
+    const size_t type_size = tiff_type_size(entry->type);
+    if (type_size != 2 && type_size != 4) return NULL;
+
+    uint8_t* data = malloc(tiff_entry_size(entry) > 4 ? tiff_entry_size(entry) : 4);
+    if (tiff_entry_size(entry) > 4) {
+        const uint32_t offset = cog_entry_data_offset(tiff, entry);
+        if (offset + tiff_entry_size(entry) > size || fseek(fp, offset, SEEK_SET) != 0 || fread(data, 1, tiff_entry_size(entry), fp) != tiff_entry_size(entry)) {
+            free(data);
+            return NULL;
+        }
+    } else {
+        memcpy(data, entry->value, 4);
+    }
+
+    uint32_t* values = malloc(entry->count * sizeof(uint32_t));
+    for (size_t i = 0; i < entry->count; i++) {
+        values[i] = type_size == 2 ? cog_u16(tiff, data + i * 2) : cog_u32(tiff, data + i * 4);
+    }
+    free(data);
+    return values;
+}
+
+// Checks that the file starts like a TIFF and that every strip or tile the
+// directories point to lies inside of it, which a truncated download breaks.
+int tiff_is_complete(const char* path) {
+    const size_t size = file_size(path);
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    Cog tiff = {0};
+    uint8_t header[8] = {0};
+    int complete = fread(header, 1, 8, fp) == 8;
+    if (complete) {
+        tiff.big_endian = header[0] == 'M';
+        complete = (header[0] == 'I' || header[0] == 'M') && header[0] == header[1] && cog_u16(&tiff, header + 2) == 42;
+    }
+
+    uint32_t ifd_offset = complete ? cog_u32(&tiff, header + 4) : 0;
+    size_t ifds = 0;
+    while (complete && ifd_offset != 0 && ifds++ < 64) {
+        uint8_t count_bytes[2] = {0};
+        complete = ifd_offset + 2 <= size && fseek(fp, ifd_offset, SEEK_SET) == 0 && fread(count_bytes, 1, 2, fp) == 2;
+        if (!complete) break;
+
+        const uint16_t entries_count = cog_u16(&tiff, count_bytes);
+        uint8_t* entries = malloc(entries_count * 12 + 4);
+        complete = fread(entries, 1, entries_count * 12 + 4, fp) == entries_count * 12 + 4u;
+
+        TiffEntry offsets = {0}, counts = {0};
+        for (size_t i = 0; i < entries_count && complete; i++) {
+            TiffEntry entry = {0};
+            entry.tag = cog_u16(&tiff, entries + i * 12);
+            entry.type = cog_u16(&tiff, entries + i * 12 + 2);
+            entry.count = cog_u32(&tiff, entries + i * 12 + 4);
+            memcpy(entry.value, entries + i * 12 + 8, 4);
+            if (entry.tag == 273 || entry.tag == 324) offsets = entry;
+            if (entry.tag == 279 || entry.tag == 325) counts = entry;
+        }
+        if (complete) ifd_offset = cog_u32(&tiff, entries + entries_count * 12);
+        free(entries);
+
+        complete = complete && offsets.count > 0 && offsets.count == counts.count;
+        uint32_t* offset_values = complete ? tiff_read_array(fp, &tiff, &offsets, size) : NULL;
+        uint32_t* count_values = complete ? tiff_read_array(fp, &tiff, &counts, size) : NULL;
+        complete = offset_values != NULL && count_values != NULL;
+        for (size_t i = 0; i < offsets.count && complete; i++) {
+            complete = (uint64_t) offset_values[i] + count_values[i] <= size;
+        }
+        free(offset_values);
+        free(count_values);
+    }
+
+    fclose(fp);
+    return complete;
+}
+
+// Downloads the whole sheet into `<id>.tif.part`, resuming with range requests
+// after an interruption, and moves it in place once it is verified.
+int download_whole_tile(const uint64_t id) {
+    char tiff_file[16] = {0};
+    char part_file[24] = {0};
+    snprintf(tiff_file, 16, "%ld.tif", id);
+    snprintf(part_file, 24, "%ld.tif.part", id);
+
+    if (file_exists(tiff_file)) {
+        if (tiff_is_complete(tiff_file)) return 0;
+        // left behind by an interrupted download, continue it
+        fprintf(stderr, "[WARNING] Map [id=%ld] is incomplete, resuming its download.\n", id);
+        rename(tiff_file, part_file);
+    }
+
+    char url[256] = {0};
+    char cmd[1024] = {0};
+    char quoted_url[512] = {0}, quoted_part[64] = {0};
+    tile_url(id, url, 256);
+    shell_quote(quoted_url, 512, url);
+    shell_quote(quoted_part, 64, part_file);
+    snprintf(cmd, 1024, "curl -s -f -L -C - -o %s %s", quoted_part, quoted_url);
+    const uint64_t expected_size = remote_size(url);
+
+    printf("[INFO] Downloading map [id=%ld]...\n", id);
+    fflush(stdout);
+
+    int downloaded = 0;
+    for (size_t attempt = 0; attempt < DOWNLOAD_ATTEMPTS && !downloaded; attempt++) {
+        if (attempt > 0) printf("[INFO] Download of map [id=%ld] interrupted at %ld bytes, resuming...\n", id, file_size(part_file));
+        if (expected_size > 0 && file_size(part_file) > expected_size) remove(part_file);
+
+        // without the size from the server only the file tells whether it is complete,
+        // and resuming a complete file fails
+        if (expected_size == 0 && file_exists(part_file) && tiff_is_complete(part_file)) {
+            downloaded = 1;
+        } else if (expected_size == 0 || file_size(part_file) < expected_size) {
+            int status = system(cmd);
+            downloaded = expected_size > 0 ? file_size(part_file) == expected_size
+                                           : status == 0 || tiff_is_complete(part_file);
+        } else {
+            downloaded = 1;
+        }
+    }
+
+    if (!downloaded || !tiff_is_complete(part_file)) {
+        fprintf(stderr, "[ERROR] Could not download map [id=%ld].\n", id);
+        if (downloaded) remove(part_file); // complete, but not a valid sheet
+        return -1;
+    }
+    if (rename(part_file, tiff_file) != 0) {
+        remove(part_file);
+        return -1;
+    }
+    printf("[INFO] Downloaded map  [id=%ld]\n", id);
+    return 0;
+}
+
+// The part of a sheet keeps its name to be resumed by a later run, so the processes
+// that need the same sheet (the workers of --serve) take turns on `<id>.tif.lock`:
+// the next one finds the sheet complete.
+int download_tile(const uint64_t id) {
+    char tiff_file[16] = {0};
+    snprintf(tiff_file, 16, "%ld.tif", id);
+    if (file_exists(tiff_file) && tiff_is_complete(tiff_file)) return 0;
+#ifndef _WIN32
+    char lock_file[24] = {0};
+    snprintf(lock_file, 24, "%ld.tif.lock", id);
+    const int lock = open(lock_file, O_RDWR | O_CREAT, 0644);
+    if (lock >= 0) flock(lock, LOCK_EX);
+    const int result = download_whole_tile(id);
+    if (lock >= 0) close(lock);
+    return result;
+#else
+    return download_whole_tile(id);
+#endif
+}
+
+// Lanczos weights of the source pixels for each destination pixel along one axis
+typedef struct {
+    size_t* first; // first source pixel
+    size_t* count; // number of source pixels
+    float* weights; // `taps` per destination pixel
+    size_t taps;
+} ResampleAxis;
+
+double lanczos(const double x) {
+    if (x == 0.0) return 1.0;
+    if (fabs(x) >= LANCZOS_SUPPORT) return 0.0;
+    return LANCZOS_SUPPORT * sin(M_PI * x) * sin(M_PI * x / LANCZOS_SUPPORT) / (M_PI * M_PI * x * x);
+}
+
+void resample_axis_init(ResampleAxis* axis, const size_t src_len, const size_t dst_len) {
+    const double scale = (double) src_len / (double) dst_len;
+    const double filter_scale = scale > 1.0 ? scale : 1.0;
+    const double support = LANCZOS_SUPPORT * filter_scale;
+
+    axis->taps = (size_t) ceil(support) * 2 + 1;
+    axis->first = calloc(dst_len, sizeof(size_t));
+    axis->count = calloc(dst_len, sizeof(size_t));
+    axis->weights = calloc(dst_len * axis->taps, sizeof(float));
+
+    for (size_t i = 0; i < dst_len; i++) {
+        const double center = ((double) i + 0.5) * scale;
+        int64_t lo = (int64_t) floor(center - support);
+        int64_t hi = (int64_t) ceil(center + support);
+        if (lo < 0) lo = 0;
+        if (hi > (int64_t) src_len) hi = (int64_t) src_len;
+        if (hi - lo > (int64_t) axis->taps) hi = lo + (int64_t) axis->taps;
+
+        float* weights = axis->weights + i * axis->taps;
+        double sum = 0.0;
+        for (int64_t j = lo; j < hi; j++) {
+            weights[j - lo] = (float) lanczos(((double) j + 0.5 - center) / filter_scale);
+            sum += weights[j - lo];
+        }
+        for (int64_t j = lo; j < hi && sum != 0.0; j++) weights[j - lo] = (float) (weights[j - lo] / sum);
+        axis->first[i] = (size_t) lo;
+        axis->count[i] = (size_t) (hi - lo);
+    }
+}
+
+void resample_axis_free(ResampleAxis* axis) {
+    free(axis->first);
+    free(axis->count);
+    free(axis->weights);
+}
+
+// Reads the size of the first image of a TIFF without decoding it.
+int image_size(const char* path, uint64_t* width, uint64_t* height) {
+    char cmd[256] = {0};
+    snprintf(cmd, 256, "magick identify -ping -format \"%%w %%h\" '%s[0]'", path);
+    FILE* fp = popen(cmd, PIPE_READ);
+    if (fp == NULL) return -1;
+    unsigned long long w = 0, h = 0;
+    int read = fscanf(fp, "%llu %llu", &w, &h);
+    pclose(fp);
+    if (read != 2 || w == 0 || h == 0) return -1;
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+// Converts a downloaded sheet to `<id>-<level>.jpg`, one level of the local pyramid.
+// The sheet is decoded, resampled and encoded one row at a time: here only the
+// rows under the vertical filter are held, the encoder stays within MEMORY_LIMIT.
+int build_tile_level(const uint64_t id, const uint64_t level) {
+    char tiff_file[16] = {0};
+    char level_file[24] = {0};
+    char part_file[40] = {0};
+    snprintf(tiff_file, 16, "%ld.tif", id);
+    snprintf(level_file, 24, "%ld-%ld.jpg", id, level);
+    part_name(part_file, 40, level_file);
+    if (file_exists(level_file)) return 0;
+    if (!file_exists(tiff_file)) return -1;
+
+    uint64_t src_width = 0, src_height = 0;
+    uint64_t image_size_x = 0, image_size_y = 0;
+    level_image_size(level, &image_size_x, &image_size_y);
+    if (image_size(tiff_file, &src_width, &src_height) != 0) {
+        fprintf(stderr, "[ERROR] Could not read map [id=%ld].\n", id);
+        return -1;
+    }
+
+    char decode_cmd[256] = {0};
+    char encode_cmd[256] = {0};
+    snprintf(decode_cmd, 256, "magick stream -map rgb -storage-type char '%s[0]' -"
+#ifdef _WIN32
+        " 2> nul"
+#else
+        " 2> /dev/null"
+#endif
+    , tiff_file);
+    snprintf(encode_cmd, 256, MAGICK" -size %ldx%ld -depth 8 RGB:- JPG:%s"
+#ifdef _WIN32
+        " 2> nul"
+#else
+        " 2> /dev/null"
+#endif
+    , MAGICK_LIMITS, image_size_x, image_size_y, part_file);
+
+    printf("[INFO] Converting map  [id=%ld, level=%ld]...\n", id, level);
+    fflush(stdout);
+
+    ResampleAxis horizontal = {0}, vertical = {0};
+    resample_axis_init(&horizontal, src_width, image_size_x);
+    resample_axis_init(&vertical, src_height, image_size_y);
+
+    // the source rows, resampled horizontally, in a ring as tall as the vertical filter
+    const size_t ring_len = vertical.taps;
+    uint8_t* src_row = malloc(src_width * 3);
+    float* ring = malloc(ring_len * image_size_x * 3 * sizeof(float));
+    uint8_t* dst_row = malloc(image_size_x * 3);
+
+    FILE* decoder = popen(decode_cmd, PIPE_READ);
+    FILE* encoder = decoder != NULL ? popen(encode_cmd, PIPE_WRITE) : NULL;
+    int ok = decoder != NULL && encoder != NULL;
+
+    size_t y = 0;
+    for (size_t src_y = 0; src_y < src_height && ok; src_y++) {
+        ok = fread(src_row, 3, src_width, decoder) == src_width;
+        if (!ok) break;
+
+        float* resampled = ring + (src_y % ring_len) * image_size_x * 3;
+        for (size_t x = 0; x < image_size_x; x++) {
+            const float* weights = horizontal.weights + x * horizontal.taps;
+            const uint8_t* src = src_row + horizontal.first[x] * 3;
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            for (size_t k = 0; k < horizontal.count[x]; k++) {
+                r += weights[k] * src[k * 3];
+                g += weights[k] * src[k * 3 + 1];
+                b += weights[k] * src[k * 3 + 2];
+            }
+            resampled[x * 3] = r;
+            resampled[x * 3 + 1] = g;
+            resampled[x * 3 + 2] = b;
+        }
+
+        // every destination row whose last source row just arrived
+        while (y < image_size_y && vertical.first[y] + vertical.count[y] == src_y + 1 && ok) {
+            const float* weights = vertical.weights + y * vertical.taps;
+            for (size_t c = 0; c < image_size_x * 3; c++) {
+                float v = 0.0f;
+                for (size_t k = 0; k < vertical.count[y]; k++) {
+                    v += weights[k] * ring[((vertical.first[y] + k) % ring_len) * image_size_x * 3 + c];
+                }
+                dst_row[c] = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (uint8_t) (v + 0.5f);
+            }
+            ok = fwrite(dst_row, 3, image_size_x, encoder) == image_size_x;
+            y++;
+        }
+    }
+    ok = ok && y == image_size_y;
+
+    if (decoder != NULL && pclose(decoder) != 0) ok = 0;
+    if (encoder != NULL && pclose(encoder) != 0) ok = 0;
+    free(src_row);
+    free(ring);
+    free(dst_row);
+    resample_axis_free(&horizontal);
+    resample_axis_free(&vertical);
+
+    if (!ok || rename_part(level_file) != 0) {
+        fprintf(stderr, "[ERROR] Could not convert map [id=%ld, level=%ld].\n", id, level);
+        remove(part_file);
+        return -1;
+    }
+    return 0;
+}
+
+// LV95 to pixels of the stitched map image
+typedef struct {
+    double min_e;
+    double max_n;
+    double px_per_m;
+} RasterTransform;
+
+void raster_px(const RasterTransform* tr, const double e, const double n, double* x, double* y) {
+    *x = (e - tr->min_e) * tr->px_per_m;
+    *y = (tr->max_n - n) * tr->px_per_m;
+}
+
+// a stretch of the path, `first` and `last` included
+typedef struct {
+    size_t first;
+    size_t last;
+} PathRun;
+
+int path_runs_contain(const PathRun* runs, const size_t runs_len, const size_t idx) {
+    for (size_t r = 0; r < runs_len; r++) {
+        if (runs[r].first <= idx && idx <= runs[r].last) return 1;
+    }
+    return 0;
+}
+
+// Writes the stretches of the route and their waypoints as an ImageMagick vector
+// graphics file, returns the hash of its content.
+uint64_t write_route_mvg(const char* mvg_path, const RasterTransform* tr, const double dpi, const PathRun* runs, const size_t runs_len) {
+    FILE* fp = fopen(mvg_path, "w");
+    if (fp == NULL) return 0;
+
+    // same sizes as the TikZ overlay: 1.5pt wide line, 2.25pt dots
+    const double pt = dpi / 72.27; // px
+    char line[128] = {0};
+    uint64_t hash = HASH_SEED;
+
+    snprintf(line, 128, "stroke red\nstroke-width %.2f\nstroke-linejoin round\nstroke-linecap round\nfill none\n", 1.5 * pt);
+    hash = hash_bytes(hash, line, strlen(line));
+    fputs(line, fp);
+    for (size_t r = 0; r < runs_len; r++) {
+        snprintf(line, 128, r == 0 ? "polyline" : "\npolyline");
+        hash = hash_bytes(hash, line, strlen(line));
+        fputs(line, fp);
+        for (size_t i = runs[r].first; i <= runs[r].last; i++) {
+            double x = 0, y = 0;
+            raster_px(tr, path[i].e, path[i].n, &x, &y);
+            snprintf(line, 128, " %.1f,%.1f", x, y);
+            hash = hash_bytes(hash, line, strlen(line));
+            fputs(line, fp);
+        }
+    }
+
+    snprintf(line, 128, "\nstroke none\nfill red\n");
+    hash = hash_bytes(hash, line, strlen(line));
+    fputs(line, fp);
+    for (size_t i = 0; i < waypoints_len; i++) {
+        if (!path_runs_contain(runs, runs_len, waypoints[i].idx)) continue;
+        double x = 0, y = 0;
+        raster_px(tr, waypoints[i].e, waypoints[i].n, &x, &y);
+        snprintf(line, 128, "circle %.1f,%.1f %.1f,%.1f\n", x, y, x + 2.25 * pt, y);
+        hash = hash_bytes(hash, line, strlen(line));
+        fputs(line, fp);
+    }
+
+    fclose(fp);
+    return hash;
+}
+
+#define MAP_CELL_SIZE 0.8 // cm, unit of the TikZ picture of the map
+#define MAP_PAGE_WIDTH 34.6 // cells, room for the map on a landscape page
+#define MAP_PAGE_HEIGHT 21.75
+#define PREVIEW_DPI 96
+
+// The area of the map page and its size on paper.
+typedef struct {
+    uint64_t minE, maxE, minN, maxN; // lv95
+    uint64_t width, height; // m
+    double max_size; // cells spanned by `height`
+} MapFrame;
+
+// the cells spanned by the height of a frame, the page is turned for tall frames
+double map_max_size(const uint64_t width, const uint64_t height) {
+    const double rel_width = MAP_PAGE_WIDTH;
+    const double rel_height = MAP_PAGE_HEIGHT;
+    double max_size = 0.0;
+    if (height < width) {
+        max_size = (double) rel_height;
+        if (max_size / height * width > (double) rel_width) {
+            max_size = rel_width / width * height;
+        }
+    } else {
+        max_size = (double) rel_width;
+        if (max_size / height * width > (double) rel_height) {
+            max_size = (double) rel_width / width * height;
+        }
+    }
+    return max_size;
+}
+
+// Fits the route into the proportions of the page, with a margin around it.
+void map_frame_fit(MapFrame* frame) {
+    uint64_t minE = 1000000000, maxE = 0, minN = 1000000000, maxN = 0;
+    uint64_t E = 0, N = 0;
+    for (size_t i = 0; i < path_len; i++) {
+        E = path[i].e;
+        N = path[i].n;
+        if (E < minE) minE = E;
+        if (E > maxE) maxE = E;
+        if (N < minN) minN = N;
+        if (N > maxN) maxN = N;
+    }
+
+    uint64_t width = (maxE - minE);
+    uint64_t height = (maxN - minN);
+
+
+    uint64_t new_height = height, new_width = width;
+    const double rel_width = MAP_PAGE_WIDTH;
+    const double rel_height = MAP_PAGE_HEIGHT;
+    const double rel_ratio = rel_width / rel_height;
+    if (width > height) {
+        if((double) width / (double) height > rel_ratio) {
+            new_height = width * rel_height / rel_width;
+            minN -= (new_height - height)/2;
+            maxN += (new_height - height)/2;
+        } else if ((double) width / (double) height < rel_ratio) {
+            new_width = height * rel_width / rel_height;
+            minE -= (new_width - width) /2;
+            maxE += (new_width - width)/2;
+        }
+    } else {
+        if((double) height / (double) width > rel_ratio) {
+            new_width = height * rel_height / rel_width;
+            minE -= (new_width - width) / 2;
+            maxE += (new_width - width) / 2;
+        } else if ((double) height / (double) width < rel_ratio) {
+            new_height = width * rel_width / rel_height;
+            minN -= (new_height - height) / 2;
+            maxN += (new_height - height) / 2;
+        }
+    }
+
+    width = new_width;
+    height = new_height;
+
+    width = width * 12 / 10;
+    height = height * 12 / 10;
+
+    minE -= width / 12;
+    maxE += width / 12;
+    minN -= height / 12;
+    maxN += height / 12;
+
+    *frame = (MapFrame) { minE, maxE, minN, maxN, width, height, map_max_size(width, height) };
+}
+
+// Returns the index in `directions_labels` of the side of the waypoint its label goes on,
+// away from the path.
+size_t waypoint_label_direction(const MapFrame* frame, const size_t i) {
+    const uint64_t minE = frame->minE, maxE = frame->maxE, minN = frame->minN, maxN = frame->maxN;
+
+    const int64_t step = 1;
+    const int64_t max_samples = 25;
+    
+    Vec2d direction_vec = {0};
+    size_t direction = DIRECTIONS_COUNT;
+    Vec2d forward_vec = {0};
+    Vec2d backward_vec = {0};
+    
+    size_t path_idx = waypoints[i].idx;
+    // printf("WAYPOINT PATH IDX: %ld\n", waypoints[i].idx);
+
+    uint64_t x = waypoints[i].e, y = waypoints[i].n;
+    double sum_x = 0.0, sum_y = 0.0;
+    int64_t n = 0, count = 0;
+    for (int64_t j = path_idx-1; j > (int64_t) path_idx - step * max_samples && j >= 0; j--) {
+        // printf("    (%ld) %lf %lf\n", j, sum_x, sum_y);
+        sum_x += (path[j].e - x) * (max_samples - n + 1);
+        sum_y += (path[j].n - y) * (max_samples - n + 1);
+        n ++;
+        count += max_samples - count + 1;
+    }
+    // printf("BACKWARD COUNT: %ld\n", count);
+    count = count <= 0 ? 1 : count;
+    backward_vec = (Vec2d) {
+        sum_x / (double) count, sum_y / (double) count
+    };
+    backward_vec = vec2d_normalized(backward_vec);
+    // printf("BACKWARD %lf %lf\n", backward_vec.x, backward_vec.y);
+
+    sum_x = 0.0; sum_y = 0.0; count = 0; n = 0;
+    for (int64_t j = path_idx+1; j < path_idx + step * max_samples && j < path_len; j++) {
+        sum_x += (path[j].e - x) * (max_samples - n + 1);
+        sum_y += (path[j].n - y) * (max_samples - n + 1);
+        n ++;
+        count += max_samples - count + 1;
+    }
+    // printf("FORWARD COUNT: %ld\n", count);
+    count = count <= 0 ? 1 : count;
+    forward_vec = (Vec2d) {
+        sum_x / (double) count, sum_y / (double) count
+    };
+    forward_vec = vec2d_normalized(forward_vec);
+    // printf("FORWARD %lf %lf\n", forward_vec.x, forward_vec.y);
+
+    if (vec2d_length(forward_vec) < 0.001) {
+        forward_vec = backward_vec;
+        // printf("FORWARD IS SHORT\n");
+    }
+    if (vec2d_length(backward_vec) < 0.001) {
+        backward_vec = forward_vec;
+        // printf("BACKWARD IS SHORT\n");
+    }
+
+    if (vec2d_dot(forward_vec, backward_vec) < -1.0 + 0.001) {
+        // printf("Very opposite! %lf\n", vec2d_dot(forward_vec, backward_vec));
+        double center_x = (maxE - minE)/2.0;
+        double center_y = (maxN - minN)/2.0;
+        Vec2d ray_from_center = vec2d_normalized((Vec2d) {
+            x - center_x,
+            y - center_y,
+        });
+        direction_vec = (Vec2d) {
+            -forward_vec.y,
+            forward_vec.x,
+        };
+        if (vec2d_dot(direction_vec, ray_from_center) < 0.0) {
+            direction_vec = vec2d_invert(direction_vec);
+        }
+    } else {
+        direction_vec = vec2d_invert(vec2d_add(forward_vec, backward_vec));
+    }
+
+    direction_vec = vec2d_normalized(direction_vec);
+    for (size_t k = 0; k < DIRECTIONS_COUNT; k++) {
+        // printf("DIFFERENCE OF DISTANCE: %lf\n", vec2d_dot(directions_vectors[k], direction_vec) - 0.923);
+        if (vec2d_dot(directions_vectors[k], direction_vec) > 0.923) {
+            direction = k;
+            // sb_appendf(sb, "\\draw[green] [->, ultra thick] (%lf, %lf) -- (%lf, %lf);\n",
+            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size),
+            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size),
+            //     map(waypoints[i].e, minE, minE+height, 0.0, max_size) + directions_vectors[k].x,
+            //     map(waypoints[i].n, maxN, minN, 0.0, -max_size) + directions_vectors[k].y);
+            break;
+        }
+    }
+    assert(direction < DIRECTIONS_COUNT);
+
+    return direction;
+}
+
+
+#define LABEL_FONT_SIZE 9.0 // pt, \small
+#define LABEL_CHAR_WIDTH (0.7 * LABEL_FONT_SIZE) // pt, bold capitals
+#define LABEL_HEIGHT (0.7 * LABEL_FONT_SIZE) // pt
+#define LABEL_SEP (2.5 / 25.4 * 72.27) // pt, the inner sep of the label nodes
+
+typedef struct {
+    double min_e, min_n, max_e, max_n; // lv95
+} Rect;
+
+// The text of the label of waypoint `i` on side `direction` of it, in meters.
+Rect label_rect(const MapFrame* frame, const size_t i, const size_t direction) {
+    const double m_per_pt = (double) frame->height / (frame->max_size * MAP_CELL_SIZE) * 2.54 / 72.27;
+    char wp_name[2] = {0};
+    const double width = LABEL_CHAR_WIDTH * waypoint_name(i, wp_name) * m_per_pt;
+    const double height = LABEL_HEIGHT * m_per_pt;
+    const double sep = LABEL_SEP * m_per_pt;
+    const Vec2d side = directions_vectors[direction];
+
+    // the anchor is a side or a corner of the label
+    Rect rect = { waypoints[i].e - width / 2.0, waypoints[i].n - height / 2.0, 0, 0 };
+    if (side.x > 0.1) rect.min_e = waypoints[i].e + sep;
+    if (side.x < -0.1) rect.min_e = waypoints[i].e - sep - width;
+    if (side.y > 0.1) rect.min_n = waypoints[i].n + sep;
+    if (side.y < -0.1) rect.min_n = waypoints[i].n - sep - height;
+    rect.max_e = rect.min_e + width;
+    rect.max_n = rect.min_n + height;
+    return rect;
+}
+
+// Items bucketed by the square cells their bounding box covers, with the cells hashed
+// into a fixed table: looking up a small area costs the same however long the route is.
+typedef struct {
+    size_t item;
+    size_t next; // index + 1 of the next entry of the bucket, 0 at the end
+} SpatialEntry;
+
+typedef struct {
+    double cell; // m
+    size_t buckets_len; // a power of two
+    size_t* buckets; // index + 1 of the first entry
+    SpatialEntry* entries;
+    size_t entries_len;
+    size_t entries_cap;
+} SpatialHash;
+
+void spatial_hash_init(SpatialHash* hash, const double cell, const size_t items) {
+    hash->cell = cell;
+    hash->buckets_len = 64;
+    while (hash->buckets_len < items * 2) hash->buckets_len *= 2;
+    hash->buckets = calloc(hash->buckets_len, sizeof(size_t));
+    hash->entries_cap = items + 16;
+    hash->entries = malloc(hash->entries_cap * sizeof(SpatialEntry));
+    hash->entries_len = 0;
+}
+
+void spatial_hash_free(SpatialHash* hash) {
+    free(hash->buckets);
+    free(hash->entries);
+}
+
+size_t spatial_bucket(const SpatialHash* hash, const int64_t col, const int64_t row) {
+    const int64_t key[] = { col, row };
+    return hash_bytes(HASH_SEED, key, sizeof(key)) & (hash->buckets_len - 1);
+}
+
+void spatial_hash_insert(SpatialHash* hash, const Rect* rect, const size_t item) {
+    for (int64_t row = (int64_t) floor(rect->min_n / hash->cell); row <= (int64_t) floor(rect->max_n / hash->cell); row++) {
+        for (int64_t col = (int64_t) floor(rect->min_e / hash->cell); col <= (int64_t) floor(rect->max_e / hash->cell); col++) {
+            if (hash->entries_len == hash->entries_cap) {
+                hash->entries_cap *= 2;
+                hash->entries = realloc(hash->entries, hash->entries_cap * sizeof(SpatialEntry));
+            }
+            const size_t bucket = spatial_bucket(hash, col, row);
+            hash->entries[hash->entries_len] = (SpatialEntry) { item, hash->buckets[bucket] };
+            hash->buckets[bucket] = ++hash->entries_len;
+        }
+    }
+}
+
+// Collects the items whose cells the area touches, each once: `stamps` remembers the
+// last query that returned an item. Returns how many there are.
+size_t spatial_hash_query(const SpatialHash* hash, const Rect* rect, size_t* stamps, const size_t stamp, size_t* items, const size_t items_cap) {
+    size_t items_len = 0;
+    for (int64_t row = (int64_t) floor(rect->min_n / hash->cell); row <= (int64_t) floor(rect->max_n / hash->cell); row++) {
+        for (int64_t col = (int64_t) floor(rect->min_e / hash->cell); col <= (int64_t) floor(rect->max_e / hash->cell); col++) {
+            for (size_t e = hash->buckets[spatial_bucket(hash, col, row)]; e != 0 && items_len < items_cap; e = hash->entries[e - 1].next) {
+                const size_t item = hash->entries[e - 1].item;
+                if (stamps[item] == stamp) continue;
+                stamps[item] = stamp;
+                items[items_len++] = item;
+            }
+        }
+    }
+    return items_len;
+}
+
+// Liang-Barsky: whether the segment from `a` to `b` passes through the rectangle.
+int segment_crosses_rect(const Point* a, const Point* b, const Rect* rect) {
+    const double de = b->e - a->e, dn = b->n - a->n;
+    const double p[4] = { -de, de, -dn, dn };
+    const double q[4] = { a->e - rect->min_e, rect->max_e - a->e, a->n - rect->min_n, rect->max_n - a->n };
+    double t0 = 0.0, t1 = 1.0;
+    for (size_t k = 0; k < 4; k++) {
+        if (p[k] == 0.0) {
+            if (q[k] < 0.0) return 0;
+        } else {
+            const double t = q[k] / p[k];
+            if (p[k] < 0.0) t0 = t > t0 ? t : t0;
+            else t1 = t < t1 ? t : t1;
+            if (t0 > t1) return 0;
+        }
+    }
+    return 1;
+}
+
+#define LABEL_QUERY_CAP 4096
+
+// Picks the side of every waypoint label on the stretches. The side facing away from the
+// path comes first, then its neighbours; the first free one wins, otherwise the one with
+// the least track and labels under it. Track segments and placed labels are looked up in
+// spatial hashes, so placing stays linear in the number of waypoints.
+void place_labels(const MapFrame* frame, const PathRun* runs, const size_t runs_len, size_t directions[WAYPOINTS_CAPACITY]) {
+    const double m_per_pt = (double) frame->height / (frame->max_size * MAP_CELL_SIZE) * 2.54 / 72.27;
+    const double cell = (2.0 * LABEL_SEP + 2.0 * LABEL_CHAR_WIDTH) * m_per_pt;
+
+    size_t segments_len = 0;
+    for (size_t r = 0; r < runs_len; r++) segments_len += runs[r].last - runs[r].first;
+
+    SpatialHash segments = {0}, labels = {0};
+    spatial_hash_init(&segments, cell, segments_len);
+    spatial_hash_init(&labels, cell, waypoints_len);
+    for (size_t r = 0; r < runs_len; r++) {
+        for (size_t i = runs[r].first; i < runs[r].last; i++) {
+            const Rect bounds = {
+                path[i].e < path[i + 1].e ? path[i].e : path[i + 1].e,
+                path[i].n < path[i + 1].n ? path[i].n : path[i + 1].n,
+                path[i].e > path[i + 1].e ? path[i].e : path[i + 1].e,
+                path[i].n > path[i + 1].n ? path[i].n : path[i + 1].n,
+            };
+            spatial_hash_insert(&segments, &bounds, i);
+        }
+    }
+
+    size_t* segment_stamps = calloc(path_len, sizeof(size_t));
+    size_t label_stamps[WAYPOINTS_CAPACITY] = {0};
+    size_t* found = malloc(LABEL_QUERY_CAP * sizeof(size_t));
+    Rect placed[WAYPOINTS_CAPACITY] = {0};
+    size_t stamp = 0;
+
+    for (size_t i = 0; i < waypoints_len; i++) {
+        if (!path_runs_contain(runs, runs_len, waypoints[i].idx)) continue;
+        const size_t preferred = waypoint_label_direction(frame, i);
+
+        double best_cost = DBL_MAX;
+        for (size_t attempt = 0; attempt < DIRECTIONS_COUNT && best_cost > 0.0; attempt++) {
+            // 0, +1, -1, +2, -2, ... around the preferred side
+            const int64_t offset = attempt % 2 == 1 ? (int64_t) (attempt + 1) / 2 : -(int64_t) attempt / 2;
+            const size_t direction = (size_t) ((int64_t) preferred + offset + DIRECTIONS_COUNT) % DIRECTIONS_COUNT;
+            const Rect rect = label_rect(frame, i, direction);
+            const double area = (rect.max_e - rect.min_e) * (rect.max_n - rect.min_n);
+
+            double cost = 0.0;
+            if (rect.min_e < frame->minE || rect.max_e > frame->maxE || rect.min_n < frame->minN || rect.max_n > frame->maxN)
+                cost += 4.0;
+
+            stamp++;
+            const size_t found_segments = spatial_hash_query(&segments, &rect, segment_stamps, stamp, found, LABEL_QUERY_CAP);
+            for (size_t k = 0; k < found_segments; k++) {
+                cost += segment_crosses_rect(&path[found[k]], &path[found[k] + 1], &rect);
+            }
+
+            const size_t found_labels = spatial_hash_query(&labels, &rect, label_stamps, stamp, found, LABEL_QUERY_CAP);
+            for (size_t k = 0; k < found_labels; k++) {
+                const Rect* other = &placed[found[k]];
+                const double overlap_e = fmin(rect.max_e, other->max_e) - fmax(rect.min_e, other->min_e);
+                const double overlap_n = fmin(rect.max_n, other->max_n) - fmax(rect.min_n, other->min_n);
+                if (overlap_e > 0.0 && overlap_n > 0.0) cost += 10.0 * overlap_e * overlap_n / area;
+            }
+
+            if (cost < best_cost) {
+                best_cost = cost;
+                directions[i] = direction;
+                placed[i] = rect;
+            }
+        }
+
+        spatial_hash_insert(&labels, &placed[i], i);
+    }
+
+    free(found);
+    free(segment_stamps);
+    spatial_hash_free(&segments);
+    spatial_hash_free(&labels);
+}
+
+// Writes the labels of the waypoints on the stretches as an ImageMagick vector graphics
+// file, placed like the TikZ nodes: bold, with a white contour, `inner sep` away from the waypoint.
+uint64_t write_labels_mvg(const char* mvg_path, const RasterTransform* tr, const MapFrame* frame, const double dpi, const PathRun* runs, const size_t runs_len) {
+    FILE* fp = fopen(mvg_path, "w");
+    if (fp == NULL) return 0;
+
+    const double pt = dpi / 72.27; // px
+    const double font_size = LABEL_FONT_SIZE * pt;
+    const double sep = 2.5 / 25.4 * dpi; // 2.5mm
+    char line[128] = {0};
+    uint64_t hash = HASH_SEED;
+
+    snprintf(line, 128, "font-size %.1f\nfont-weight bold\ntext-anchor middle\nstroke-linejoin round\n", font_size);
+    hash = hash_bytes(hash, line, strlen(line));
+    fputs(line, fp);
+
+    size_t directions[WAYPOINTS_CAPACITY] = {0};
+    place_labels(frame, runs, runs_len, directions);
+
+    char wp_name[2] = {0};
+    for (size_t i = 0; i < waypoints_len; i++) {
+        if (!path_runs_contain(runs, runs_len, waypoints[i].idx)) continue;
+        size_t wp_name_len = waypoint_name(i, wp_name);
+        const Vec2d direction = directions_vectors[directions[i]];
+
+        // the anchor is a side or a corner of the label, pixels grow downwards
+        const double half_width = 0.35 * font_size * wp_name_len, half_height = 0.35 * font_size;
+        double x = 0, y = 0;
+        raster_px(tr, waypoints[i].e, waypoints[i].n, &x, &y);
+        if (direction.x > 0.1) x += sep + half_width;
+        if (direction.x < -0.1) x -= sep + half_width;
+        if (direction.y > 0.1) y -= sep + half_height;
+        if (direction.y < -0.1) y += sep + half_height;
+
+        snprintf(line, 128, "stroke white\nstroke-width %.1f\nfill white\ntext %.1f,%.1f '%.*s'\n", 1.5 * pt, x, y + half_height, (int) wp_name_len, wp_name);
+        hash = hash_bytes(hash, line, strlen(line));
+        fputs(line, fp);
+        snprintf(line, 128, "stroke none\nfill '#e60000'\ntext %.1f,%.1f '%.*s'\n", x, y + half_height, (int) wp_name_len, wp_name);
+        hash = hash_bytes(hash, line, strlen(line));
+        fputs(line, fp);
+    }
+
+    fclose(fp);
+    return hash;
+}
+
+// The pixels of the map image of a frame: its size on paper at `dpi`.
+RasterTransform raster_transform(const MapFrame* frame, const uint64_t dpi) {
+    const double map_width_cm = ((double) (frame->maxE - frame->minE) / (double) frame->height) * MAP_CELL_SIZE * frame->max_size;
+    const double px_per_m = (map_width_cm / 2.54 * dpi) / (double) (frame->maxE - frame->minE);
+    return (RasterTransform) { frame->minE, frame->maxN, px_per_m };
+}
+
+// the coarsest pyramid level that still has at least the needed detail
+uint64_t raster_level(const RasterTransform* tr) {
+    double resolution_kinda = floor(log2(1.0 / (tr->px_per_m * TILE_METERS_PER_PIXEL)));
+    resolution_kinda = resolution_kinda < 0.0 ? 0.0 : resolution_kinda;
+
+    return (uint64_t) resolution_kinda < 5 ? (uint64_t) resolution_kinda : 5;
+}
+
+// the part of a sheet shown on a map and where it goes in the map image
+typedef struct {
+    uint64_t id;
+    uint64_t level;
+    int64_t min_e, min_n, max_e, max_n; // lv95
+    int64_t x0, y0, x1, y1; // px
+    uint64_t hash;
+    char file[64];
+} SheetCrop;
+
+#define FRAME_SHEETS_CAP 32
+
+// Lists the sheets under the frame, returns how many there are.
+size_t frame_crops(const MapFrame* frame, const RasterTransform* tr, const uint64_t resolution_id, SheetCrop* crops) {
+    const uint64_t minE = frame->minE, maxE = frame->maxE, minN = frame->minN, maxN = frame->maxN;
+    const uint64_t width = frame->width, height = frame->height;
+
+    size_t checked_ids_size = 0;
+    uint64_t checked_ids[FRAME_SHEETS_CAP] = {0};
+    size_t crops_len = 0;
+
+    const uint64_t min_dimension = width < height ? width : height;
+    uint64_t step = min_dimension / 32;
+    step = step < 100 ? step : 100;
+
+    for (uint64_t e = minE; e <= maxE; e += step) {
+        for (uint64_t n = maxN; n >= minN; n -= step) {
+            uint64_t id = lv95_to_tileid(e, n);
+            if (get_year(id) == 0) continue; // outside of the national map
+            uint64_t e2 = 0, n2 = 0;
+            tileid_coord(id, &e2, &n2);
+            // printf("%ld %ld -> %ld %ld\n", e, n, e2, n2);
+            // printf("    %ld %ld -> %ld %ld\n", e - e2, n - n2, TILE_WIDTH, TILE_HEIGHT);
+            // printf("    %ld %ld\n", id, lv95_to_tileid(e2+1, n2+1));
+
+            int checked = 0;
+            for (size_t i = 0; i < checked_ids_size; i++) {
+                if (checked_ids[i] == id) checked = 1;
+            }
+            if (checked) continue;
+            assert(checked_ids_size < FRAME_SHEETS_CAP && "Too many map sheets");
+            checked_ids[checked_ids_size++] = id;
+
+            // get the coordinates contained in the map
+            int64_t mapMinE = 0, mapMinN = 0;
+            int64_t mapMaxE = 0, mapMaxN = 0;
+
+            tileid_coord(id, (uint64_t*) &mapMinE, (uint64_t*) &mapMinN);
+            mapMaxE = mapMinE + TILE_WIDTH;
+            mapMaxN = mapMinN + TILE_HEIGHT;
+            // printf("MAP: %ld %ld %ld %ld\n", mapMinE, mapMinN, mapMaxE, mapMaxN);
+            // printf("MINIMAP: %ld %ld %ld %ld\n", minE, minN, maxE, maxN);
+
+            SheetCrop* crop = &crops[crops_len];
+            crop->id = id;
+            crop->level = resolution_id;
+            crop->min_e = mapMinE > (int64_t) minE ? (int64_t) mapMinE : (int64_t) minE;
+            crop->max_e = mapMaxE < (int64_t) maxE ? (int64_t) mapMaxE : (int64_t) maxE;
+            crop->min_n = mapMinN > (int64_t) minN ? (int64_t) mapMinN : (int64_t) minN;
+            crop->max_n = mapMaxN < (int64_t) maxN ? (int64_t) mapMaxN : (int64_t) maxN;
+            // printf("MIN MIN / MAX MAX: %ld %ld %ld %ld\n", mapMinE, mapMinN, mapMaxE, mapMaxN);
+            // printf("MIN MIN / MAX MAX: %ld %ld %ld %ld\n", crop->min_e, crop->min_n, crop->max_e, crop->max_n);
+
+            // place the window in the stitched image; rounding both edges keeps neighbouring sheets seamless
+            double place_x0_px = 0, place_y0_px = 0, place_x1_px = 0, place_y1_px = 0;
+            raster_px(tr, crop->min_e, crop->max_n, &place_x0_px, &place_y0_px);
+            raster_px(tr, crop->max_e, crop->min_n, &place_x1_px, &place_y1_px);
+            crop->x0 = (int64_t) round(place_x0_px);
+            crop->x1 = (int64_t) round(place_x1_px);
+            crop->y0 = (int64_t) round(place_y0_px);
+            crop->y1 = (int64_t) round(place_y1_px);
+            if (crop->x1 <= crop->x0 || crop->y1 <= crop->y0) continue;
+
+            // crops are named after what they contain, so reruns and overlapping routes reuse them
+            const int64_t crop_key[] = {
+                id, resolution_id,
+                crop->min_e, crop->min_n, crop->max_e, crop->max_n,
+                crop->x1 - crop->x0, crop->y1 - crop->y0,
+                CROP_FORMAT_VERSION,
+            };
+            crop->hash = hash_bytes(HASH_SEED, crop_key, sizeof(crop_key));
+            snprintf(crop->file, 64, CACHE_DIR"/crops/%016lx.png", crop->hash);
+            crops_len++;
+        }
+    }
+
+    return crops_len;
+}
+
+// Cuts the window of the sheet out of the pyramid level, of the remote sheet, or of
+// the whole downloaded sheet, in this order of preference.
+int make_crop(const SheetCrop* crop) {
+    const uint64_t id = crop->id;
+    const uint64_t resolution_id = crop->level;
+    const int64_t min_contained_E = crop->min_e, min_contained_N = crop->min_n;
+    const int64_t max_contained_E = crop->max_e, max_contained_N = crop->max_n;
+
+    int64_t mapMinE = 0, mapMinN = 0;
+    tileid_coord(id, (uint64_t*) &mapMinE, (uint64_t*) &mapMinN);
+    const int64_t mapMaxN = mapMinN + TILE_HEIGHT;
+
+    uint64_t full_image_size_x = 0, full_image_size_y = 0;
+    level_image_size(resolution_id, &full_image_size_x, &full_image_size_y);
+
+    char tiff_file[16] = {0};
+    char jpg_file[16] = {0};
+    char window_file[64] = {0};
+    snprintf(tiff_file, 15, "%ld.tif", id);
+    snprintf(jpg_file, 15, "%ld-%ld.jpg", id, resolution_id);
+    snprintf(window_file, 64, CACHE_DIR"/cog/window-%ld.%d.tif", id, (int) getpid());
+
+    // read only the blocks of the remote sheet covering the window, unless the whole sheet is already here
+    Cog cog = {0};
+    const char* crop_source = jpg_file;
+    int64_t image_size_x = full_image_size_x, image_size_y = full_image_size_y;
+    int64_t origin_x = 0, origin_y = 0;
+    int from_cog = !file_exists(jpg_file) && !file_exists(tiff_file) && cog_open(&cog, id) == 0;
+    if (from_cog) {
+        const size_t ifd_idx = cog_level_ifd(&cog, full_image_size_x);
+        image_size_x = cog.ifds[ifd_idx].width;
+        image_size_y = cog.ifds[ifd_idx].height;
+
+        int64_t x0 = (int64_t) floor((double) (min_contained_E - mapMinE) / TILE_WIDTH * image_size_x);
+        int64_t y0 = (int64_t) floor((double) (mapMaxN - max_contained_N) / TILE_HEIGHT * image_size_y);
+        int64_t x1 = (int64_t) ceil((double) (max_contained_E - mapMinE) / TILE_WIDTH * image_size_x);
+        int64_t y1 = (int64_t) ceil((double) (mapMaxN - min_contained_N) / TILE_HEIGHT * image_size_y);
+        from_cog = cog_read_window(&cog, ifd_idx, x0, y0, x1 - x0, y1 - y0, window_file, &origin_x, &origin_y) == 0;
+        if (from_cog) crop_source = window_file;
+        cog_close(&cog);
+    }
+
+    if (!from_cog) {
+        image_size_x = full_image_size_x;
+        image_size_y = full_image_size_y;
+        origin_x = origin_y = 0;
+
+        const StageMark download_mark = stage_begin();
+        const int downloaded = download_tile(id) == 0;
+        stage_end(STAGE_MAP_DOWNLOAD, &download_mark);
+        if (!downloaded || build_tile_level(id, resolution_id) != 0) return -1;
+    }
+
+    // get the size of the cropped image in pixels
+    double cropped_map_width = (double) (max_contained_E - min_contained_E) / (double) TILE_WIDTH;
+    double cropped_map_height = (double) (max_contained_N - min_contained_N) /  (double) TILE_HEIGHT;
+    uint64_t cropped_image_width =  (uint64_t) ((double) image_size_x * cropped_map_width);
+    uint64_t cropped_image_height = (uint64_t) ((double) image_size_y * cropped_map_height);
+    // printf("WIDTH / HEIGHT: %ld %ld\n", cropped_image_width, cropped_image_height);
+
+    if (cropped_image_width == 0 || cropped_image_height == 0) return -1;
+
+    // get the offset from the center of the image
+    double coord_offset_x = (double) (min_contained_E - mapMinE) / (double) TILE_WIDTH;
+    double coord_offset_y = (double) (mapMaxN - max_contained_N) / (double) TILE_HEIGHT;
+    // printf("COORD OFFSETS: %f %f\n", coord_offset_x * TILE_WIDTH, coord_offset_y * TILE_HEIGHT);
+
+    int64_t pixel_offset_x = (int64_t) (coord_offset_x * (double)image_size_x) - origin_x;
+    int64_t pixel_offset_y = (int64_t)  (coord_offset_y * (double)image_size_y) - origin_y;
+    // printf("PX OFFSETS: %ld %ld\n", pixel_offset_x, pixel_offset_y);
+    // printf("\n");
+
+    char crop_part[80] = {0};
+    part_name(crop_part, 80, crop->file);
+    char crop_cmd[512] = {0};
+    snprintf(crop_cmd, 512, MAGICK" %s -crop %ldx%ld%+ld%+ld +repage -filter Lanczos -resize %ldx%ld! PNG:%s"
+#ifdef _WIN32
+        " > nul"
+#else
+        " 2> /dev/null"
+#endif
+    , MAGICK_LIMITS, crop_source, cropped_image_width, cropped_image_height, pixel_offset_x, pixel_offset_y, crop->x1 - crop->x0, crop->y1 - crop->y0, crop_part);
+    // printf("[CROP] %s\n", crop_cmd);
+    printf("[INFO] Cropping map    [id=%ld]... ", id);
+    fflush(stdout);
+    const int cropped = system(crop_cmd) == 0 && rename_part(crop->file) == 0;
+    remove(window_file);
+    if (cropped) {
+        printf("done!\n");
+        return 0;
+    }
+    printf("failed!\n");
+    return -1;
+}
+
+// Crops every sheet under the frame and stitches them into `map_file`, a JPEG for the
+// document or a PNG for the preview, with the stretches of the route and their labels
+// drawn in if asked. Returns the number of sheets, 0 if there is no map or one of
+// its sheets could not be cropped.
+// With --watch the last map made is kept: while the frame, the resolution and what is
+// drawn on it stay the same it is returned right away.
+uint64_t watch_map_key = 0;
+char watch_map_file[64] = {0};
+size_t watch_map_sheets = 0;
+
+size_t map_raster(const MapFrame* frame, const uint64_t dpi, const PathRun* runs, const size_t runs_len, const int draw_route, const int draw_labels, const char* ext, char* map_file, const size_t map_file_size) {
+    uint64_t watch_key = 0;
+    if (WATCH) {
+        // what the map is made of: the frame, and the route and the waypoints only when
+        // they are drawn into it, as TikZ draws them by default
+        watch_key = hash_bytes(HASH_SEED, frame, sizeof(MapFrame));
+        watch_key = hash_bytes(watch_key, &dpi, sizeof(dpi));
+        if (draw_route || draw_labels) {
+            // the labels are placed away from the route, both depend on all of it
+            watch_key = hash_bytes(watch_key, runs, runs_len * sizeof(PathRun));
+            for (size_t r = 0; r < runs_len; r++) {
+                for (size_t i = runs[r].first; i <= runs[r].last; i++) watch_key = hash_bytes(watch_key, &path[i].e, 2 * sizeof(double));
+            }
+            for (size_t i = 0; i < waypoints_len; i++) {
+                watch_key = hash_bytes(watch_key, &waypoints[i].e, 2 * sizeof(double));
+                watch_key = hash_bytes(watch_key, &waypoints[i].idx, sizeof(size_t));
+            }
+        }
+        const int layers[2] = { draw_route, draw_labels };
+        watch_key = hash_bytes(watch_key, layers, sizeof(layers));
+        watch_key = hash_bytes(watch_key, ext, strlen(ext));
+        watch_key = hash_bytes(watch_key, &JPEG_QUALITY, sizeof(JPEG_QUALITY));
+        if (watch_key == watch_map_key && file_exists(watch_map_file)) {
+            printf("[INFO] Watch: map unchanged, reusing `%s`\n", watch_map_file);
+            snprintf(map_file, map_file_size, "%s", watch_map_file);
+            return watch_map_sheets;
+        }
+        printf("[INFO] Watch: map changed, making it\n");
+        watch_map_key = 0;
+    }
+
+    const RasterTransform tr = raster_transform(frame, dpi);
+    const uint64_t resolution_id = raster_level(&tr);
+
+    uint64_t full_image_size_x = 0, full_image_size_y = 0;
+    level_image_size(resolution_id, &full_image_size_x, &full_image_size_y);
+
+    printf("[INFO] Chosen resolution: %ld (%ldx%ldpx), resampled to %ld dpi\n", resolution_id, full_image_size_x, full_image_size_y, dpi);
+
+    make_dir(CACHE_DIR);
+    make_dir(CACHE_DIR"/cog");
+    make_dir(CACHE_DIR"/crops");
+    make_dir(CACHE_DIR"/maps");
+
+    SheetCrop crops[FRAME_SHEETS_CAP] = {0};
+    const StageMark sheets_mark = stage_begin();
+    const size_t crops_len = frame_crops(frame, &tr, resolution_id, crops);
+    stage_end(STAGE_MAP_SHEETS, &sheets_mark);
+    size_t frame_id = 0;
+
+    // every sheet is cropped and composed into a single image, embedded once
+    const uint64_t stitch_width = (uint64_t) round((double) (frame->maxE - frame->minE) * tr.px_per_m);
+    const uint64_t stitch_height = (uint64_t) round((double) (frame->maxN - frame->minN) * tr.px_per_m);
+    uint64_t stitch_hash = hash_bytes(HASH_SEED, &stitch_width, sizeof(stitch_width));
+    stitch_hash = hash_bytes(stitch_hash, &stitch_height, sizeof(stitch_height));
+
+    char* stitch_cmd = calloc(STITCH_CMD_CAP, sizeof(char));
+    size_t stitch_cmd_len = snprintf(stitch_cmd, STITCH_CMD_CAP, MAGICK" -size %ldx%ld xc:white", MAGICK_LIMITS, stitch_width, stitch_height);
+
+    for (size_t i = 0; i < crops_len; i++) {
+        const SheetCrop* crop = &crops[i];
+        if (file_exists(crop->file)) {
+            cache_touch(crop->file);
+        } else {
+            const StageMark crop_mark = stage_begin();
+            const int cropped = make_crop(crop);
+            stage_end(STAGE_MAP_CROP, &crop_mark);
+            if (cropped != 0) {
+                // a map with a white hole in place of a sheet is no map to hand out
+                fprintf(stderr, "[ERROR] Could not crop map [id=%ld], the map is left out.\n", crop->id);
+                frame_id = 0;
+                break;
+            }
+        }
+
+        stitch_hash = hash_bytes(stitch_hash, &crop->hash, sizeof(crop->hash));
+        stitch_hash = hash_bytes(stitch_hash, &crop->x0, sizeof(crop->x0));
+        stitch_hash = hash_bytes(stitch_hash, &crop->y0, sizeof(crop->y0));
+        stitch_cmd_len += snprintf(stitch_cmd + stitch_cmd_len, STITCH_CMD_CAP - stitch_cmd_len,
+            " %s -geometry %+ld%+ld -composite", crop->file, crop->x0, crop->y0);
+        assert(stitch_cmd_len < STITCH_CMD_CAP && "Too many map sheets");
+
+        frame_id += 1;
+    }
+
+    // the vector layers are named after the frame, pages of an atlas are stitched at the same time
+    char route_mvg[64] = {0};
+    char labels_mvg[64] = {0};
+    snprintf(route_mvg, 64, CACHE_DIR"/route-%ld-%ld.%d.mvg", frame->minE, frame->minN, (int) getpid());
+    snprintf(labels_mvg, 64, CACHE_DIR"/labels-%ld-%ld.%d.mvg", frame->minE, frame->minN, (int) getpid());
+
+    // draw the route straight into the image: a 50% opaque layer, like the TikZ transparency group
+    if (frame_id > 0 && draw_route) {
+        const uint64_t route_hash = write_route_mvg(route_mvg, &tr, dpi, runs, runs_len);
+        stitch_hash = hash_bytes(stitch_hash, &route_hash, sizeof(route_hash));
+        stitch_cmd_len += snprintf(stitch_cmd + stitch_cmd_len, STITCH_CMD_CAP - stitch_cmd_len,
+            " "OPEN_PAREN" -size %ldx%ld xc:none -draw @%s -channel A -evaluate multiply 0.5 +channel "CLOSE_PAREN" -composite",
+            stitch_width, stitch_height, route_mvg);
+    }
+    if (frame_id > 0 && draw_labels) {
+        const uint64_t labels_hash = write_labels_mvg(labels_mvg, &tr, frame, dpi, runs, runs_len);
+        stitch_hash = hash_bytes(stitch_hash, &labels_hash, sizeof(labels_hash));
+        stitch_cmd_len += snprintf(stitch_cmd + stitch_cmd_len, STITCH_CMD_CAP - stitch_cmd_len, " -draw @%s", labels_mvg);
+    }
+
+    if (frame_id > 0) {
+        const int jpeg = strcmp(ext, "jpg") == 0;
+        if (jpeg) stitch_hash = hash_bytes(stitch_hash, &JPEG_QUALITY, sizeof(JPEG_QUALITY));
+        else stitch_hash = hash_bytes(stitch_hash, ext, strlen(ext));
+        snprintf(map_file, map_file_size, CACHE_DIR"/maps/%016lx.%s", stitch_hash, ext);
+
+        if (file_exists(map_file)) {
+            printf("[INFO] Reusing map     [%s]\n", map_file);
+            cache_touch(map_file);
+        } else {
+            if (jpeg) {
+                stitch_cmd_len += snprintf(stitch_cmd + stitch_cmd_len, STITCH_CMD_CAP - stitch_cmd_len,
+                    " -strip -sampling-factor 4:2:0 -define jpeg:optimize-coding=true -quality %ld", JPEG_QUALITY);
+            }
+            char map_part[80] = {0};
+            part_name(map_part, 80, map_file);
+            snprintf(stitch_cmd + stitch_cmd_len, STITCH_CMD_CAP - stitch_cmd_len, " %s:%s"
+#ifdef _WIN32
+                " > nul"
+#else
+                " 2> /dev/null"
+#endif
+            , jpeg ? "JPG" : "PNG", map_part);
+            // printf("[STITCH] %s\n", stitch_cmd);
+            printf("[INFO] Stitching map   [sheets=%ld]... ", frame_id);
+            fflush(stdout);
+            const StageMark stitch_mark = stage_begin();
+            const int stitched = system(stitch_cmd) == 0 && rename_part(map_file) == 0;
+            stage_end(STAGE_MAP_STITCH, &stitch_mark);
+            if (stitched) printf("done!\n");
+            else printf("failed!\n");
+        }
+    }
+    free(stitch_cmd);
+    remove(route_mvg);
+    remove(labels_mvg);
+
+    const size_t sheets = frame_id > 0 && file_exists(map_file) ? frame_id : 0;
+    if (WATCH && sheets > 0) {
+        watch_map_key = watch_key;
+        snprintf(watch_map_file, 64, "%s", map_file);
+        watch_map_sheets = sheets;
+    }
+    return sheets;
+}
+
+// Prints one map page showing the frame, with the stretches of the route inside of it.
+// Returns -1 when the page is left without the map image.
+int print_map_page(String_Builder* sb, const MapFrame* frame, const PathRun* runs, const size_t runs_len, const size_t page, const size_t pages) {
+    int embedded = 0;
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\pagebreak\n");
+    sb_append_cstr(sb, "\n");
+
+    sb_append_cstr(sb, "    \\begin{center}\n");
+    sb_appendf(sb, "        \\textsc{\\Large %s}\n", name);
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "        \\vspace{0.5ex}\n");
+    sb_append_cstr(sb, "\n");
+    if (pages > 1) sb_appendf(sb, "\\textsc{\\small Carta topografica, foglio %ld di %ld}\n", page + 1, pages);
+    else sb_append_cstr(sb, "\\textsc{\\small Carta topografica}\n");
+    sb_append_cstr(sb, "    \\end{center}\n");
+
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\vspace{2ex}\n");
+    sb_append_cstr(sb, "\n");
+
+    {
+        const uint64_t minE = frame->minE, maxE = frame->maxE, minN = frame->minN, maxN = frame->maxN;
+        const uint64_t width = frame->width, height = frame->height;
+        const double max_size = frame->max_size;
+
+        const double cell_size = MAP_CELL_SIZE;
+        const size_t decimals = plot_decimals(cell_size);
+        sb_appendf(sb, "\\begin{center}\n\\begin{tikzpicture}[x=%lfcm,y=%lfcm, step=%lfcm", cell_size, cell_size, cell_size);
+        if (height > width) {
+            sb_append_cstr(sb, ", rotate=270, transform shape");
+        }
+        sb_append_cstr(sb, "] \n");
+
+        double scale = (double) height / (max_size * cell_size * 0.01);
+        printf("Map scale: 1:%ld\n", (uint64_t) round(scale));
+        // sb_appendf(sb, "\\draw[very thin,color=black!10] (0.0,0.0) grid (%.1lf,-%.1lf);\n", 30.0+0.5, 20.0+0.5);
+
+        char map_file[64] = {0};
+        int route_rasterized = 0;
+        if (map_raster(frame, TARGET_DPI, runs, runs_len, RASTER_ROUTE, 0, "jpg", map_file, 64) > 0) {
+            route_rasterized = RASTER_ROUTE;
+            embedded = 1;
+
+            // the stitched image covers the whole frame
+            double x = map((minE + maxE) / 2.0, minE, minE + height, 0.0, max_size);
+            double y = map((minN + maxN) / 2.0, maxN, minN, 0.0, max_size);
+            double w = ((double) (maxE - minE) / (double) height) * cell_size * max_size;
+            double h = ((double) (maxN - minN) / (double) height) * cell_size * max_size;
+
+            sb_appendf(sb, "\\node[inner sep=0pt] (russel) at (%lf, -%lf) {\\includegraphics[width=%lfcm, height=%lfcm]{%s}};\n", x, y, w, h, map_file);
+        }
+
+        if (!route_rasterized) {
+            sb_append_cstr(sb, "\\begin{scope}[transparency group, opacity=0.50]\n");
+            // stretches leave the frame of an atlas page
+            if (pages > 1) {
+                sb_append_cstr(sb, "\\clip ");
+                sb_append_point(sb, map(minE, minE, minE+height, 0.0, max_size), map(minN, maxN, minN, 0.0, -max_size), decimals);
+                sb_append_cstr(sb, " rectangle ");
+                sb_append_point(sb, map(maxE, minE, minE+height, 0.0, max_size), map(maxN, maxN, minN, 0.0, -max_size), decimals);
+                sb_append_cstr(sb, ";\n");
+            }
+
+            // printf("2: %lf %lf %lf %lf", (double) minE, (double) minE+height, 0.0, max_size);
+            size_t index_step = max(path_len / GRAPH_POINTS_COUNT, 1);
+            for (size_t r = 0; r < runs_len; r++) {
+                sb_append_cstr(sb, "\\draw[red, line width=1.5pt] plot[smooth] coordinates{");
+                for (size_t i = runs[r].first; i <= runs[r].last; i ++) {
+                    if (i % index_step == 0 || i == runs[r].last) {
+                        sb_append_point(sb,
+                            map(path[i].e, minE, minE+height, 0.0, max_size),
+                            map(path[i].n, maxN, minN, 0.0, -max_size), decimals);
+                        sb_append_buf(sb, " ", 1);
+                    }
+                }
+                sb_append_cstr(sb, "};\n");
+            }
+            for (size_t i = 0; i < waypoints_len; i++) {
+                if (!path_runs_contain(runs, runs_len, waypoints[i].idx)) continue;
+                sb_append_cstr(sb, "\\filldraw[red] ");
+                sb_append_point(sb,
+                    map(waypoints[i].e, minE, minE+height, 0.0, max_size),
+                    map(waypoints[i].n, maxN, minN, 0.0, -max_size), decimals);
+                sb_append_cstr(sb, " circle (2.25pt);\n");
+            }
+
+            sb_append_cstr(sb, "\\end{scope}\n");
+        }
+
+        // sb_append_cstr(sb, "\\begin{scope}[transparency group, opacity=1.0]\n");
+
+        size_t directions[WAYPOINTS_CAPACITY] = {0};
+        place_labels(frame, runs, runs_len, directions);
+
+        char wp_name[2] = {0};
+        for (size_t i = 0; i < waypoints_len; i++) {
+            if (!path_runs_contain(runs, runs_len, waypoints[i].idx)) continue;
+            size_t wp_name_len = waypoint_name(i, wp_name);
+            // printf("%.*s (%ld/%ld)\n", 2, wp_name, waypoints[i].idx, path_len);
+            const char* direction_str = directions_labels[directions[i]];
+            // printf("DIRECTION `%s`\n", direction_str);
+
+            sb_append_cstr(sb, "\\filldraw[red!90!black, fill opacity=0.0, draw opacity=0.0, text opacity=1.0] ");
+            sb_append_point(sb,
+                map(waypoints[i].e, minE, minE+height, 0.0, max_size),
+                map(waypoints[i].n, maxN, minN, 0.0, -max_size), decimals);
+            sb_appendf(sb, " circle (2.25pt) node[anchor=%s, inner sep=2.5mm]{\\textbf{\\contour{white}{\\small %.*s}}};\n",
+                direction_str,
+                (int) wp_name_len, wp_name);
+        }
+
+        sb_append_cstr(sb, "\\draw[black] ");
+        sb_append_point(sb, map(minE, minE, minE+height, 0.0, max_size), map(minN, maxN, minN, 0.0, -max_size), decimals);
+        sb_append_cstr(sb, " rectangle ");
+        sb_append_point(sb, map(maxE, minE, minE+height, 0.0, max_size), map(maxN, maxN, minN, 0.0, -max_size), decimals);
+        sb_append_cstr(sb, ";\n");
+
+        // NORTH ARROW
+        // sb_appendf(sb, "\\draw [-stealth, ultra thick, white]  (%lf,%lf) -- (%lf,%lf);\n",
+        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
+        //     map(maxN, maxN, minN, 0, -max_size) - 1.5,
+        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
+        //     map(maxN, maxN, minN, 0, -max_size) - 0.5);
+        // sb_appendf(sb, "\\draw [-stealth, thick, black]  (%lf,%lf) -- (%lf,%lf);\n",
+        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
+        //     map(maxN, maxN, minN, 0, -max_size) - 1.45,
+        //     map(maxE, minE, height+minE, 0, max_size) - 1.5,
+        //     map(maxN, maxN, minN, 0, -max_size) - 0.55);
+        // sb_appendf(sb, "\\filldraw[red] (%lf,%lf) circle (8pt) node[anchor=south west]{%s};\n", 0.0, 0.0, "B");
+        // sb_appendf(sb, "\\filldraw[red] (%lf,%lf) circle (2pt) node[anchor=south west]{%s};\n", 0.0, -20.0, "C");
+        // sb_appendf(sb, "\\filldraw[red] (%lf,%lf) circle (2pt) node[anchor=south west]{%s};\n", 20.0, -20.0, "D");
+        //  sb_append_cstr(sb, "\\end{scope}\n");
+
+        sb_append_cstr(sb, "\\end{tikzpicture}\n");
+        sb_append_cstr(sb, "\\end{center}\n");
+    }
+
+    if (!embedded) fprintf(stderr, "[ERROR] Map page %ld of %ld is without the map.\n", page + 1, pages);
+    return embedded ? 0 : -1;
+}
+
+// Centers a frame of `width` by `height` meters on a point.
+void map_frame_around(MapFrame* frame, const double e, const double n, const double width, const double height) {
+    frame->minE = (uint64_t) round(e - width / 2.0);
+    frame->maxE = (uint64_t) round(e + width / 2.0);
+    frame->minN = (uint64_t) round(n - height / 2.0);
+    frame->maxN = (uint64_t) round(n + height / 2.0);
+    frame->width = frame->maxE - frame->minE;
+    frame->height = frame->maxN - frame->minN;
+    frame->max_size = map_max_size(frame->width, frame->height);
+}
+
+// The points of the path sorted into square cells, to find the ones in a window
+// without going through the whole path.
+typedef struct {
+    double min_e, min_n;
+    double cell; // m
+    size_t cols, rows;
+    size_t* cell_first; // `cols * rows + 1` offsets into `points`
+    size_t* points; // indices of the path, cell after cell
+} PathGrid;
+
+size_t path_grid_col(const PathGrid* grid, const double e) {
+    const double col = floor((e - grid->min_e) / grid->cell);
+    return col < 0.0 ? 0 : col >= grid->cols ? grid->cols - 1 : (size_t) col;
+}
+
+size_t path_grid_row(const PathGrid* grid, const double n) {
+    const double row = floor((n - grid->min_n) / grid->cell);
+    return row < 0.0 ? 0 : row >= grid->rows ? grid->rows - 1 : (size_t) row;
+}
+
+void path_grid_build(PathGrid* grid, const double cell) {
+    double min_e = DBL_MAX, min_n = DBL_MAX, max_e = -DBL_MAX, max_n = -DBL_MAX;
+    for (size_t i = 0; i < path_len; i++) {
+        if (path[i].e < min_e) min_e = path[i].e;
+        if (path[i].e > max_e) max_e = path[i].e;
+        if (path[i].n < min_n) min_n = path[i].n;
+        if (path[i].n > max_n) max_n = path[i].n;
+    }
+    grid->min_e = min_e;
+    grid->min_n = min_n;
+    grid->cell = cell;
+    grid->cols = (size_t) ((max_e - min_e) / cell) + 1;
+    grid->rows = (size_t) ((max_n - min_n) / cell) + 1;
+
+    // counting sort of the points by cell, in the order of the path within a cell
+    const size_t cells = grid->cols * grid->rows;
+    grid->cell_first = calloc(cells + 1, sizeof(size_t));
+    grid->points = malloc(path_len * sizeof(size_t));
+    for (size_t i = 0; i < path_len; i++) {
+        grid->cell_first[path_grid_row(grid, path[i].n) * grid->cols + path_grid_col(grid, path[i].e) + 1]++;
+    }
+    for (size_t c = 0; c < cells; c++) grid->cell_first[c + 1] += grid->cell_first[c];
+    size_t* fill = malloc(cells * sizeof(size_t));
+    memcpy(fill, grid->cell_first, cells * sizeof(size_t));
+    for (size_t i = 0; i < path_len; i++) {
+        grid->points[fill[path_grid_row(grid, path[i].n) * grid->cols + path_grid_col(grid, path[i].e)]++] = i;
+    }
+    free(fill);
+}
+
+void path_grid_free(PathGrid* grid) {
+    free(grid->cell_first);
+    free(grid->points);
+}
+
+int index_cmp(const void* a, const void* b) {
+    const size_t ia = *(const size_t*) a;
+    const size_t ib = *(const size_t*) b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Finds the stretches of the path inside the frame, each with one more point at its
+// ends so the line reaches the border. Returns how many there are.
+size_t path_grid_runs(const PathGrid* grid, const MapFrame* frame, PathRun* runs) {
+    const size_t col0 = path_grid_col(grid, frame->minE), col1 = path_grid_col(grid, frame->maxE);
+    const size_t row0 = path_grid_row(grid, frame->minN), row1 = path_grid_row(grid, frame->maxN);
+
+    size_t inside_len = 0;
+    for (size_t row = row0; row <= row1; row++) {
+        inside_len += grid->cell_first[row * grid->cols + col1 + 1] - grid->cell_first[row * grid->cols + col0];
+    }
+    size_t* inside = malloc((inside_len + 1) * sizeof(size_t));
+    inside_len = 0;
+    for (size_t row = row0; row <= row1; row++) {
+        for (size_t k = grid->cell_first[row * grid->cols + col0]; k < grid->cell_first[row * grid->cols + col1 + 1]; k++) {
+            const Point* p = &path[grid->points[k]];
+            if (p->e >= frame->minE && p->e <= frame->maxE && p->n >= frame->minN && p->n <= frame->maxN)
+                inside[inside_len++] = grid->points[k];
+        }
+    }
+    qsort(inside, inside_len, sizeof(size_t), index_cmp);
+
+    size_t runs_len = 0;
+    for (size_t k = 0; k < inside_len; k++) {
+        const size_t first = inside[k] > 0 ? inside[k] - 1 : 0;
+        const size_t last = inside[k] + 1 < path_len ? inside[k] + 1 : path_len - 1;
+        if (runs_len > 0 && first <= runs[runs_len - 1].last + 1) {
+            runs[runs_len - 1].last = last;
+        } else {
+            runs[runs_len++] = (PathRun) { first, last };
+        }
+    }
+    free(inside);
+    return runs_len;
+}
+
+#define ATLAS_PAGES_CAP 256
+#define ATLAS_OVERLAP 0.1 // of the shorter side of a page, shown again on the next one
+
+MapFrame atlas_pages[ATLAS_PAGES_CAP] = {0};
+size_t atlas_pages_len = 0;
+PathRun* atlas_runs = NULL;
+size_t atlas_runs_first[ATLAS_PAGES_CAP + 1] = {0};
+SheetCrop* atlas_crops = NULL;
+size_t atlas_crops_len = 0;
+uint64_t atlas_sheet_ids[ATLAS_PAGES_CAP * FRAME_SHEETS_CAP] = {0};
+size_t atlas_sheet_ids_len = 0;
+
+// Walks the path and starts a new page where it leaves the current one. A page
+// takes the points as long as they fit, less the overlap, turned or not. Returns -1
+// when the route needs more than ATLAS_PAGES_CAP pages at this scale.
+int atlas_paginate() {
+    const double page_width = MAP_PAGE_WIDTH * MAP_CELL_SIZE / 100.0 * ATLAS_SCALE; // m
+    const double page_height = MAP_PAGE_HEIGHT * MAP_CELL_SIZE / 100.0 * ATLAS_SCALE;
+    const double margin = ATLAS_OVERLAP * page_height;
+    const double inner_width = page_width - 2.0 * margin, inner_height = page_height - 2.0 * margin;
+
+    atlas_pages_len = 0;
+    size_t i = 0;
+    while (i < path_len) {
+        double min_e = path[i].e, max_e = path[i].e, min_n = path[i].n, max_n = path[i].n;
+        int landscape = 1;
+        size_t j = i + 1;
+        for (; j < path_len; j++) {
+            const double e0 = path[j].e < min_e ? path[j].e : min_e, e1 = path[j].e > max_e ? path[j].e : max_e;
+            const double n0 = path[j].n < min_n ? path[j].n : min_n, n1 = path[j].n > max_n ? path[j].n : max_n;
+            const int fits_landscape = e1 - e0 <= inner_width && n1 - n0 <= inner_height;
+            const int fits_portrait = e1 - e0 <= inner_height && n1 - n0 <= inner_width;
+            if (!fits_landscape && !fits_portrait) break;
+            min_e = e0; max_e = e1; min_n = n0; max_n = n1;
+            landscape = fits_landscape;
+        }
+
+        if (atlas_pages_len == ATLAS_PAGES_CAP) {
+            fprintf(stderr, "[ERRORE] Troppe pagine per l'atlante a 1:%ld (più di %d), usare una scala più piccola.\n", ATLAS_SCALE, ATLAS_PAGES_CAP);
+            atlas_pages_len = 0;
+            return -1;
+        }
+        map_frame_around(&atlas_pages[atlas_pages_len++], (min_e + max_e) / 2.0, (min_n + max_n) / 2.0,
+            landscape ? page_width : page_height, landscape ? page_height : page_width);
+
+        // the next page starts from the last point of this one
+        i = j < path_len && j - 1 > i ? j - 1 : j;
+    }
+    return 0;
+}
+
+int atlas_crop_sheet(const size_t k) {
+    int result = 0;
+    for (size_t i = 0; i < atlas_crops_len; i++) {
+        if (atlas_crops[i].id != atlas_sheet_ids[k] || file_exists(atlas_crops[i].file)) continue;
+        if (make_crop(&atlas_crops[i]) != 0) result = -1;
+    }
+    return result;
+}
+
+int atlas_raster_route = 0, atlas_raster_labels = 0; // what the stitched pages have drawn in
+
+int atlas_stitch_page(const size_t k) {
+    char map_file[64] = {0};
+    const PathRun* runs = atlas_runs + atlas_runs_first[k];
+    const size_t runs_len = atlas_runs_first[k + 1] - atlas_runs_first[k];
+    return map_raster(&atlas_pages[k], TARGET_DPI, runs, runs_len, atlas_raster_route, atlas_raster_labels, "jpg", map_file, 64) > 0 ? 0 : -1;
+}
+
+// Covers the route with pages at a fixed scale and crops the sheets they need, each in
+// one process since the pages share them. The pages are left to stitch.
+int atlas_prepare() {
+    if (atlas_paginate() != 0) return -1;
+
+    const double page_height = MAP_PAGE_HEIGHT * MAP_CELL_SIZE / 100.0 * ATLAS_SCALE;
+    PathGrid grid = {0};
+    path_grid_build(&grid, page_height);
+
+    PathRun* runs = malloc(path_len * sizeof(PathRun));
+    size_t runs_len = 0;
+    atlas_runs = NULL;
+    for (size_t k = 0; k < atlas_pages_len; k++) {
+        const size_t page_runs_len = path_grid_runs(&grid, &atlas_pages[k], runs);
+        atlas_runs = realloc(atlas_runs, (runs_len + page_runs_len) * sizeof(PathRun));
+        memcpy(atlas_runs + runs_len, runs, page_runs_len * sizeof(PathRun));
+        atlas_runs_first[k] = runs_len;
+        runs_len += page_runs_len;
+    }
+    atlas_runs_first[atlas_pages_len] = runs_len;
+    free(runs);
+    path_grid_free(&grid);
+
+    printf("[INFO] Atlas: %ld pages at 1:%ld\n", atlas_pages_len, ATLAS_SCALE);
+
+    make_dir(CACHE_DIR);
+    make_dir(CACHE_DIR"/cog");
+    make_dir(CACHE_DIR"/crops");
+    make_dir(CACHE_DIR"/maps");
+
+    atlas_crops = calloc(atlas_pages_len * FRAME_SHEETS_CAP, sizeof(SheetCrop));
+    atlas_crops_len = 0;
+    atlas_sheet_ids_len = 0;
+    for (size_t k = 0; k < atlas_pages_len; k++) {
+        const RasterTransform tr = raster_transform(&atlas_pages[k], TARGET_DPI);
+        SheetCrop* crops = atlas_crops + atlas_crops_len;
+        const StageMark sheets_mark = stage_begin();
+        const size_t crops_len = frame_crops(&atlas_pages[k], &tr, raster_level(&tr), crops);
+        stage_end(STAGE_MAP_SHEETS, &sheets_mark);
+        for (size_t i = 0; i < crops_len; i++) {
+            int known = 0;
+            for (size_t s = 0; s < atlas_sheet_ids_len; s++) {
+                if (atlas_sheet_ids[s] == crops[i].id) known = 1;
+            }
+            if (!known) atlas_sheet_ids[atlas_sheet_ids_len++] = crops[i].id;
+        }
+        atlas_crops_len += crops_len;
+    }
+
+    parallel_run(atlas_sheet_ids_len, atlas_crop_sheet, JOBS);
+    return 0;
+}
+
+void atlas_free() {
+    free(atlas_crops);
+    free(atlas_runs);
+    atlas_crops = NULL;
+    atlas_runs = NULL;
+}
+
+// The pages are stitched in parallel before they are printed. Returns the number of
+// pages without their map.
+size_t print_atlas(String_Builder* sb) {
+    if (atlas_prepare() != 0) return 1;
+
+    atlas_raster_route = RASTER_ROUTE;
+    atlas_raster_labels = 0;
+    parallel_run(atlas_pages_len, atlas_stitch_page, JOBS);
+
+    size_t failed = 0;
+    for (size_t k = 0; k < atlas_pages_len; k++) {
+        failed += print_map_page(sb, &atlas_pages[k], atlas_runs + atlas_runs_first[k], atlas_runs_first[k + 1] - atlas_runs_first[k], k, atlas_pages_len) != 0;
+    }
+
+    atlas_free();
+    return failed;
+}
+
+// Returns -1 when a page is left without its map.
+int print_map(String_Builder* sb) {
+    const StageMark mark = stage_begin();
+    const time_t run_start = time(NULL);
+
+    int failed = 0;
+    if (ATLAS_SCALE > 0) {
+        failed = print_atlas(sb) > 0;
+    } else {
+        MapFrame frame = {0};
+        map_frame_fit(&frame);
+        const PathRun whole = { 0, path_len - 1 };
+        failed = print_map_page(sb, &frame, &whole, 1, 0, 1) != 0;
+    }
+
+    cache_gc(CACHE_DIR"/crops", run_start);
+    cache_gc(CACHE_DIR"/maps", run_start);
+    stage_end(STAGE_MAP, &mark);
+    return failed ? -1 : 0;
+}
+
+// Renders the map page as a PNG straight from the map sheets, without LaTeX:
+// same frame and labels as `print_map_page`, at screen resolution.
+int print_preview(const char* png_path) {
+    MapFrame frame = {0};
+    map_frame_fit(&frame);
+
+    const time_t run_start = time(NULL);
+    const PathRun whole = { 0, path_len - 1 };
+    char map_file[64] = {0};
+    const size_t sheets = map_raster(&frame, PREVIEW_DPI, &whole, 1, 1, 1, "png", map_file, 64);
+    cache_gc(CACHE_DIR"/crops", run_start);
+    cache_gc(CACHE_DIR"/maps", run_start);
+    if (sheets == 0) {
+        fprintf(stderr, "[ERROR] Could not render the map preview.\n");
+        return -1;
+    }
+
+    FILE* in = fopen(map_file, "rb");
+    FILE* out = fopen(png_path, "wb");
+    int ok = in != NULL && out != NULL;
+    char buffer[64 * 1024];
+    size_t read = 0;
+    while (ok && (read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ok = fwrite(buffer, 1, read, out) == read;
+    }
+    if (in != NULL) fclose(in);
+    if (out != NULL) fclose(out);
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Could not write `%s`.\n", png_path);
+        return -1;
+    }
+    printf("[INFO] Preview written to `%s`\n", png_path);
+    return 0;
+}
+
+// A minimal PDF writer: objects are numbered in advance so they can refer to each
+// other, written one after the other, and indexed by the cross-reference table at the end.
+#define PDF_OBJECTS_CAP 1024
+#define PDF_PT_PER_CM (72.0 / 2.54)
+
+typedef struct {
+    String_Builder out;
+    size_t offsets[PDF_OBJECTS_CAP]; // of object `id` in `out`, ids start at 1
+    size_t objects_len;
+} Pdf;
+
+void pdf_init(Pdf* pdf) {
+    *pdf = (Pdf) {0};
+    // the binary comment tells transfer programs the file is not text
+    sb_append_cstr(&pdf->out, "%PDF-1.4\n%\xe2\xe3\xcf\xd3\n");
+}
+
+size_t pdf_new_object(Pdf* pdf) {
+    assert(pdf->objects_len + 1 < PDF_OBJECTS_CAP && "Too many PDF objects");
+    return ++pdf->objects_len;
+}
+
+void pdf_begin_object(Pdf* pdf, const size_t id) {
+    pdf->offsets[id] = pdf->out.count;
+    sb_appendf(&pdf->out, "%ld 0 obj\n", id);
+}
+
+void pdf_end_object(Pdf* pdf) {
+    sb_append_cstr(&pdf->out, "endobj\n");
+}
+
+void pdf_stream_object(Pdf* pdf, const size_t id, const String_Builder* content) {
+    pdf_begin_object(pdf, id);
+    sb_appendf(&pdf->out, "<< /Length %ld >>\nstream\n", content->count);
+    sb_append_buf(&pdf->out, content->items, content->count);
+    sb_append_cstr(&pdf->out, "\nendstream\n");
+    pdf_end_object(pdf);
+}
+
+// one of the standard 14 fonts, which every reader has and which need no embedding
+void pdf_font_object(Pdf* pdf, const size_t id, const char* base_font) {
+    pdf_begin_object(pdf, id);
+    sb_appendf(&pdf->out, "<< /Type /Font /Subtype /Type1 /BaseFont /%s /Encoding /WinAnsiEncoding >>\n", base_font);
+    pdf_end_object(pdf);
+}
+
+void pdf_finish(Pdf* pdf, const size_t root) {
+    const size_t xref = pdf->out.count;
+    sb_appendf(&pdf->out, "xref\n0 %ld\n0000000000 65535 f \n", pdf->objects_len + 1);
+    for (size_t id = 1; id <= pdf->objects_len; id++) {
+        sb_appendf(&pdf->out, "%010ld 00000 n \n", pdf->offsets[id]);
+    }
+    sb_appendf(&pdf->out, "trailer\n<< /Size %ld /Root %ld 0 R >>\nstartxref\n%ld\n%%%%EOF\n", pdf->objects_len + 1, root, xref);
+}
+
+// Numbers in content streams always take a point, whatever the locale.
+void pdf_number(String_Builder* content, const double x) {
+    sb_append_short(content, x, 4);
+    sb_append_buf(content, " ", 1);
+}
+
+void pdf_point(String_Builder* content, const double x, const double y, const char* op) {
+    pdf_number(content, x);
+    pdf_number(content, y);
+    sb_append_cstr(content, op);
+    sb_append_buf(content, "\n", 1);
+}
+
+void pdf_curve_to(String_Builder* content, const double x1, const double y1, const double x2, const double y2, const double x3, const double y3) {
+    pdf_number(content, x1);
+    pdf_number(content, y1);
+    pdf_number(content, x2);
+    pdf_number(content, y2);
+    pdf_point(content, x3, y3, "c");
+}
+
+// widths of the printable ASCII characters of Helvetica, in thousandths of the font size
+const uint16_t helvetica_widths[95] = {
+    278, 278, 355, 556, 556, 889, 667, 191, 333, 333, 389, 584, 278, 333, 278, 278,
+    556, 556, 556, 556, 556, 556, 556, 556, 556, 556, 278, 278, 584, 584, 584, 556,
+    1015, 667, 667, 722, 722, 667, 611, 778, 722, 278, 500, 667, 556, 833, 722, 778,
+    667, 778, 722, 667, 611, 722, 667, 944, 667, 667, 611, 278, 278, 278, 469, 556,
+    333, 556, 556, 500, 556, 556, 278, 556, 556, 222, 222, 500, 222, 833, 556, 556,
+    556, 556, 333, 500, 278, 556, 500, 722, 500, 500, 500, 334, 260, 334, 584,
+};
+
+#define PDF_SYMBOL '\x01' // the next byte is a glyph of the Symbol font: "\x01" "D" is a Delta
+#define PDF_SYMBOL_STR "\x01"
+
+uint16_t symbol_width(const uint8_t c) {
+    switch (c) {
+    case 'D': return 612; // Delta
+    case 0xAD: case 0xAF: return 603; // arrowup, arrowdown
+    default: return 500;
+    }
+}
+
+// Decodes the next character of UTF-8 `*text` into WinAnsi, where Latin-1 lives at the
+// same codes, and moves past it; '?' for what WinAnsi does not have.
+uint8_t pdf_next_char(const char** text) {
+    const uint8_t* c = (const uint8_t*) *text;
+    if (c[0] < 0x80) {
+        *text += 1;
+        return c[0];
+    }
+    size_t len = c[0] >= 0xF0 ? 4 : c[0] >= 0xE0 ? 3 : 2;
+    for (size_t k = 1; k < len; k++) {
+        if (c[k] == '\0') len = k;
+    }
+    const uint32_t code = len == 2 ? ((uint32_t) (c[0] & 0x1F) << 6) | (c[1] & 0x3F) : '?';
+    *text += len;
+    return code >= 0xA0 && code <= 0xFF ? (uint8_t) code : '?';
+}
+
+double pdf_text_width(const char* text, const double size) {
+    double width = 0.0;
+    while (*text != '\0') {
+        if (*text == PDF_SYMBOL && text[1] != '\0') {
+            width += symbol_width((uint8_t) text[1]);
+            text += 2;
+            continue;
+        }
+        const uint8_t c = pdf_next_char(&text);
+        width += c >= 32 && c < 127 ? helvetica_widths[c - 32] : 556;
+    }
+    return width * size / 1000.0;
+}
+
+#define PDF_CAP_HEIGHT 0.718 // of Helvetica, times the font size
+
+// Shows UTF-8 `text` with its left end of the baseline at `x`, `y`; `align` is 0 for
+// left, 0.5 for centered, 1 for right aligned. Glyphs after PDF_SYMBOL come from the
+// Symbol font, which the page has as `F2`.
+void pdf_text(String_Builder* content, const char* font, const double size, const double x, const double y, const double align, const char* text) {
+    sb_appendf(content, "BT /%s ", font);
+    pdf_number(content, size);
+    sb_append_cstr(content, "Tf ");
+    pdf_number(content, x - align * pdf_text_width(text, size));
+    pdf_number(content, y);
+    sb_append_cstr(content, "Td (");
+    while (*text != '\0') {
+        if (*text == PDF_SYMBOL && text[1] != '\0') {
+            sb_append_cstr(content, ") Tj /F2 ");
+            pdf_number(content, size);
+            sb_append_cstr(content, "Tf (");
+            sb_append_buf(content, text + 1, 1);
+            sb_appendf(content, ") Tj /%s ", font);
+            pdf_number(content, size);
+            sb_append_cstr(content, "Tf (");
+            text += 2;
+            continue;
+        }
+        const char c = (char) pdf_next_char(&text);
+        if (c == '(' || c == ')' || c == '\\') sb_append_buf(content, "\\", 1);
+        sb_append_buf(content, &c, 1);
+    }
+    sb_append_cstr(content, ") Tj ET\n");
+}
+
+void pdf_line(String_Builder* content, const double x0, const double y0, const double x1, const double y1) {
+    pdf_point(content, x0, y0, "m");
+    pdf_point(content, x1, y1, "l");
+    sb_append_cstr(content, "S\n");
+}
+
+// The smooth curve through the points, as TikZ' plot[smooth] draws it: each piece of
+// the Catmull-Rom spline is the cubic Bézier with control points a sixth of the chord
+// of the neighbours away from its ends.
+void pdf_smooth_curve(String_Builder* content, const Vec2d* points, const size_t points_len) {
+    if (points_len == 0) return;
+    pdf_point(content, points[0].x, points[0].y, "m");
+    for (size_t i = 0; i + 1 < points_len; i++) {
+        const Vec2d p0 = points[i > 0 ? i - 1 : i], p1 = points[i], p2 = points[i + 1];
+        const Vec2d p3 = points[i + 2 < points_len ? i + 2 : i + 1];
+        pdf_curve_to(content,
+            p1.x + (p2.x - p0.x) / 6.0, p1.y + (p2.y - p0.y) / 6.0,
+            p2.x - (p3.x - p1.x) / 6.0, p2.y - (p3.y - p1.y) / 6.0,
+            p2.x, p2.y);
+    }
+    sb_append_cstr(content, "S\n");
+}
+
+// a small open arrow tip at `x`, `y` pointing along (`dx`, `dy`)
+void pdf_arrow_tip(String_Builder* content, const double x, const double y, const double dx, const double dy) {
+    const double length = 0.1, spread = 0.06; // cm
+    pdf_point(content, x - dx * length - dy * spread, y - dy * length + dx * spread, "m");
+    pdf_point(content, x, y, "l");
+    pdf_point(content, x - dx * length + dy * spread, y - dy * length - dx * spread, "l");
+    sb_append_cstr(content, "S\n");
+}
+
+void pdf_triangle(String_Builder* content, const double apex_x, const double apex_y, const double height) {
+    const double half_base = height / sqrt(3.0);
+    pdf_point(content, apex_x, apex_y, "m");
+    pdf_point(content, apex_x - half_base, apex_y - height, "l");
+    pdf_point(content, apex_x + half_base, apex_y - height, "l");
+    sb_append_cstr(content, "h B\n");
+}
+
+void pdf_dot(String_Builder* content, const double x, const double y, const double r) {
+    // four Bézier arcs
+    const double k = 0.5523 * r;
+    pdf_point(content, x + r, y, "m");
+    pdf_curve_to(content, x + r, y + k, x + k, y + r, x, y + r);
+    pdf_curve_to(content, x - k, y + r, x - r, y + k, x - r, y);
+    pdf_curve_to(content, x - r, y - k, x - k, y - r, x, y - r);
+    pdf_curve_to(content, x + k, y - r, x + r, y - k, x + r, y);
+    sb_append_cstr(content, "f\n");
+}
+
+#define PLOT_MAX_X 25.0 // cm
+#define PLOT_MAX_Y 15.0
+#define PROFILE_TEXT_SIZE (10.0 / 72.27 * 2.54) // cm, the size of the document font
+#define PROFILE_INNER_SEP (0.3333 * PROFILE_TEXT_SIZE) // cm, of TikZ nodes
+
+// the extent of the profile in cm, around the origin where the axes cross
+#define PROFILE_LEFT -0.95
+#define PROFILE_BOTTOM -0.6
+#define PROFILE_RIGHT 26.35
+#define PROFILE_TOP 15.8
+
+// Draws the elevation profile like the TikZ picture of the document, in cm from the
+// origin where the axes cross, with Helvetica as font `F1`. `km` is the length of the route.
+void draw_profile(String_Builder* content, const double km) {
+    sb_append_cstr(content, "1 J 1 j\n");
+
+    const double pt = 2.54 / 72.27; // cm
+    sb_append_cstr(content, "0.8 G ");
+    pdf_number(content, 0.1 * pt);
+    sb_append_cstr(content, "w\n");
+    for (size_t k = 0; k <= (size_t) PLOT_MAX_X; k++) pdf_line(content, k, 0.0, k, PLOT_MAX_Y + 0.5);
+    for (size_t h = 0; h <= (size_t) PLOT_MAX_Y; h++) pdf_line(content, 0.0, h, PLOT_MAX_X + 0.5, h);
+
+    sb_append_cstr(content, "0 G 0 g ");
+    pdf_number(content, 0.4 * pt);
+    sb_append_cstr(content, "w\n");
+    const double text = PROFILE_TEXT_SIZE, sep = PROFILE_INNER_SEP;
+    pdf_line(content, 0.0, -0.5, 0.0, PLOT_MAX_Y + 0.2);
+    pdf_arrow_tip(content, 0.0, PLOT_MAX_Y + 0.2, 0.0, 1.0);
+    pdf_text(content, "F1", text, 0.0, PLOT_MAX_Y + 0.2 + sep + 0.05, 0.5, "h [m]");
+    pdf_line(content, -0.5, 0.0, PLOT_MAX_X + 0.2, 0.0);
+    pdf_arrow_tip(content, PLOT_MAX_X + 0.2, 0.0, 1.0, 0.0);
+    pdf_text(content, "F1", text, PLOT_MAX_X + 0.2 + sep, -0.5 * PDF_CAP_HEIGHT * text, 0.0, "s [km]");
+
+    char label[32] = {0};
+    pdf_text(content, "F1", text, -sep, -sep - PDF_CAP_HEIGHT * text, 1.0, "0");
+    for (size_t h = 1; h < (size_t) PLOT_MAX_Y + 1; h++) {
+        pdf_line(content, -0.05, h, 0.05, h);
+        snprintf(label, 32, "%.0f", ((double) h /PLOT_MAX_Y) * 3000.0);
+        pdf_text(content, "F1", text, 0.05 - sep, h - 0.5 * PDF_CAP_HEIGHT * text, 1.0, label);
+    }
+    for (size_t k = 1; k < (size_t) PLOT_MAX_X + 1; k++) {
+        pdf_line(content, k, -0.05, k, 0.05);
+        snprintf(label, 32, "%.1f", round(((double) k /PLOT_MAX_X) * km * 10.0)/10.0);
+        pdf_text(content, "F1", text, k, 0.05 - sep - PDF_CAP_HEIGHT * text, 0.5, label);
+    }
+
+    const size_t index_step = max(path_len / GRAPH_POINTS_COUNT, 1);
+    Vec2d* points = malloc((path_len / index_step + 2) * sizeof(Vec2d));
+    size_t points_len = 0;
+    double max_ele = -DBL_MAX, min_ele = DBL_MAX;
+    double max_ele_x = 0.0, min_ele_x = 0.0;
+    double path_x = 0;
+    for (size_t i = 0; i < path_len; i ++) {
+        if (i > 0) path_x += distance(&path[i-1], &path[i]);
+        if (path[i].ele < min_ele) {
+            min_ele = path[i].ele;
+            min_ele_x = path_x;
+        }
+        if (path[i].ele > max_ele) {
+            max_ele = path[i].ele;
+            max_ele_x = path_x;
+        }
+        if (i % index_step == 0 || i == path_len - 1) {
+            points[points_len++] = (Vec2d) { map(path_x, 0, km, 0, PLOT_MAX_X), map(path[i].ele, 0, 3000.0, 0, PLOT_MAX_Y) };
+        }
+    }
+    pdf_smooth_curve(content, points, points_len);
+    free(points);
+
+    // the extremes, pointing at the curve from a quarter cm away
+    sb_append_cstr(content, "0.5 G 0.5 g\n");
+    double triangle_y = map(max_ele, 0, 3000.0, 0, PLOT_MAX_Y) - 0.25;
+    triangle_y = triangle_y < 0.0 ? 0.0 : triangle_y;
+    pdf_triangle(content, map(max_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y, 0.15);
+    triangle_y = map(min_ele, 0, 3000.0, 0, PLOT_MAX_Y) + 0.25;
+    triangle_y = triangle_y > PLOT_MAX_Y ? PLOT_MAX_Y : triangle_y;
+    pdf_triangle(content, map(min_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y, -0.15);
+
+    sb_append_cstr(content, "0 G 0 g\n");
+    char wp_name[3] = {0};
+    double x = 0;
+    for (size_t i = 0; i < waypoints_len; i++) {
+        const size_t wp_name_len = waypoint_name(i, wp_name);
+        wp_name[wp_name_len] = '\0';
+        const double px = map(x, 0, km, 0, PLOT_MAX_X), py = map(waypoints[i].ele, 0, 3000.0, 0, PLOT_MAX_Y);
+        pdf_dot(content, px, py, 2.0 * pt);
+        pdf_text(content, "F1", text, px + sep, py + sep, 0.0, wp_name);
+        x += segments[i].dst;
+    }
+}
+
+// The profile as a one page PDF in `CACHE_DIR/profiles`, named after its content.
+// Returns 0 and the path in `pdf_file` if it could be written.
+int write_profile_pdf(const double km, char* pdf_file, const size_t pdf_file_size) {
+    const time_t run_start = time(NULL);
+    const double left = PROFILE_LEFT, bottom = PROFILE_BOTTOM, right = PROFILE_RIGHT, top = PROFILE_TOP;
+
+    String_Builder content = {0};
+    pdf_number(&content, PDF_PT_PER_CM);
+    sb_append_cstr(&content, "0 0 ");
+    pdf_number(&content, PDF_PT_PER_CM);
+    pdf_point(&content, -left * PDF_PT_PER_CM, -bottom * PDF_PT_PER_CM, "cm");
+    draw_profile(&content, km);
+
+    Pdf pdf = {0};
+    pdf_init(&pdf);
+    const size_t catalog = pdf_new_object(&pdf), pages = pdf_new_object(&pdf), page = pdf_new_object(&pdf);
+    const size_t font = pdf_new_object(&pdf), contents = pdf_new_object(&pdf);
+
+    pdf_begin_object(&pdf, catalog);
+    sb_appendf(&pdf.out, "<< /Type /Catalog /Pages %ld 0 R >>\n", pages);
+    pdf_end_object(&pdf);
+    pdf_begin_object(&pdf, pages);
+    sb_appendf(&pdf.out, "<< /Type /Pages /Kids [%ld 0 R] /Count 1 >>\n", page);
+    pdf_end_object(&pdf);
+    pdf_begin_object(&pdf, page);
+    sb_appendf(&pdf.out, "<< /Type /Page /Parent %ld 0 R /MediaBox [0 0 %ld %ld] /Resources << /Font << /F1 %ld 0 R >> >> /Contents %ld 0 R >>\n",
+        pages, (uint64_t) ceil((right - left) * PDF_PT_PER_CM), (uint64_t) ceil((top - bottom) * PDF_PT_PER_CM), font, contents);
+    pdf_end_object(&pdf);
+    pdf_font_object(&pdf, font, "Helvetica");
+    pdf_stream_object(&pdf, contents, &content);
+    pdf_finish(&pdf, catalog);
+    sb_free(&content);
+
+    make_dir(CACHE_DIR);
+    make_dir(CACHE_DIR"/profiles");
+    snprintf(pdf_file, pdf_file_size, CACHE_DIR"/profiles/%016lx.pdf", hash_bytes(HASH_SEED, pdf.out.items, pdf.out.count));
+    int result = 0;
+    if (file_exists(pdf_file)) {
+        cache_touch(pdf_file);
+    } else {
+        char part_file[272] = {0};
+        part_name(part_file, 272, pdf_file);
+        FILE* fp = fopen(part_file, "wb");
+        result = fp != NULL && fwrite(pdf.out.items, 1, pdf.out.count, fp) == pdf.out.count ? 0 : -1;
+        if (fp != NULL) fclose(fp);
+        if (result == 0) result = rename_part(pdf_file);
+    }
+    sb_free(&pdf.out);
+    cache_gc(CACHE_DIR"/profiles", run_start);
+    return result;
+}
+
+typedef struct {
+    double min_h, max_h; // m
+    double up, down; // m, climbed and descended
+    double s, kms; // km, kms, the sums of the segments
+    uint64_t time; // minutes, without the pauses
+} RouteTotals;
+
+// The totals of the route, `s` and `kms` being the sums of the segments.
+RouteTotals route_totals(const double s, const double kms) {
+    double minh = 3000, maxh = 0;
+    double updh_sum[2048] = {0};
+    double downdh_sum[2048] = {0};
+    dsum_clear(updh_sum);
+    dsum_clear(downdh_sum);
+    for (size_t i = 0; i < path_len; i++) {
+        Point p = path[i];
+        if (p.ele < minh) minh = p.ele;
+        if (p.ele > maxh) maxh = p.ele;
+        if (i > 0) {
+            Point p_ = path[i-1];
+            double dh = p.ele - p_.ele;
+            if (dh > 0.0) dsum_add(updh_sum, dh); else dsum_add(downdh_sum, -dh);
+        }
+    }
+    // printf("%lf\n", dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh);
+
+    // // DIRTY HACK
+    // double counting_error = dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh;
+    // if (counting_error < 0.0) {
+    //     dsum_add(downdh_sum, counting_error);
+    // } else {
+    //     dsum_add(updh_sum, -counting_error);
+    // }
+    // printf("%lf\n", dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh);
+
+    return (RouteTotals) {
+        minh, maxh, dsum_return(updh_sum), dsum_return(downdh_sum), s, kms,
+        (uint64_t) round(60.0 * kms / (FACTOR * ADJUSTMENT_FACTOR)),
+    };
+}
+
+// A line of the marching table: the waypoint, where the route stands when reaching it
+// and the segment on to the next one. Every output reads these, so the table is only
+// worked out once.
+typedef struct {
+    char name[3];
+    double e, n; // lv95
+    double ele; // m
+    double s, kms; // km, kms, from the start
+    uint64_t t; // minutes since midnight of the day of the start, on arrival
+    uint64_t pause; // minutes
+    PathSegmentData next; // to the next waypoint, zeros for the last one
+} MarchRow;
+
+MarchRow march[WAYPOINTS_CAPACITY] = {0};
+RouteTotals march_totals = {0};
+
+void calculate_march() {
+    double km = 0, kms = 0;
+    uint64_t t = START_TIME;
+    for (size_t i = 0; i < waypoints_len; i++) {
+        MarchRow* row = &march[i];
+        *row = (MarchRow) {0};
+        const size_t name_len = waypoint_name(i, row->name);
+        row->name[name_len] = '\0';
+        row->e = waypoints[i].e;
+        row->n = waypoints[i].n;
+        row->ele = waypoints[i].ele;
+        row->s = km;
+        row->kms = kms;
+        row->t = t;
+        row->pause = segments[i].pause;
+        if (i < waypoints_len-1) {
+            row->next = segments[i];
+            km += segments[i].dst;
+            kms += segments[i].kms;
+            t += segments[i].t + segments[i].pause;
+        }
+    }
+    march_totals = route_totals(km, kms);
+}
+
+// The marching table as records for other programs, one sink per format. The numbers
+// are written the same in every locale: m, km, kms and minutes, the times counted from
+// midnight of the day of the start.
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_JSON, // one object per line
+    EXPORT_BIN,
+    EXPORTS_COUNT,
+} ExportFormat;
+
+const char* export_extensions[EXPORTS_COUNT] = { "csv", "jsonl", "bin" };
+
+#define EXPORT_CSV_HEADER "tour,kind,name,e,n,ele,dh,dst,dkms,dt,s,kms,t,pause,min_h,max_h,up,down\n"
+#define EXPORT_BIN_MAGIC "TBLMARC1"
+
+// A record of the binary export, little endian on the usual machines: a waypoint
+// ('W', the segment fields about the way on to the next one) or the totals of a tour
+// ('T', after its waypoints), always 128 bytes.
+typedef struct {
+    char kind;
+    char name[3];
+    uint32_t index; // of the waypoint, how many there are for the totals
+    double e, n, ele;
+    double dh, dst, dkms;
+    double s, kms;
+    double min_h, max_h, up, down;
+    uint64_t dt, t, pause;
+} ExportRecord;
+
+void export_string(String_Builder* sb, const char* str, const int json) {
+    sb_append_buf(sb, "\"", 1);
+    for (const char* c = str; *c != '\0'; c++) {
+        if (*c == '"') sb_append_cstr(sb, json ? "\\\"" : "\"\"");
+        else if (json && *c == '\\') sb_append_cstr(sb, "\\\\");
+        else if (json && (uint8_t) *c < 0x20) sb_appendf(sb, "\\u%04x", (uint8_t) *c);
+        else sb_append_buf(sb, c, 1);
+    }
+    sb_append_buf(sb, "\"", 1);
+}
+
+// `key` and `x` in the format of the sink: ',x' in CSV, ',"key":x' in JSON.
+void export_number(String_Builder* sb, const int json, const char* key, const double x, const size_t decimals) {
+    if (json) sb_appendf(sb, ",\"%s\":", key);
+    else sb_append_buf(sb, ",", 1);
+    sb_append_short(sb, x, decimals);
+}
+
+void export_header(FILE* sink, const ExportFormat format) {
+    if (format == EXPORT_CSV) {
+        fputs(EXPORT_CSV_HEADER, sink);
+    } else if (format == EXPORT_BIN) {
+        fwrite(EXPORT_BIN_MAGIC, 1, 8, sink);
+    }
+}
+
+size_t export_header_size(const ExportFormat format) {
+    return format == EXPORT_CSV ? strlen(EXPORT_CSV_HEADER) : format == EXPORT_BIN ? 8 : 0;
+}
+
+// Writes the rows of `march` and the totals to `sink` one record at a time.
+void export_march(FILE* sink, const ExportFormat format) {
+    const int json = format == EXPORT_JSON;
+    String_Builder sb = {0};
+    for (size_t i = 0; i <= waypoints_len; i++) {
+        const int totals = i == waypoints_len;
+        const MarchRow* row = &march[totals ? 0 : i];
+        const RouteTotals* tot = &march_totals;
+
+        if (format == EXPORT_BIN) {
+            ExportRecord record = {0};
+            record.kind = totals ? 'T' : 'W';
+            record.index = (uint32_t) i;
+            if (totals) {
+                record.s = tot->s;
+                record.kms = tot->kms;
+                record.t = tot->time;
+                record.min_h = tot->min_h;
+                record.max_h = tot->max_h;
+                record.up = tot->up;
+                record.down = tot->down;
+            } else {
+                memcpy(record.name, row->name, 3);
+                record.e = row->e;
+                record.n = row->n;
+                record.ele = row->ele;
+                record.dh = row->next.dh;
+                record.dst = row->next.dst;
+                record.dkms = row->next.kms;
+                record.dt = row->next.t;
+                record.s = row->s;
+                record.kms = row->kms;
+                record.t = row->t;
+                record.pause = row->pause;
+            }
+            fwrite(&record, sizeof(record), 1, sink);
+            continue;
+        }
+
+        sb.count = 0;
+        if (json) sb_append_cstr(&sb, "{\"tour\":");
+        export_string(&sb, name, json);
+        sb_append_cstr(&sb, json ? ",\"kind\":" : ",");
+        sb_append_cstr(&sb, totals ? "\"totals\"" : "\"waypoint\"");
+        if (totals) {
+            if (!json) sb_append_cstr(&sb, ",,,,,,,,");
+            export_number(&sb, json, "s", tot->s, 3);
+            export_number(&sb, json, "kms", tot->kms, 3);
+            export_number(&sb, json, "t", (double) tot->time, 0);
+            if (!json) sb_append_cstr(&sb, ",");
+            export_number(&sb, json, "min_h", tot->min_h, 1);
+            export_number(&sb, json, "max_h", tot->max_h, 1);
+            export_number(&sb, json, "up", tot->up, 1);
+            export_number(&sb, json, "down", tot->down, 1);
+        } else {
+            sb_append_cstr(&sb, json ? ",\"name\":" : ",");
+            export_string(&sb, row->name, json);
+            export_number(&sb, json, "e", row->e, 0);
+            export_number(&sb, json, "n", row->n, 0);
+            export_number(&sb, json, "ele", row->ele, 1);
+            // the last waypoint has no segment after it
+            if (i < waypoints_len-1) {
+                export_number(&sb, json, "dh", row->next.dh, 1);
+                export_number(&sb, json, "dst", row->next.dst, 3);
+                export_number(&sb, json, "dkms", row->next.kms, 3);
+                export_number(&sb, json, "dt", (double) row->next.t, 0);
+            } else {
+                sb_append_cstr(&sb, json ? ",\"dh\":null,\"dst\":null,\"dkms\":null,\"dt\":null" : ",,,,");
+            }
+            export_number(&sb, json, "s", row->s, 3);
+            export_number(&sb, json, "kms", row->kms, 3);
+            export_number(&sb, json, "t", (double) row->t, 0);
+            export_number(&sb, json, "pause", (double) row->pause, 0);
+            if (!json) sb_append_cstr(&sb, ",,,,");
+        }
+        sb_append_cstr(&sb, json ? "}\n" : "\n");
+        fwrite(sb.items, 1, sb.count, sink);
+    }
+    sb_free(&sb);
+}
+
+// Writes the table to `path` in `format`. With `append` the records go after the
+// ones already there, so that a batch of runs fills one file.
+int write_export(const char* path, const ExportFormat format, const int append) {
+    FILE* sink = fopen(path, append ? "ab" : "wb");
+    if (sink == NULL) {
+        fprintf(stderr, "[ERROR] Could not write `%s`.\n", path);
+        return -1;
+    }
+    fseek(sink, 0, SEEK_END);
+    if (ftell(sink) == 0) export_header(sink, format);
+    export_march(sink, format);
+    const int result = ferror(sink) ? -1 : 0;
+    fclose(sink);
+    if (result == 0) printf("[INFO] Table written to `%s`\n", path);
+    else fprintf(stderr, "[ERROR] Could not write `%s`.\n", path);
+    return result;
+}
+
+// Whole runs are kept in CACHE_DIR/results, named after a hash of the GPX file and of
+// everything that changes the outputs: the same route with the same parameters gets
+// the stored files back without parsing, maps or XeLaTeX.
+#define RESULT_FORMAT_VERSION 1 // bump when the outputs change for the same input
+
+typedef struct {
+    const char* ext; // of the file in the cache
+    char path[128];
+    int export_format; // -1 for the document
+    int append; // the records go after the ones of the file
+    size_t offset; // size of the appended file before this run
+} ResultArtifact;
+
+#define RESULT_ARTIFACTS_CAP 8
+
+uint64_t result_key(const uint64_t source_hash, const int* options, const size_t options_len) {
+    const uint64_t version = RESULT_FORMAT_VERSION;
+    uint64_t hash = hash_bytes(HASH_SEED, &version, sizeof(version));
+    hash = hash_bytes(hash, &source_hash, sizeof(source_hash));
+    hash = hash_bytes(hash, options, options_len * sizeof(int));
+    hash = hash_bytes(hash, &FACTOR, sizeof(FACTOR));
+    hash = hash_bytes(hash, &ADJUSTMENT_FACTOR, sizeof(ADJUSTMENT_FACTOR));
+    hash = hash_bytes(hash, &START_TIME, sizeof(START_TIME));
+    hash = hash_bytes(hash, pauses, sizeof(pauses));
+    const uint64_t map_options[] = { TARGET_DPI, JPEG_QUALITY, ATLAS_SCALE, (uint64_t) RASTER_ROUTE, (uint64_t) NATIVE_PROFILE };
+    return hash_bytes(hash, map_options, sizeof(map_options));
+}
+
+void result_file(const uint64_t key, const ResultArtifact* artifact, char* path, const size_t path_size) {
+    snprintf(path, path_size, CACHE_DIR"/results/%016lx.%s", key, artifact->ext);
+}
+
+// Copies `from` past its first `skip` bytes to the end of `to`.
+int copy_bytes(const char* from, const size_t skip, FILE* to) {
+    FILE* fp = fopen(from, "rb");
+    if (fp == NULL) return -1;
+    fseek(fp, (long) skip, SEEK_SET);
+    char buf[64 * 1024];
+    size_t n = 0;
+    int result = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (fwrite(buf, 1, n, to) != n) result = -1;
+    }
+    if (ferror(fp)) result = -1;
+    fclose(fp);
+    return result;
+}
+
+// Counts hits and misses in CACHE_DIR/results.stats and reports them. The file is
+// locked while it is updated, the workers of --serve count at the same time.
+void result_stats(const int hit, const uint64_t key) {
+    uint64_t hits = 0, misses = 0;
+    make_dir(CACHE_DIR);
+#ifndef _WIN32
+    const int fd = open(CACHE_DIR"/results.stats", O_RDWR | O_CREAT, 0644);
+    FILE* fp = fd >= 0 ? fdopen(fd, "r+") : NULL;
+    if (fd >= 0 && fp == NULL) close(fd);
+    if (fp != NULL) flock(fd, LOCK_EX);
+#else
+    FILE* fp = fopen(CACHE_DIR"/results.stats", "r+");
+    if (fp == NULL) fp = fopen(CACHE_DIR"/results.stats", "w+");
+#endif
+    if (fp != NULL && fscanf(fp, "hits %lu misses %lu", &hits, &misses) != 2) hits = misses = 0;
+    if (hit) hits++; else misses++;
+
+    if (fp != NULL) {
+        // the counts only grow, the new line covers the old one
+        rewind(fp);
+        fprintf(fp, "hits %lu misses %lu\n", hits, misses);
+        fclose(fp); // and with it the lock
+    }
+    printf("[INFO] Result cache %s [%016lx] (hits: %ld, misses: %ld)\n", hit ? "hit" : "miss", key, hits, misses);
+}
+
+// Whether the images a stored LaTeX document includes from the cache (the map, the
+// profile) are still there: they live in caches of their own and may have been
+// removed since. Those found are marked as used.
+int result_images_exist(const char* tex_path) {
+    FILE* fp = fopen(tex_path, "rb");
+    if (fp == NULL) return 0;
+
+    String_Builder tex = {0};
+    char buf[16 * 1024];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sb_append_buf(&tex, buf, n);
+    fclose(fp);
+    sb_append_buf(&tex, "", 1);
+
+    int exist = 1;
+    for (const char* image = strstr(tex.items, "{"CACHE_DIR"/"); image != NULL && exist; image = strstr(image + 1, "{"CACHE_DIR"/")) {
+        char image_path[256] = {0};
+        const size_t len = strcspn(image + 1, "}\n");
+        snprintf(image_path, 256, "%.*s", (int) len, image + 1);
+        exist = file_exists(image_path);
+        if (exist) cache_touch(image_path);
+    }
+    sb_free(&tex);
+    return exist;
+}
+
+// Writes the stored outputs of the run `key` in place, if all of them are there.
+// The exports given a file are added to it like a run would.
+int result_restore(const uint64_t key, const ResultArtifact* artifacts, const size_t artifacts_len) {
+    char path[256] = {0};
+    for (size_t k = 0; k < artifacts_len; k++) {
+        result_file(key, &artifacts[k], path, 256);
+        if (!file_exists(path)) return 0;
+        if (strcmp(artifacts[k].ext, "tex") == 0 && !result_images_exist(path)) return 0;
+    }
+
+    for (size_t k = 0; k < artifacts_len; k++) {
+        const ResultArtifact* artifact = &artifacts[k];
+        result_file(key, artifact, path, 256);
+        cache_touch(path);
+
+        FILE* out = fopen(artifact->path, artifact->append ? "ab" : "wb");
+        if (out == NULL) {
+            fprintf(stderr, "[ERROR] Could not write `%s`.\n", artifact->path);
+            return 0;
+        }
+        fseek(out, 0, SEEK_END);
+        if (artifact->export_format >= 0 && ftell(out) == 0) export_header(out, (ExportFormat) artifact->export_format);
+        const int result = copy_bytes(path, 0, out);
+        fclose(out);
+        if (result != 0) return 0;
+        printf("[INFO] Restored `%s`\n", artifact->path);
+    }
+    result_stats(1, key);
+    return 1;
+}
+
+// Keeps the outputs of this run under `key`, the exports without their header.
+void result_store(const uint64_t key, const ResultArtifact* artifacts, const size_t artifacts_len) {
+    const time_t run_start = time(NULL);
+    make_dir(CACHE_DIR);
+    make_dir(CACHE_DIR"/results");
+
+    char path[256] = {0}, part_path[272] = {0};
+    for (size_t k = 0; k < artifacts_len; k++) {
+        const ResultArtifact* artifact = &artifacts[k];
+        size_t skip = artifact->offset;
+        if (artifact->export_format >= 0) {
+            const size_t header_size = export_header_size((ExportFormat) artifact->export_format);
+            if (skip < header_size) skip = header_size;
+        }
+
+        result_file(key, artifact, path, 256);
+        part_name(part_path, 272, path);
+        FILE* out = fopen(part_path, "wb");
+        if (out == NULL) return;
+        const int result = copy_bytes(artifact->path, skip, out);
+        fclose(out);
+        if (result != 0 || rename_part(path) != 0) {
+            remove(part_path);
+            return;
+        }
+    }
+    cache_gc(CACHE_DIR"/results", run_start);
+}
+
+#define DOC_MARGIN 1.0
+
+// Everything before \begin{document}, the same for every document: it goes into the
+// precompiled format.
+void print_latex_preamble(String_Builder* sb) {
+    sb_append_cstr(sb, "\\documentclass[a4paper,10pt,landscape]{article}\n");
+    sb_append_cstr(sb, "\\usepackage[outline,copies]{contour}\n");
+    sb_append_cstr(sb, "\\usepackage{multirow}\n");
+    sb_appendf(sb, "\\usepackage[margin=%.0fcm]{geometry}\n", DOC_MARGIN);
+    sb_append_cstr(sb, "\\usepackage{microtype}\n");
+    sb_append_cstr(sb, "\\usepackage{longtable}\n");
+    sb_append_cstr(sb, "\\usepackage{graphicx}\n");
+    sb_append_cstr(sb, "\\usepackage{tikz}\n");
+    sb_append_cstr(sb, "\\usepgflibrary{plotmarks}\n");
+    sb_append_cstr(sb, "\\usepgflibrary{shapes.geometric}\n");
+    sb_append_cstr(sb, "\\usetikzlibrary{positioning}\n");
+}
+
+// The elevation profile as a TikZ picture, `km` is the length of the route.
+void print_profile_tikz(String_Builder* sb, const double km) {
+    char wp_name[2] = "  ";
+    #define CELL_SIZE 1.0
+    const size_t decimals = plot_decimals(CELL_SIZE);
+    sb_appendf(sb, "    \\begin{center}\\begin{tikzpicture}[x=%lfcm,y=%lfcm, step=%lfcm]\n", CELL_SIZE, CELL_SIZE, CELL_SIZE);
+
+        sb_appendf(sb, "\\draw[very thin,color=black!20] (0.0,0.0) grid (%.1f,%.1f);\n", PLOT_MAX_X+0.5, PLOT_MAX_Y+0.5);
+
+        sb_appendf(sb, "\\draw[->] (0,-0.5) -- (0,%.1f) node[above] {$h \\hphantom{i} [m]$};\n", PLOT_MAX_Y+0.2);
+        sb_appendf(sb, "\\draw[->] (-0.5,0) -- (%.1f,0) node[right] {$s \\hphantom{i} [km]$};\n", PLOT_MAX_X+0.2);
+
+        sb_append_cstr(sb, "\\filldraw[black] (0,0) rectangle (0.0,0.0) node[anchor=north east]{0};\n");
+
+        for (size_t h = 1; h < (size_t) PLOT_MAX_Y + 1; h++) {
+            sb_appendf(sb, "\\filldraw[black] (-0.05,%ld) rectangle (0.05, %ld) node[anchor=east]{%.0f};\n", h, h, ((double) h /PLOT_MAX_Y) * 3000.0);
+        }
+
+        for (size_t k = 1; k < (size_t) PLOT_MAX_X + 1; k++) {
+            sb_appendf(sb, "\\filldraw[black] (%ld,-0.05) rectangle (%ld,0.05) node[anchor=north]{%.1f};\n", k, k, round(((double) k /PLOT_MAX_X) * km * 10.0)/10.0);
+        }
+
+        size_t index_step = max(path_len / GRAPH_POINTS_COUNT, 1);
+        // printf("PATH OPTIMIZATION: %ld %ld\n", path_len, index_step);
+        // sb_append_cstr(sb, "\\draw plot[smooth] coordinates{(0,0) ");
+        // {
+        //     double path_x = 0;
+        //     double path_kms;
+        //     for (size_t i = 0; i < path_len; i ++) {
+        //         if (i > 0) {
+        //             double dst = distance(&path[i-1], &path[i]);
+        //             double dh = path[i].ele - path[i-1].ele;
+        //             path_x += dst;
+
+        //             path_kms += calculate_kms(dst, dh);
+        //         }
+
+        //         if (i % index_step == 0 || i == path_len - 1)
+        //             sb_appendf(sb, "(%f, %f) ",
+        //                 map(path_x, 0, km, 0, PLOT_MAX_X),
+        //                 map(path_kms, 0, kms, 0, PLOT_MAX_Y));
+        //     }
+        // }
+        // sb_append_cstr(sb, "};\n");
+
+        sb_append_cstr(sb, "\\draw plot[smooth] coordinates{");
+        double max_ele = -DBL_MAX, min_ele = DBL_MAX;
+        double max_ele_x = 0.0, min_ele_x = 0.0;
+        {
+            double path_x = 0;
+            for (size_t i = 0; i < path_len; i ++) {
+                if (i > 0) path_x += distance(&path[i-1], &path[i]);
+                if (path[i].ele < min_ele) {
+                        min_ele = path[i].ele;
+                        min_ele_x = path_x;
+                }
+                if (path[i].ele > max_ele) {
+                        max_ele = path[i].ele;
+                        max_ele_x = path_x;
+                }
+
+                if (i % index_step == 0 || i == path_len - 1) {
+                    sb_append_point(sb,
+                        map(path_x, 0, km, 0, PLOT_MAX_X),
+                        map(path[i].ele, 0, 3000.0, 0, PLOT_MAX_Y), decimals);
+                    sb_append_buf(sb, " ", 1);
+                }
+            }
+        }
+        sb_append_cstr(sb, "};\n");
+
+        double triangle_y = map(max_ele, 0, 3000.0, 0, PLOT_MAX_Y) - 0.25;
+        triangle_y = triangle_y < 0.0 ? 0.0 : triangle_y;
+        sb_append_cstr(sb, "\\draw[black!50] ");
+        sb_append_point(sb, map(max_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y, decimals);
+        sb_append_cstr(sb, " node[draw,isosceles triangle,isosceles triangle apex angle=60,draw,rotate=90, anchor=apex, scale=0.33, fill=black!50] {};\n");
+        triangle_y = map(min_ele, 0, 3000.0, 0, PLOT_MAX_Y) + 0.25;
+        triangle_y = triangle_y > PLOT_MAX_Y ? PLOT_MAX_Y : triangle_y;
+        sb_append_cstr(sb, "\\draw[black!50] ");
+        sb_append_point(sb, map(min_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y, decimals);
+        sb_append_cstr(sb, " node[draw,isosceles triangle,isosceles triangle apex angle=60,draw,rotate=270, anchor=apex, scale=0.33, fill=black!50] {};\n");
+#if 0
+        double ele_progress = map(max_ele_x, 0, km, 0, 1.0);
+        if (ele_progress < 0.025) {
+            sb_appendf(sb, "\\node[anchor=north west] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
+        // } else if (ele_progress > 0.9) {
+        //     sb_appendf(sb, "\\node[anchor=north east] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
+        } else {
+            sb_appendf(sb, "\\node[anchor=north] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
+        }
+
+        ele_progress = map(min_ele_x, 0, km, 0, 1.0);
+        if (ele_progress < 0.025) {
+            sb_appendf(sb, "\\node[anchor=south west] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
+        // } else if (ele_progress > 0.9) {
+        //     sb_appendf(sb, "\\node[anchor=south east] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
+        } else {
+            sb_appendf(sb, "\\node[anchor=south] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
+        }
+#endif
+
+        double x = 0;
+        for (size_t i = 0; i < waypoints_len; i++) {
+            waypoint_name(i, wp_name);
+            sb_append_cstr(sb, "\\filldraw[black] ");
+            sb_append_point(sb, map(x, 0, km, 0, PLOT_MAX_X), map(waypoints[i].ele, 0, 3000.0, 0, PLOT_MAX_Y), decimals);
+            sb_appendf(sb, " circle (2pt) node[anchor=south west]{%.*s};\n", 2, wp_name);
+            x += segments[i].dst;
+        }
+
+    sb_append_cstr(sb, "    \\end{tikzpicture}\\end{center}\n");
+}
+
+// With --watch the profile of the last run is kept, to draw it again only when the
+// elevation or the distances along the route change.
+uint64_t watch_profile_key = 0;
+String_Builder watch_profile = {0};
+
+void print_profile(String_Builder* sb, const double km) {
+    uint64_t key = hash_bytes(HASH_SEED, path, path_len * sizeof(Point));
+    key = hash_bytes(key, waypoints, waypoints_len * sizeof(Point));
+    key = hash_bytes(key, &NATIVE_PROFILE, sizeof(NATIVE_PROFILE));
+    if (WATCH && watch_profile.count > 0 && key == watch_profile_key) {
+        printf("[INFO] Watch: elevation profile unchanged, reusing it\n");
+        sb_append_buf(sb, watch_profile.items, watch_profile.count);
+        return;
+    }
+    if (WATCH) printf("[INFO] Watch: elevation profile changed, drawing it\n");
+
+    String_Builder profile = {0};
+    char profile_file[64] = {0};
+    if (NATIVE_PROFILE && write_profile_pdf(km, profile_file, 64) == 0) {
+        sb_appendf(&profile, "    \\begin{center}\\includegraphics{%s}\\end{center}\n", profile_file);
+    } else {
+        print_profile_tikz(&profile, km);
+    }
+    sb_append_buf(sb, profile.items, profile.count);
+
+    if (WATCH) {
+        sb_free(&watch_profile);
+        watch_profile = profile;
+        watch_profile_key = key;
+    } else {
+        sb_free(&profile);
+    }
+}
+
+// Returns -1 when the map was asked for and could not be made, the rest of the
+// document is printed all the same.
+int print_latex_document(String_Builder* sb, int include_map) {
+    const StageMark mark = stage_begin();
+    setlocale(LC_NUMERIC, "");
+
+    print_latex_preamble(sb);
+
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\begin{document}\n");
+    sb_append_cstr(sb, "    \\pagenumbering{gobble}\n");
+    sb_append_cstr(sb, "    \\contourlength{0.5pt}\n");
+    sb_append_cstr(sb, "    \\contournumber{16}\n");
+    sb_append_cstr(sb, "    \\begin{center}\n");
+    sb_appendf(sb, "        \\textsc{\\Huge %s}\n", name);
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "        \\vspace{2ex}\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\textsc{\\large Tabella di marcia}\n");
+    sb_append_cstr(sb, "    \\end{center}\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\vspace{2ex}\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "    \\begin{center}\\begin{tabular}{|c|c|}\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_appendf(sb, "        \\multirow{2}{*}{Fattore di marcia:} & \\multirow{2}{*}{$%0.1f \\hphantom{a} \\frac{kms}{h}$}\\\\\n", FACTOR);
+    sb_append_cstr(sb, "        &\\\\\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "    \\end{tabular}\\end{center}\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "    \\begin{longtable}{|c|c|c|c|c|c|c|c|c|c|c|c|c|l|}\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "        \\multirow{2}{*}{Nome} & \\multirow{2}{*}{Coord. (LV95)} & \\multirow{2}{*}{Alt. [m]} & \\multirow{2}{*}{$\\Delta h$ [hm]} & \\multirow{2}{*}{$\\Delta s$ [km]} & \\multirow{2}{*}{$\\Delta kms$} & \\multirow{2}{*}{$\\Delta t$ [hh:mm]} & \\multirow{2}{*}{$s$ [km]} & \\multirow{2}{*}{$kms$} & \\multirow{2}{*}{$t$ [hh:mm]} & \\multirow{2}{*}{$t$ [hh:mm]} & \\multirow{2}{*}{Pausa [hh:mm]} & \\multirow{2}{*}{Osservazioni \\hphantom{aaaaaaaaaa}} \\\\\n");
+    sb_append_cstr(sb, "        &&&&&&&&&&&&\\\\\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "        \\hline\n");
+
+    // assert(waypoints_len == segments_len + 1);
+    for (size_t i = 0; i < waypoints_len; i++) {
+        const MarchRow* row = &march[i];
+        const PathSegmentData psd = row->next;
+        sb_appendf(sb, "\\multirow{2}{*}{%-2s} & ", row->name);
+        sb_appendf(sb, "\\multirow{2}{*}{%'ld %'ld} & ", (uint64_t) round(row->e), (uint64_t) round(row->n));
+        sb_appendf(sb, "\\multirow{2}{*}{%'.0f} & ", round(row->ele));
+        sb_append_cstr(sb, " & & & & ");
+        sb_appendf(sb, "\\multirow{2}{*}{%.1f} &", row->s);
+        sb_appendf(sb, "\\multirow{2}{*}{%.1f} &", row->kms);
+        sb_appendf(sb, "\\multirow{2}{*}{%02ld:%02ld} &", (row->t / 60)%24, row->t % 60);
+        sb_append_cstr(sb, "\\multirow{2}{*}{} &");
+        if (i < waypoints_len-1 && i > 0 && row->pause > 0) {
+            sb_appendf(sb, "\\multirow{2}{*}{%02ld:%02ld} &", row->pause / 60, row->pause % 60);
+        } else {
+            sb_append_cstr(sb, "\\multirow{2}{*}{} &");
+        }
+        sb_append_cstr(sb, "\\multirow{2}{*}{}\\\\\n");
+        sb_append_cstr(sb, "        \\cline{4-7} \n");
+        if (i < waypoints_len-1) {
+            sb_append_cstr(sb, " & & & ");
+            sb_appendf(sb, "\\multirow{2}{*}{%.1f} & ", psd.dh/100.0);
+            sb_appendf(sb, " \\multirow{2}{*}{%.1f} &", psd.dst);
+            sb_appendf(sb, " \\multirow{2}{*}{%.1f} &", psd.kms);
+            sb_appendf(sb, "\\multirow{2}{*}{%02ld:%02ld}&&&&&& \\\\\n", psd.t / 60, psd.t % 60);
+
+            // sb_append_cstr(sb, "&&&&&&&&& \\\\\n");
+            sb_append_cstr(sb, "        \\cline{1-3}\\cline{8-13} \n");
+        } else {
+            sb_append_cstr(sb, "&&&&&&&&&&&&\\\\\n");
+            sb_append_cstr(sb, "\\hline\n");
+        }
+    }
+
+    sb_append_cstr(sb, "    \\end{longtable}\n");
+
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "        \\vspace{2ex}\n");
+    sb_append_cstr(sb, "\n");
+
+    sb_append_cstr(sb, "    \\begin{center}\\begin{tabular}{|c|c|c|c|c|c|c|}\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "        \\multicolumn{2}{|c|}{\\multirow{2}{*}{Estremi}} & \\multicolumn{5}{|c|}{\\multirow{2}{*}{Totali}}\\\\\n");
+    sb_append_cstr(sb, "        \\multicolumn{2}{|c|}{} & \\multicolumn{5}{|c|}{} \\\\\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "        \\multirow{2}{*}{$\\min h$} & \\multirow{2}{*}{$\\max h$} & \\multirow{2}{*}{$\\Delta h^\\uparrow$} & \\multirow{2}{*}{$\\Delta h^\\downarrow$} & \\multirow{2}{*}{$s$} & \\multirow{2}{*}{$kms$} & \\multirow{2}{*}{$t$ (senza pause)} \\\\\n");
+    sb_append_cstr(sb, "        &&&&&& \\\\\n");
+    sb_append_cstr(sb, "        \\hline\n");
+
+    const RouteTotals totals = march_totals;
+    sb_appendf(sb, "        \\multirow{2}{*}{%.0f m.s.l.m.} & \\multirow{2}{*}{%.0f m.s.l.m.} & \\multirow{2}{*}{%.0f m} & \\multirow{2}{*}{%.0f m} & \\multirow{2}{*}{%.2f km} & \\multirow{2}{*}{%.2f kms} & \\multirow{2}{*}{%ld h %ld min} \\\\\n", round(totals.min_h), round(totals.max_h), round(totals.up), round(totals.down), totals.s, totals.kms, totals.time/60, totals.time%60);
+    sb_append_cstr(sb, "        &&&&&& \\\\\n");
+    sb_append_cstr(sb, "        \\hline\n");
+    sb_append_cstr(sb, "    \\end{tabular}\\end{center}\n");
+
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\pagebreak\n");
+    sb_append_cstr(sb, "\n");
+
+    sb_append_cstr(sb, "    \\begin{center}\n");
+    sb_appendf(sb, "        \\textsc{\\Huge %s}\n", name);
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "        \\vspace{2ex}\n");
+    sb_append_cstr(sb, "\n");
+    sb_append_cstr(sb, "\\textsc{\\large Profilo altimetrico}\n");
+    sb_append_cstr(sb, "    \\end{center}\n");
+
+    sb_append_cstr(sb, "\n");
+
+    print_profile(sb, totals.s);
+
+    int failed = 0;
+    if (include_map)
+        failed = print_map(sb) != 0;
+    
+    sb_append_cstr(sb, "\\end{document}\n");
+    stage_end(STAGE_LATEX_DOCUMENT, &mark);
+    return failed ? -1 : 0;
+}
+
+// The same document written straight as a PDF, without LaTeX: A4 landscape pages with the
+// standard Helvetica and Symbol fonts, laid out from the top.
+#define PDF_PAGE_WIDTH 842.0 // pt
+#define PDF_PAGE_HEIGHT 595.0
+#define PDF_MARGIN (DOC_MARGIN * PDF_PT_PER_CM)
+#define PDF_PAGES_CAP 512
+#define PDF_TEXT_SIZE 9.0 // pt, Helvetica is wider than the LaTeX font
+#define PDF_ROW_HEIGHT 12.0 // pt, half of the two rows a waypoint takes
+
+typedef struct {
+    Pdf pdf;
+    size_t pages_id;
+    size_t fonts[2]; // Helvetica, Symbol
+    size_t page_ids[PDF_PAGES_CAP];
+    size_t pages_len;
+    String_Builder content; // of the page being laid out
+    size_t image; // object drawn on the page as `Im0`, 0 for none
+    double y; // pt from the top of the page down to the free space
+} PdfDocument;
+
+void pdf_document_begin(PdfDocument* doc) {
+    pdf_init(&doc->pdf);
+    doc->pages_id = pdf_new_object(&doc->pdf);
+    doc->fonts[0] = pdf_new_object(&doc->pdf);
+    doc->fonts[1] = pdf_new_object(&doc->pdf);
+    pdf_font_object(&doc->pdf, doc->fonts[0], "Helvetica");
+    // Symbol has its own built-in encoding
+    pdf_begin_object(&doc->pdf, doc->fonts[1]);
+    sb_append_cstr(&doc->pdf.out, "<< /Type /Font /Subtype /Type1 /BaseFont /Symbol >>\n");
+    pdf_end_object(&doc->pdf);
+}
+
+void pdf_page_begin(PdfDocument* doc) {
+    doc->content.count = 0;
+    doc->image = 0;
+    doc->y = PDF_MARGIN;
+    sb_append_cstr(&doc->content, "0.4 w\n");
+}
+
+void pdf_page_end(PdfDocument* doc) {
+    assert(doc->pages_len < PDF_PAGES_CAP && "Too many PDF pages");
+    const size_t page = pdf_new_object(&doc->pdf), contents = pdf_new_object(&doc->pdf);
+    pdf_stream_object(&doc->pdf, contents, &doc->content);
+
+    pdf_begin_object(&doc->pdf, page);
+    sb_appendf(&doc->pdf.out, "<< /Type /Page /Parent %ld 0 R /MediaBox [0 0 842 595] /Contents %ld 0 R\n", doc->pages_id, contents);
+    sb_appendf(&doc->pdf.out, "   /Resources << /Font << /F1 %ld 0 R /F2 %ld 0 R >>", doc->fonts[0], doc->fonts[1]);
+    if (doc->image != 0) sb_appendf(&doc->pdf.out, " /XObject << /Im0 %ld 0 R >>", doc->image);
+    sb_append_cstr(&doc->pdf.out, " >> >>\n");
+    pdf_end_object(&doc->pdf);
+    doc->page_ids[doc->pages_len++] = page;
+}
+
+void pdf_document_end(PdfDocument* doc) {
+    pdf_begin_object(&doc->pdf, doc->pages_id);
+    sb_append_cstr(&doc->pdf.out, "<< /Type /Pages /Kids [");
+    for (size_t k = 0; k < doc->pages_len; k++) sb_appendf(&doc->pdf.out, "%ld 0 R ", doc->page_ids[k]);
+    sb_appendf(&doc->pdf.out, "] /Count %ld >>\n", doc->pages_len);
+    pdf_end_object(&doc->pdf);
+
+    const size_t catalog = pdf_new_object(&doc->pdf);
+    pdf_begin_object(&doc->pdf, catalog);
+    sb_appendf(&doc->pdf.out, "<< /Type /Catalog /Pages %ld 0 R >>\n", doc->pages_id);
+    pdf_end_object(&doc->pdf);
+    pdf_finish(&doc->pdf, catalog);
+    sb_free(&doc->content);
+}
+
+// Embeds a JPEG file as it is, PDF readers decode it themselves. Returns the object, 0
+// if the file is not a JPEG it understands.
+size_t pdf_jpeg_object(Pdf* pdf, const char* path, uint64_t* width, uint64_t* height) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+    String_Builder jpeg = {0};
+    char buf[64 * 1024];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sb_append_buf(&jpeg, buf, n);
+    fclose(fp);
+
+    // the size is in the start of frame segment
+    const uint8_t* data = (const uint8_t*) jpeg.items;
+    size_t components = 0;
+    size_t at = 2;
+    while (jpeg.count >= 2 && data[0] == 0xFF && data[1] == 0xD8 && at + 9 < jpeg.count && data[at] == 0xFF) {
+        const uint8_t marker = data[at + 1];
+        const size_t length = ((size_t) data[at + 2] << 8) | data[at + 3];
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            *height = ((uint64_t) data[at + 5] << 8) | data[at + 6];
+            *width = ((uint64_t) data[at + 7] << 8) | data[at + 8];
+            components = data[at + 9];
+            break;
+        }
+        at += 2 + length;
+    }
+    if (components != 1 && components != 3) {
+        sb_free(&jpeg);
+        return 0;
+    }
+
+    const size_t id = pdf_new_object(pdf);
+    pdf_begin_object(pdf, id);
+    sb_appendf(&pdf->out, "<< /Type /XObject /Subtype /Image /Width %ld /Height %ld /ColorSpace /%s /BitsPerComponent 8 /Filter /DCTDecode /Length %ld >>\nstream\n",
+        *width, *height, components == 3 ? "DeviceRGB" : "DeviceGray", jpeg.count);
+    sb_append_buf(&pdf->out, jpeg.items, jpeg.count);
+    sb_append_cstr(&pdf->out, "\nendstream\n");
+    pdf_end_object(pdf);
+    sb_free(&jpeg);
+    return id;
+}
+
+// `text` centered in the line at `y` pt from the top.
+void pdf_centered_line(PdfDocument* doc, const double size, const char* text) {
+    doc->y += size;
+    pdf_text(&doc->content, "F1", size, PDF_PAGE_WIDTH / 2.0, PDF_PAGE_HEIGHT - doc->y, 0.5, text);
+    doc->y += 0.3 * size;
+}
+
+// The name of the tour over `subtitle`, `size` being the one of the name.
+void pdf_page_title(PdfDocument* doc, const double size, const char* subtitle) {
+    pdf_centered_line(doc, size, name);
+    doc->y += size / 4.0;
+    pdf_centered_line(doc, size / 2.0, subtitle);
+    doc->y += 20.0;
+}
+
+// A line between two points given from the top left of the page.
+void pdf_rule(PdfDocument* doc, const double x0, const double y0, const double x1, const double y1) {
+    pdf_line(&doc->content, x0, PDF_PAGE_HEIGHT - y0, x1, PDF_PAGE_HEIGHT - y1);
+}
+
+// `text` centered in the cell from `x0` to `x1`, on the line at `y` pt from the top.
+void pdf_cell(PdfDocument* doc, const double x0, const double x1, const double y, const char* text) {
+    pdf_text(&doc->content, "F1", PDF_TEXT_SIZE, (x0 + x1) / 2.0, PDF_PAGE_HEIGHT - y - 0.5 * PDF_CAP_HEIGHT * PDF_TEXT_SIZE, 0.5, text);
+}
+
+// `n` with the thousands separator of the locale, like the ' flag of printf.
+void format_grouped(char* buf, const size_t size, const uint64_t n) {
+    const char* sep = localeconv()->thousands_sep;
+    char digits[32] = {0};
+    const size_t digits_len = (size_t) snprintf(digits, 32, "%ld", n);
+    size_t len = 0;
+    for (size_t k = 0; k < digits_len && len + strlen(sep) + 2 < size; k++) {
+        if (k > 0 && (digits_len - k) % 3 == 0) len += (size_t) snprintf(buf + len, size - len, "%s", sep);
+        buf[len++] = digits[k];
+    }
+    buf[len] = '\0';
+}
+
+#define MARCH_COLUMNS 13
+
+const char* march_titles[MARCH_COLUMNS] = {
+    "Nome", "Coord. (LV95)", "Alt. [m]", PDF_SYMBOL_STR "Dh [hm]", PDF_SYMBOL_STR "Ds [km]", PDF_SYMBOL_STR "Dkms",
+    PDF_SYMBOL_STR "Dt [hh:mm]", "s [km]", "kms", "t [hh:mm]", "t [hh:mm]", "Pausa [hh:mm]", "Osservazioni",
+};
+const double march_widths[MARCH_COLUMNS] = { 36, 104, 46, 50, 50, 46, 58, 46, 46, 58, 58, 74, 113 }; // pt
+
+void pdf_march_header(PdfDocument* doc, double* column_x) {
+    const double top = doc->y;
+    pdf_rule(doc, column_x[0], top, column_x[MARCH_COLUMNS], top);
+    for (size_t c = 0; c < MARCH_COLUMNS; c++) {
+        pdf_cell(doc, column_x[c], column_x[c + 1], top + PDF_ROW_HEIGHT, march_titles[c]);
+    }
+    doc->y += 2.0 * PDF_ROW_HEIGHT;
+    for (size_t c = 0; c <= MARCH_COLUMNS; c++) pdf_rule(doc, column_x[c], top, column_x[c], doc->y + 2.0);
+    // \hline\hline
+    pdf_rule(doc, column_x[0], doc->y, column_x[MARCH_COLUMNS], doc->y);
+    pdf_rule(doc, column_x[0], doc->y + 2.0, column_x[MARCH_COLUMNS], doc->y + 2.0);
+    doc->y += 2.0;
+}
+
+// The vertical rules of the table part from `top` to where the layout got.
+void pdf_march_close(PdfDocument* doc, const double* column_x, const double top) {
+    for (size_t c = 0; c <= MARCH_COLUMNS; c++) pdf_rule(doc, column_x[c], top, column_x[c], doc->y);
+}
+
+// Lays out the marching table like the longtable of the document: each waypoint takes two
+// rows, and the segment to the next one sits across the rows of both in columns 4 to 7.
+// The table goes on to the next page, with its header, where it does not fit.
+void pdf_march_table(PdfDocument* doc) {
+    double column_x[MARCH_COLUMNS + 1] = { PDF_MARGIN };
+    for (size_t c = 0; c < MARCH_COLUMNS; c++) column_x[c + 1] = column_x[c] + march_widths[c];
+
+    const double bottom = PDF_PAGE_HEIGHT - PDF_MARGIN;
+    pdf_march_header(doc, column_x);
+    double top = doc->y;
+
+    char cell[64] = {0};
+    char segment_cells[4][32] = {0};
+    for (size_t i = 0; i < waypoints_len; i++) {
+        const MarchRow* row = &march[i];
+        const PathSegmentData psd = row->next;
+
+        // the segment from the previous waypoint goes where its two halves meet, or in
+        // its first half when the page ends between them
+        if (i > 0) {
+            const int fits = doc->y + 2.0 * PDF_ROW_HEIGHT <= bottom;
+            const double y = fits ? doc->y : doc->y - PDF_ROW_HEIGHT / 2.0;
+            for (size_t c = 0; c < 4; c++) pdf_cell(doc, column_x[3 + c], column_x[4 + c], y, segment_cells[c]);
+            if (!fits) {
+                pdf_rule(doc, column_x[0], doc->y, column_x[MARCH_COLUMNS], doc->y);
+                pdf_march_close(doc, column_x, top);
+                pdf_page_end(doc);
+                pdf_page_begin(doc);
+                pdf_march_header(doc, column_x);
+                top = doc->y;
+            }
+        }
+
+        const double middle = doc->y + PDF_ROW_HEIGHT;
+        pdf_cell(doc, column_x[0], column_x[1], middle, row->name);
+        char north[32] = {0};
+        format_grouped(cell, 32, (uint64_t) round(row->e));
+        format_grouped(north, 32, (uint64_t) round(row->n));
+        strcat(cell, " ");
+        strcat(cell, north);
+        pdf_cell(doc, column_x[1], column_x[2], middle, cell);
+        format_grouped(cell, 64, (uint64_t) round(row->ele));
+        pdf_cell(doc, column_x[2], column_x[3], middle, cell);
+        snprintf(cell, 64, "%.1f", row->s);
+        pdf_cell(doc, column_x[7], column_x[8], middle, cell);
+        snprintf(cell, 64, "%.1f", row->kms);
+        pdf_cell(doc, column_x[8], column_x[9], middle, cell);
+        snprintf(cell, 64, "%02ld:%02ld", (row->t / 60)%24, row->t % 60);
+        pdf_cell(doc, column_x[9], column_x[10], middle, cell);
+        if (i < waypoints_len-1 && i > 0 && row->pause > 0) {
+            snprintf(cell, 64, "%02ld:%02ld", row->pause / 60, row->pause % 60);
+            pdf_cell(doc, column_x[11], column_x[12], middle, cell);
+        }
+
+        // \cline{4-7} closes the segment before
+        pdf_rule(doc, column_x[3], middle, column_x[7], middle);
+        doc->y += 2.0 * PDF_ROW_HEIGHT;
+
+        if (i < waypoints_len-1) {
+            snprintf(segment_cells[0], 32, "%.1f", psd.dh/100.0);
+            snprintf(segment_cells[1], 32, "%.1f", psd.dst);
+            snprintf(segment_cells[2], 32, "%.1f", psd.kms);
+            snprintf(segment_cells[3], 32, "%02ld:%02ld", psd.t / 60, psd.t % 60);
+
+            // \cline{1-3}\cline{8-13}
+            pdf_rule(doc, column_x[0], doc->y, column_x[3], doc->y);
+            pdf_rule(doc, column_x[7], doc->y, column_x[MARCH_COLUMNS], doc->y);
+        } else {
+            pdf_rule(doc, column_x[0], doc->y, column_x[MARCH_COLUMNS], doc->y);
+        }
+    }
+    pdf_march_close(doc, column_x, top);
+}
+
+// The totals under the marching table, on the next page if they do not fit there.
+void pdf_totals_table(PdfDocument* doc) {
+    const double width = 96.0; // pt, of each column
+    const double height = 6.0 * PDF_ROW_HEIGHT;
+    if (doc->y + 20.0 + height > PDF_PAGE_HEIGHT - PDF_MARGIN) {
+        pdf_page_end(doc);
+        pdf_page_begin(doc);
+    } else {
+        doc->y += 20.0;
+    }
+
+    double x[8] = { (PDF_PAGE_WIDTH - 7.0 * width) / 2.0 };
+    for (size_t c = 0; c < 7; c++) x[c + 1] = x[c] + width;
+    const double top = doc->y;
+
+    pdf_rule(doc, x[0], top, x[7], top);
+    pdf_cell(doc, x[0], x[2], top + PDF_ROW_HEIGHT, "Estremi");
+    pdf_cell(doc, x[2], x[7], top + PDF_ROW_HEIGHT, "Totali");
+    pdf_rule(doc, x[0], top + 2.0 * PDF_ROW_HEIGHT, x[7], top + 2.0 * PDF_ROW_HEIGHT);
+
+    const char* titles[7] = {
+        "min h", "max h", PDF_SYMBOL_STR "Dh" PDF_SYMBOL_STR "\xad", PDF_SYMBOL_STR "Dh" PDF_SYMBOL_STR "\xaf", "s", "kms", "t (senza pause)",
+    };
+    for (size_t c = 0; c < 7; c++) pdf_cell(doc, x[c], x[c + 1], top + 3.0 * PDF_ROW_HEIGHT, titles[c]);
+    pdf_rule(doc, x[0], top + 4.0 * PDF_ROW_HEIGHT, x[7], top + 4.0 * PDF_ROW_HEIGHT);
+
+    const RouteTotals totals = march_totals;
+    char cells[7][32] = {0};
+    snprintf(cells[0], 32, "%.0f m.s.l.m.", round(totals.min_h));
+    snprintf(cells[1], 32, "%.0f m.s.l.m.", round(totals.max_h));
+    snprintf(cells[2], 32, "%.0f m", round(totals.up));
+    snprintf(cells[3], 32, "%.0f m", round(totals.down));
+    snprintf(cells[4], 32, "%.2f km", totals.s);
+    snprintf(cells[5], 32, "%.2f kms", totals.kms);
+    snprintf(cells[6], 32, "%ld h %ld min", totals.time/60, totals.time%60);
+    for (size_t c = 0; c < 7; c++) pdf_cell(doc, x[c], x[c + 1], top + 5.0 * PDF_ROW_HEIGHT, cells[c]);
+    pdf_rule(doc, x[0], top + height, x[7], top + height);
+
+    // the two columns of the extremes and the five of the totals only split below their title
+    for (size_t c = 0; c <= 7; c++) {
+        pdf_rule(doc, x[c], c == 0 || c == 2 || c == 7 ? top : top + 2.0 * PDF_ROW_HEIGHT, x[c], top + height);
+    }
+    doc->y = top + height;
+}
+
+void pdf_profile_page(PdfDocument* doc, const double km) {
+    pdf_page_begin(doc);
+    pdf_page_title(doc, 24.0, "Profilo altimetrico");
+
+    const double width = (PROFILE_RIGHT - PROFILE_LEFT) * PDF_PT_PER_CM;
+    const double x = (PDF_PAGE_WIDTH - width) / 2.0 - PROFILE_LEFT * PDF_PT_PER_CM;
+    const double y = PDF_PAGE_HEIGHT - doc->y - PROFILE_TOP * PDF_PT_PER_CM;
+    sb_append_cstr(&doc->content, "q ");
+    pdf_number(&doc->content, PDF_PT_PER_CM);
+    sb_append_cstr(&doc->content, "0 0 ");
+    pdf_number(&doc->content, PDF_PT_PER_CM);
+    pdf_point(&doc->content, x, y, "cm");
+    draw_profile(&doc->content, km);
+    sb_append_cstr(&doc->content, "Q\n");
+    pdf_page_end(doc);
+}
+
+// A map page like print_map_page, with the route and the labels drawn into the image;
+// upright frames are turned like the TikZ picture.
+int pdf_map_page(PdfDocument* doc, const MapFrame* frame, const PathRun* runs, const size_t runs_len, const size_t page, const size_t pages) {
+    char map_file[64] = {0};
+    if (map_raster(frame, TARGET_DPI, runs, runs_len, 1, 1, "jpg", map_file, 64) == 0) {
+        fprintf(stderr, "[ERROR] Map page %ld of %ld left out, there is no map for it.\n", page + 1, pages);
+        return -1;
+    }
+
+    pdf_page_begin(doc);
+    char subtitle[64] = {0};
+    if (pages > 1) snprintf(subtitle, 64, "Carta topografica, foglio %ld di %ld", page + 1, pages);
+    else snprintf(subtitle, 64, "Carta topografica");
+    pdf_page_title(doc, 16.0, subtitle);
+
+    uint64_t px_width = 0, px_height = 0;
+    doc->image = pdf_jpeg_object(&doc->pdf, map_file, &px_width, &px_height);
+    if (doc->image == 0) {
+        fprintf(stderr, "[ERROR] Could not embed the map `%s`\n", map_file);
+        pdf_page_end(doc);
+        return -1;
+    }
+
+    const double w = ((double) (frame->maxE - frame->minE) / (double) frame->height) * MAP_CELL_SIZE * frame->max_size * PDF_PT_PER_CM;
+    const double h = ((double) (frame->maxN - frame->minN) / (double) frame->height) * MAP_CELL_SIZE * frame->max_size * PDF_PT_PER_CM;
+    const int turned = frame->height > frame->width;
+    const double box_width = turned ? h : w, box_height = turned ? w : h;
+    // the frame is sized for the LaTeX page, it may take some of the space of the title
+    const double left = (PDF_PAGE_WIDTH - box_width) / 2.0;
+    const double top = fmin(PDF_PAGE_HEIGHT - doc->y, PDF_MARGIN + box_height);
+
+    sb_append_cstr(&doc->content, "q ");
+    if (turned) {
+        // clockwise: the width of the image runs down the page, its height to the right
+        sb_append_cstr(&doc->content, "0 ");
+        pdf_number(&doc->content, -w);
+        pdf_number(&doc->content, h);
+        sb_append_cstr(&doc->content, "0 ");
+        pdf_point(&doc->content, left, top, "cm");
+    } else {
+        pdf_number(&doc->content, w);
+        sb_append_cstr(&doc->content, "0 0 ");
+        pdf_number(&doc->content, h);
+        pdf_point(&doc->content, left, top - h, "cm");
+    }
+    sb_append_cstr(&doc->content, "/Im0 Do Q\n");
+    pdf_number(&doc->content, left);
+    pdf_number(&doc->content, top - box_height);
+    pdf_number(&doc->content, box_width);
+    pdf_number(&doc->content, box_height);
+    sb_append_cstr(&doc->content, "re S\n");
+    pdf_page_end(doc);
+    return 0;
+}
+
+// Writes the document to `pdf_path` without going through LaTeX.
+int write_direct_pdf(const char* pdf_path, const int include_map) {
+    setlocale(LC_NUMERIC, "");
+    const time_t run_start = time(NULL);
+
+    PdfDocument doc = {0};
+    pdf_document_begin(&doc);
+
+    pdf_page_begin(&doc);
+    pdf_page_title(&doc, 24.0, "Tabella di marcia");
+    {
+        // the box with the factor
+        const double x0 = PDF_PAGE_WIDTH / 2.0 - 100.0, x1 = PDF_PAGE_WIDTH / 2.0, x2 = PDF_PAGE_WIDTH / 2.0 + 100.0;
+        const double top = doc.y, bottom = doc.y + 2.0 * PDF_ROW_HEIGHT;
+        char factor[32] = {0};
+        snprintf(factor, 32, "%0.1f kms/h", FACTOR);
+        pdf_cell(&doc, x0, x1, top + PDF_ROW_HEIGHT, "Fattore di marcia:");
+        pdf_cell(&doc, x1, x2, top + PDF_ROW_HEIGHT, factor);
+        pdf_rule(&doc, x0, top, x2, top);
+        pdf_rule(&doc, x0, bottom, x2, bottom);
+        for (size_t c = 0; c < 3; c++) pdf_rule(&doc, x0 + 100.0 * c, top, x0 + 100.0 * c, bottom);
+        doc.y = bottom + 20.0;
+    }
+    pdf_march_table(&doc);
+    pdf_totals_table(&doc);
+    pdf_page_end(&doc);
+
+    pdf_profile_page(&doc, march_totals.s);
+
+    int map_failed = 0;
+    if (include_map) {
+        if (ATLAS_SCALE > 0 && atlas_prepare() != 0) {
+            map_failed = 1;
+        } else if (ATLAS_SCALE > 0) {
+            atlas_raster_route = 1;
+            atlas_raster_labels = 1;
+            parallel_run(atlas_pages_len, atlas_stitch_page, JOBS);
+            for (size_t k = 0; k < atlas_pages_len; k++) {
+                map_failed |= pdf_map_page(&doc, &atlas_pages[k], atlas_runs + atlas_runs_first[k], atlas_runs_first[k + 1] - atlas_runs_first[k], k, atlas_pages_len) != 0;
+            }
+            atlas_free();
+        } else {
+            MapFrame frame = {0};
+            map_frame_fit(&frame);
+            const PathRun whole = { 0, path_len - 1 };
+            map_failed = pdf_map_page(&doc, &frame, &whole, 1, 0, 1) != 0;
         }
+        cache_gc(CACHE_DIR"/crops", run_start);
+        cache_gc(CACHE_DIR"/maps", run_start);
+    }
+
+    pdf_document_end(&doc);
+    FILE* fp = fopen(pdf_path, "wb");
+    const int ok = fp != NULL && fwrite(doc.pdf.out.items, 1, doc.pdf.out.count, fp) == doc.pdf.out.count;
+    if (fp != NULL) fclose(fp);
+    sb_free(&doc.pdf.out);
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Could not write `%s`.\n", pdf_path);
+        return -1;
+    }
+    printf("[INFO] PDF written to `%s`\n", pdf_path);
+    return map_failed ? -1 : 0;
+}
+
+#ifndef _WIN32
+// Runs xelatex with `args` and no shell, feeding it `input` if given, and returns its
+// exit status, -1 if it could not be started. What it prints goes to `output_path`, if
+// given, otherwise nowhere.
+int run_xelatex(char* const args[], const String_Builder* input, const char* output_path) {
+    int fds[2] = {0};
+    if (pipe(fds) != 0) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        const int output = output_path != NULL ? open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                                               : open("/dev/null", O_WRONLY);
+        if (output >= 0) dup2(output, STDOUT_FILENO);
+        execvp(args[0], args);
+        _exit(127);
+    }
+    close(fds[0]);
+    if (pid < 0) {
+        close(fds[1]);
+        return -1;
+    }
+
+    // xelatex may stop reading early on a fatal error
+    void (*previous)(int) = signal(SIGPIPE, SIG_IGN);
+    size_t written = 0;
+    while (input != NULL && written < input->count) {
+        const ssize_t n = write(fds[1], input->items + written, input->count - written);
+        if (n <= 0) break;
+        written += (size_t) n;
+    }
+    close(fds[1]);
+    signal(SIGPIPE, previous);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status)) return 1;
+    return WEXITSTATUS(status) == 127 ? -1 : WEXITSTATUS(status);
+}
+
+// Finds or dumps the format with the preamble already loaded, named after its hash so
+// a changed preamble gets a new one. Writes its path without the extension, as -fmt
+// takes it, and returns 0 when it can be used.
+int latex_format(char* fmt_path, const size_t fmt_path_size) {
+    String_Builder preamble = {0};
+    print_latex_preamble(&preamble);
+    const uint64_t hash = hash_bytes(HASH_SEED, preamble.items, preamble.count);
+
+    char cwd[256] = {0};
+    if (getcwd(cwd, 256) == NULL) {
+        sb_free(&preamble);
+        return -1;
+    }
+    snprintf(fmt_path, fmt_path_size, "%s/"CACHE_DIR"/formats/tabellinator-%016lx", cwd, hash);
+    char fmt_file[320] = {0};
+    snprintf(fmt_file, 320, "%s.fmt", fmt_path);
+    if (file_exists(fmt_file)) {
+        sb_free(&preamble);
+        cache_touch(fmt_file);
+        return 0;
+    }
+
+    printf("[INFO] Building LaTeX format... ");
+    fflush(stdout);
+    make_dir(CACHE_DIR);
+    make_dir(CACHE_DIR"/formats");
+
+    // mylatexformat dumps everything up to \begin{document}
+    char preamble_file[64] = {0};
+    snprintf(preamble_file, 64, CACHE_DIR"/formats/tabellinator-%016lx.tex", hash);
+    sb_append_cstr(&preamble, "\\begin{document}\n\\end{document}\n");
+    FILE* fp = fopen(preamble_file, "w");
+    if (fp != NULL) {
+        fwrite(preamble.items, 1, preamble.count, fp);
+        fclose(fp);
+    }
+    sb_free(&preamble);
+
+    char jobname[64] = {0};
+    snprintf(jobname, 64, "-jobname=tabellinator-%016lx", hash);
+    char* const args[] = { "xelatex", "-ini", "-interaction=nonstopmode", jobname,
+        "-output-directory="CACHE_DIR"/formats", "&xelatex", "mylatexformat.ltx", preamble_file, NULL };
+    run_xelatex(args, NULL, NULL);
+    remove(preamble_file);
+
+    if (!file_exists(fmt_file)) {
+        printf("failed!\n");
+        return -1;
+    }
+    printf("done!\n");
+    return 0;
+}
+
+// 0 when the file does not exist
+uint64_t file_hash(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+
+    uint64_t hash = HASH_SEED;
+    char buf[16 * 1024];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) hash = hash_bytes(hash, buf, n);
+    fclose(fp);
+    return hash;
+}
+
+// Whether a package left a "Rerun LaTeX" or "Rerun to get ... right" warning in the log.
+int latex_log_asks_rerun(const char* log_path) {
+    FILE* fp = fopen(log_path, "rb");
+    if (fp == NULL) return 0;
+
+    String_Builder log = {0};
+    char buf[16 * 1024];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sb_append_buf(&log, buf, n);
+    fclose(fp);
+    sb_append_buf(&log, "", 1);
+
+    int rerun = 0;
+    for (const char* line = strstr(log.items, "Rerun"); line != NULL && !rerun; line = strstr(line + 5, "Rerun")) {
+        rerun = strncmp(line, "Rerun LaTeX", 11) == 0 || strncmp(line, "Rerun to get", 12) == 0;
     }
+    sb_free(&log);
+    return rerun;
+}
 
-    fprintf(sink, "    \\end{longtable}\n");
+// Whether xelatex could not load the format, from what it printed: the log is only
+// opened after the format is loaded. A format of another version of TeX is reported
+// on lines starting with "---! ".
+int latex_format_failed(const char* output_path) {
+    FILE* fp = fopen(output_path, "rb");
+    if (fp == NULL) return 0;
+
+    String_Builder output = {0};
+    char buf[16 * 1024];
+    size_t n = 0;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sb_append_buf(&output, buf, n);
+    fclose(fp);
+    sb_append_buf(&output, "", 1);
+
+    const int failed = strstr(output.items, "Fatal format file error") != NULL || strstr(output.items, "---! ") != NULL;
+    sb_free(&output);
+    return failed;
+}
+#endif
 
-    fprintf(sink, "\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "        \\vspace{2ex}\n");
-    fprintf(sink, "\n");
+#define LATEX_MAX_PASSES 4
+
+// Runs XeLaTeX on the document. Outside of Windows it is written to the standard input
+// of xelatex, started without a shell, so the .tex file does not need to exist: the job
+// name and output directory come from `out_file_path`, the PDF lands next to the GPX file.
+// The preamble comes from the precompiled format when there is one; should xelatex not
+// load it (e.g. after an update of TeX), the document is compiled again without it. The
+// format is left in place, another process may be reading it.
+// Another pass only follows when the .aux file changed or the log asks for one: the
+// .aux of the last run stays next to the PDF, so an unchanged document takes one pass.
+int compile_latex(const String_Builder* doc) {
+#ifndef _WIN32
+    char output_directory[160] = "-output-directory=.";
+    char jobname[160] = {0};
+    const char* base = strrchr(out_file_path, '/');
+    if (base != NULL) {
+        snprintf(output_directory, 160, "-output-directory=%.*s", (int) (base - out_file_path), out_file_path);
+        base++;
+    } else {
+        base = out_file_path;
+    }
+    snprintf(jobname, 160, "-jobname=%.*s", (int) strlen(base) - 4, base);
 
-    fprintf(sink, "    \\begin{center}\\begin{tabular}{|c|c|c|c|c|c|c|}\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "        \\multicolumn{2}{|c|}{\\multirow{2}{*}{Estremi}} & \\multicolumn{5}{|c|}{\\multirow{2}{*}{Totali}}\\\\\n");
-    fprintf(sink, "        \\multicolumn{2}{|c|}{} & \\multicolumn{5}{|c|}{} \\\\\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "        \\multirow{2}{*}{$\\min h$} & \\multirow{2}{*}{$\\max h$} & \\multirow{2}{*}{$\\Delta h^\\uparrow$} & \\multirow{2}{*}{$\\Delta h^\\downarrow$} & \\multirow{2}{*}{$s$} & \\multirow{2}{*}{$kms$} & \\multirow{2}{*}{$t$ (senza pause)} \\\\\n");
-    fprintf(sink, "        &&&&&& \\\\\n");
-    fprintf(sink, "        \\hline\n");
+    char fmt_path[256] = {0};
+    char fmt[272] = {0};
+    const int use_format = latex_format(fmt_path, 256) == 0;
+    snprintf(fmt, 272, "-fmt=%s", fmt_path);
 
-    double minh = 3000, maxh = 0;
-    double updh_sum[2048] = {0};
-    double downdh_sum[2048] = {0};
-    dsum_clear(updh_sum);
-    dsum_clear(downdh_sum);
-    for (size_t i = 0; i < path_len; i++) {
-        Point p = path[i];
-        if (p.ele < minh) minh = p.ele;
-        if (p.ele > maxh) maxh = p.ele;
-        if (i > 0) {
-            Point p_ = path[i-1];
-            double dh = p.ele - p_.ele;
-            if (dh > 0.0) dsum_add(updh_sum, dh); else dsum_add(downdh_sum, -dh);
+    printf("[INFO] Compiling LaTeX document... ");
+    fflush(stdout);
+
+    // scrollmode, since in nonstopmode TeX refuses to read the document from the terminal
+    char* args[] = { "xelatex", "-interaction=scrollmode", jobname, output_directory, fmt, NULL };
+    if (!use_format) args[4] = NULL;
+
+    char aux_path[160] = {0}, log_path[160] = {0}, output_path[168] = {0};
+    snprintf(aux_path, 160, "%.*s.aux", (int) strlen(out_file_path) - 4, out_file_path);
+    snprintf(log_path, 160, "%.*s.log", (int) strlen(out_file_path) - 4, out_file_path);
+    snprintf(output_path, 168, "%.*s.xelatex-output", (int) strlen(out_file_path) - 4, out_file_path);
+
+    size_t passes = 0;
+    int status = 0;
+    while (passes < LATEX_MAX_PASSES) {
+        const uint64_t aux_before = file_hash(aux_path);
+        status = run_xelatex(args, doc, args[4] != NULL ? output_path : NULL);
+        if (status > 0 && args[4] != NULL && latex_format_failed(output_path)) {
+            printf("\n");
+            fflush(stdout);
+            fprintf(stderr, "[WARNING] Could not load the LaTeX format %s.fmt, compiling without it. Delete it to build it again.\n", fmt_path);
+            args[4] = NULL;
+            status = run_xelatex(args, doc, NULL);
+        }
+        remove(output_path);
+        if (status < 0) {
+            printf("failed!\n");
+            fflush(stdout);
+            fprintf(stderr, "[ERROR] Could not run xelatex\n");
+            return -1;
         }
+        passes++;
+
+        if (file_hash(aux_path) == aux_before && !latex_log_asks_rerun(log_path)) break;
     }
-    // printf("%lf\n", dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh);
+    // the PDF of a document with errors is not one to keep, or to cache
+    if (status != 0) {
+        printf("failed!\n");
+        fflush(stdout);
+        fprintf(stderr, "[ERROR] xelatex exited with status %d, see `%s`\n", status, log_path);
+        return -1;
+    }
+    printf("done in %ld pass%s!\n", passes, passes == 1 ? "" : "es");
+    return 0;
+#else
+    (void) doc;
+    printf("[INFO] Compiling LaTeX document... ");
+    fflush(stdout);
+    char command[256] = {0};
+    snprintf(command, 256, "xelatex -interaction=nonstopmode '%s' > nul", out_file_path);
+    if (system(command) != 0) {
+        printf("failed!\n");
+        return -1;
+    }
+    printf("done!\n");
+    return 0;
+#endif
+}
 
-    // // DIRTY HACK
-    // double counting_error = dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh;
-    // if (counting_error < 0.0) {
-    //     dsum_add(downdh_sum, counting_error);
-    // } else {
-    //     dsum_add(updh_sum, -counting_error);
-    // }
-    // printf("%lf\n", dsum_return(updh_sum)-dsum_return(downdh_sum) - maxh + minh);
+// What a run writes besides the terminal output.
+typedef struct {
+    int build_pdf, keep_tex, direct_pdf, include_map, no_document;
+    int exports[EXPORTS_COUNT];
+    const char* export_paths[EXPORTS_COUNT]; // NULL to write next to the GPX file
+} RunOptions;
+
+// Lists the files the run leaves behind, to keep them in the result cache or get
+// them from there.
+size_t run_artifacts(const RunOptions* run, const char* gpx_path, ResultArtifact artifacts[RESULT_ARTIFACTS_CAP]) {
+    size_t artifacts_len = 0;
+    if (!run->no_document) {
+        if (run->direct_pdf || !run->build_pdf || run->keep_tex) {
+            artifacts[artifacts_len] = (ResultArtifact) { run->direct_pdf ? "pdf" : "tex", {0}, -1, 0, 0 };
+            snprintf(artifacts[artifacts_len++].path, 128, "%s", out_file_path);
+        }
+        if (run->build_pdf && !run->direct_pdf) {
+            artifacts[artifacts_len] = (ResultArtifact) { "pdf", {0}, -1, 0, 0 };
+            snprintf(artifacts[artifacts_len++].path, 128, "%.*s.pdf", (int) strlen(out_file_path)-4, out_file_path);
+        }
+    }
+    for (size_t k = 0; k < EXPORTS_COUNT; k++) {
+        if (!run->exports[k]) continue;
+        ResultArtifact* artifact = &artifacts[artifacts_len++];
+        *artifact = (ResultArtifact) { export_extensions[k], {0}, (int) k, run->export_paths[k] != NULL, 0 };
+        if (artifact->append) {
+            snprintf(artifact->path, 128, "%s", run->export_paths[k]);
+            artifact->offset = file_size(artifact->path);
+        } else {
+            snprintf(artifact->path, 128, "%.*s.%s", (int) strlen(gpx_path)-4, gpx_path, export_extensions[k]);
+        }
+    }
+    return artifacts_len;
+}
 
-    uint64_t tot_time = (uint64_t) round(60.0 * kms / (FACTOR * ADJUSTMENT_FACTOR));
-    fprintf(sink, "        \\multirow{2}{*}{%.0f m.s.l.m.} & \\multirow{2}{*}{%.0f m.s.l.m.} & \\multirow{2}{*}{%.0f m} & \\multirow{2}{*}{%.0f m} & \\multirow{2}{*}{%.2f km} & \\multirow{2}{*}{%.2f kms} & \\multirow{2}{*}{%ld h %ld min} \\\\\n", round(minh), round(maxh), round(dsum_return(updh_sum)), round(dsum_return(downdh_sum)), km, kms, tot_time/60, tot_time%60);
-    fprintf(sink, "        &&&&&& \\\\\n");
-    fprintf(sink, "        \\hline\n");
-    fprintf(sink, "    \\end{tabular}\\end{center}\n");
+uint64_t run_key(const RunOptions* run, const uint64_t source_hash) {
+    const int options[] = {
+        run->include_map, run->build_pdf, run->keep_tex, run->direct_pdf, run->no_document,
+        run->exports[EXPORT_CSV], run->exports[EXPORT_JSON], run->exports[EXPORT_BIN],
+    };
+    return result_key(source_hash, options, sizeof(options) / sizeof(options[0]));
+}
 
-    fprintf(sink, "\n");
-    fprintf(sink, "\\pagebreak\n");
-    fprintf(sink, "\n");
+// With --watch the hash of the last document compiled, the PDF next to it is left
+// alone while the document stays the same.
+uint64_t watch_tex_hash = 0;
+
+int watch_compile_latex(const String_Builder* doc) {
+    const uint64_t tex_hash = hash_bytes(HASH_SEED, doc->items, doc->count);
+    char pdf_path[160] = {0};
+    snprintf(pdf_path, 160, "%.*s.pdf", (int) strlen(out_file_path)-4, out_file_path);
+    if (WATCH && tex_hash == watch_tex_hash && file_exists(pdf_path)) {
+        printf("[INFO] Watch: LaTeX document unchanged [%016lx], keeping `%s`\n", tex_hash, pdf_path);
+        return 0;
+    }
+    if (WATCH) printf("[INFO] Watch: LaTeX document changed [%016lx], compiling it\n", tex_hash);
 
-    fprintf(sink, "    \\begin{center}\n");
-    fprintf(sink, "        \\textsc{\\Huge %s}\n", name);
-    fprintf(sink, "\n");
-    fprintf(sink, "        \\vspace{2ex}\n");
-    fprintf(sink, "\n");
-    fprintf(sink, "\\textsc{\\large Profilo altimetrico}\n");
-    fprintf(sink, "    \\end{center}\n");
+    const StageMark mark = stage_begin();
+    const int result = compile_latex(doc);
+    stage_end(STAGE_COMPILE, &mark);
+    watch_tex_hash = result == 0 ? tex_hash : 0;
+    return result;
+}
 
-    fprintf(sink, "\n");
+int write_outputs(const RunOptions* run, const ResultArtifact* artifacts, const size_t artifacts_len) {
+    // the exports next to the GPX file are rewritten, the ones given a file are added to it
+    int failed = 0;
+    for (size_t k = 0; k < artifacts_len; k++) {
+        if (artifacts[k].export_format < 0) continue;
+        failed |= write_export(artifacts[k].path, (ExportFormat) artifacts[k].export_format, artifacts[k].append) != 0;
+    }
 
-    #define PLOT_MAX_X 25.0
-    #define PLOT_MAX_Y 15.0
+    if (run->no_document) {
+        // only the exports
+    } else if (run->direct_pdf) {
+        failed |= write_direct_pdf(out_file_path, run->include_map) != 0;
+    } else {
+        // Output table
+        // Output graph
+        // Output latex doc
+        String_Builder doc = {0};
+        failed |= print_latex_document(&doc, run->include_map) != 0;
+
+        // the document goes straight to XeLaTeX, the .tex is only written when asked for
+        if (!run->build_pdf || run->keep_tex) {
+            FILE *out_file = fopen(out_file_path, "w");
+            if (out_file == NULL) {
+                out_file = stdout;
+            }
+            fwrite(doc.items, 1, doc.count, out_file);
+            if (out_file != stdout) fclose(out_file);
+        }
 
-    #define CELL_SIZE 1.0
-    fprintf(sink, "    \\begin{center}\\begin{tikzpicture}[x=%lfcm,y=%lfcm, step=%lfcm]\n", CELL_SIZE, CELL_SIZE, CELL_SIZE);
+        // Create PDF
+        if (run->build_pdf) failed |= watch_compile_latex(&doc) != 0;
+        sb_free(&doc);
+    }
+    return failed;
+}
 
-        fprintf(sink, "\\draw[very thin,color=black!20] (0.0,0.0) grid (%.1f,%.1f);\n", PLOT_MAX_X+0.5, PLOT_MAX_Y+0.5);
+// Writes the outputs of the track with the current parameters, taken from the result
+// cache when it has them. The distances of the segments must be known.
+int emit(const RunOptions* run, const char* gpx_path, const uint64_t source_hash) {
+    ResultArtifact artifacts[RESULT_ARTIFACTS_CAP] = {0};
+    const size_t artifacts_len = run_artifacts(run, gpx_path, artifacts);
+    const uint64_t key = run_key(run, source_hash);
+    if (result_restore(key, artifacts, artifacts_len)) {
+        // the PDF may not be the one of the last document compiled any more
+        watch_tex_hash = 0;
+        return 0;
+    }
+    result_stats(0, key);
 
-        fprintf(sink, "\\draw[->] (0,-0.5) -- (0,%.1f) node[above] {$h \\hphantom{i} [m]$};\n", PLOT_MAX_Y+0.2);
-        fprintf(sink, "\\draw[->] (-0.5,0) -- (%.1f,0) node[right] {$s \\hphantom{i} [km]$};\n", PLOT_MAX_X+0.2);
+    // Calculate time
+    // Set pauses
+    calculate_segment_times();
+    calculate_march();
 
-        fprintf(sink, "\\filldraw[black] (0,0) rectangle (0.0,0.0) node[anchor=north east]{0};\n");
+    const int failed = write_outputs(run, artifacts, artifacts_len);
+    if (!failed) result_store(key, artifacts, artifacts_len);
+    return failed;
+}
 
-        for (size_t h = 1; h < (size_t) PLOT_MAX_Y + 1; h++) {
-            fprintf(sink, "\\filldraw[black] (-0.05,%ld) rectangle (0.05, %ld) node[anchor=east]{%.0f};\n", h, h, ((double) h /PLOT_MAX_Y) * 3000.0);
+// The marching table on the terminal, to check the times while changing the parameters.
+void print_march_table(FILE* sink) {
+    // the Δ takes two bytes
+    fprintf(sink, "%-5s %7s %8s %8s %8s %7s %7s %7s %7s\n", "Nome", "Alt.", "Δs", "Δkms", "Δt", "s", "kms", "t", "Pausa");
+    for (size_t i = 0; i < waypoints_len; i++) {
+        const MarchRow* row = &march[i];
+        fprintf(sink, "%-5s %7.0f ", row->name, round(row->ele));
+        if (i < waypoints_len-1) {
+            fprintf(sink, "%7.1f %7.1f   %02ld:%02ld ", row->next.dst, row->next.kms, row->next.t / 60, row->next.t % 60);
+        } else {
+            fprintf(sink, "%7s %7s %7s ", "", "", "");
         }
+        fprintf(sink, "%7.1f %7.1f   %02ld:%02ld", row->s, row->kms, (row->t / 60)%24, row->t % 60);
+        if (i < waypoints_len-1 && i > 0 && row->pause > 0) fprintf(sink, "   %02ld:%02ld", row->pause / 60, row->pause % 60);
+        fprintf(sink, "\n");
+    }
+    fprintf(sink, "Totali: %.2f km, %.2f kms, %ld h %ld min senza pause, dislivello +%.0f m / -%.0f m\n",
+        march_totals.s, march_totals.kms, march_totals.time/60, march_totals.time%60, round(march_totals.up), round(march_totals.down));
+}
 
-        for (size_t k = 1; k < (size_t) PLOT_MAX_X + 1; k++) {
-            fprintf(sink, "\\filldraw[black] (%ld,-0.05) rectangle (%ld,0.05) node[anchor=north]{%.1f};\n", k, k, round(((double) k /PLOT_MAX_X) * km * 10.0)/10.0);
+int parse_hhmm(const char* str, uint64_t* minutes) {
+    uint64_t hours = 0, mins = 0;
+    if (sscanf(str, "%lu:%lu", &hours, &mins) != 2 || mins >= 60) return 0;
+    *minutes = hours * 60 + mins;
+    return 1;
+}
+
+void print_repl_help() {
+    printf("Comandi:  factor <kms/h>         Cambia il fattore di marcia.\n");
+    printf("          start <hh:mm>          Cambia l'orario di partenza.\n");
+    printf("          pause <punto> <hh:mm>  Cambia la pausa a un punto intermedio.\n");
+    printf("          table                  Stampa la tabella di marcia.\n");
+    printf("          emit                   Scrive i documenti e le esportazioni.\n");
+    printf("          quit                   Termina.\n");
+}
+
+// Lets the parameters be tried out on a parsed track: the distances and the kms of the
+// segments stay as they are, each change only works the times out again. The outputs
+// are written on request, through the result cache like a normal run.
+int repl(const RunOptions* run, const char* gpx_path, const uint64_t source_hash) {
+    int failed = 0;
+    char line[256] = {0};
+    calculate_segment_times();
+    calculate_march();
+    print_march_table(stdout);
+    print_repl_help();
+
+    while (1) {
+        printf("> ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL) break;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char command[16] = {0}, arg1[64] = {0}, arg2[64] = {0};
+        const int args = sscanf(line, "%15s %63s %63s", command, arg1, arg2);
+        if (args <= 0) continue;
+
+        int changed = 0;
+        if (strcmp(command, "factor") == 0 && args == 2) {
+            const double factor = strtod(arg1, NULL);
+            if (factor > 0) {
+                FACTOR = factor;
+                changed = 1;
+            } else {
+                fprintf(stderr, "[ERRORE] Fattore di marcia non valido: '%s'.\n", arg1);
+            }
+        } else if (strcmp(command, "start") == 0 && args == 2) {
+            changed = parse_hhmm(arg1, &START_TIME);
+            if (!changed) fprintf(stderr, "[ERRORE] Orario di partenza non valido: '%s'.\n", arg1);
+        } else if (strcmp(command, "pause") == 0 && args == 3) {
+            for (char* c = arg1; *c; c++) if (*c >= 'a' && *c <= 'z') *c -= 'a' - 'A';
+            size_t i = 1;
+            while (i < waypoints_len-1 && strcmp(march[i].name, arg1) != 0) i++;
+            if (i >= waypoints_len-1) {
+                fprintf(stderr, "[ERRORE] Punto intermedio sconosciuto: '%s'.\n", arg1);
+            } else {
+                changed = parse_hhmm(arg2, &pauses[i]);
+                if (!changed) fprintf(stderr, "[ERRORE] Pausa non valida: '%s'.\n", arg2);
+            }
+        } else if (strcmp(command, "table") == 0 && args == 1) {
+            print_march_table(stdout);
+        } else if (strcmp(command, "emit") == 0 && args == 1) {
+            failed = emit(run, gpx_path, source_hash);
+        } else if ((strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) && args == 1) {
+            break;
+        } else if (strcmp(command, "help") == 0) {
+            print_repl_help();
+        } else {
+            fprintf(stderr, "[ERRORE] Comando non riconosciuto: '%s'.\n", line);
         }
 
-        size_t index_step = max(path_len / GRAPH_POINTS_COUNT, 1);
-        // printf("PATH OPTIMIZATION: %ld %ld\n", path_len, index_step);
-        // fprintf(sink, "\\draw plot[smooth] coordinates{(0,0) ");
-        // {
-        //     double path_x = 0;
-        //     double path_kms;
-        //     for (size_t i = 0; i < path_len; i ++) {
-        //         if (i > 0) {
-        //             double dst = distance(&path[i-1], &path[i]);
-        //             double dh = path[i].ele - path[i-1].ele;
-        //             path_x += dst;
+        if (changed) {
+            calculate_segment_times();
+            calculate_march();
+            print_march_table(stdout);
+        }
+    }
+    return failed;
+}
 
-        //             path_kms += calculate_kms(dst, dh);
-        //         }
+#ifndef _WIN32
+// Waits until `gpx_path` is written again. Editors often save to a new file and rename
+// it over the old one, so on Linux the directory is watched with inotify for either;
+// elsewhere the modification time is polled. Events coming right after the first one
+// belong to the same save.
+void wait_for_change(const char* gpx_path, const int watch_fd) {
+#ifdef __linux__
+    const char* base = strrchr(gpx_path, '/');
+    base = base != NULL ? base + 1 : gpx_path;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    struct pollfd pfd = { watch_fd, POLLIN, 0 };
+    while (!changed || poll(&pfd, 1, 200) > 0) {
+        const ssize_t len = read(watch_fd, events, sizeof(events));
+        if (len <= 0) return;
+        for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            if (event->len > 0 && strcmp(event->name, base) == 0) changed = 1;
+        }
+    }
+#else
+    (void) watch_fd;
+    struct stat st = {0};
+    const int64_t mtime = stat(gpx_path, &st) == 0 ? stat_mtime(&st) : 0;
+    while (stat(gpx_path, &st) != 0 || stat_mtime(&st) == mtime) sleep(1);
+    usleep(200 * 1000);
+#endif
+}
+#endif
 
-        //         if (i % index_step == 0 || i == path_len - 1)
-        //             fprintf(sink, "(%f, %f) ",
-        //                 map(path_x, 0, km, 0, PLOT_MAX_X),
-        //                 map(path_kms, 0, kms, 0, PLOT_MAX_Y));
-        //     }
-        // }
-        // fprintf(sink, "};\n");
+// Writes the outputs again every time the GPX file is saved. The stages whose input did
+// not change reuse what the previous run left in memory: the map while its frame and
+// the route on it stay, the profile while the elevation stays and the PDF while the
+// document stays; each says so in the log.
+int watch_track(const RunOptions* run, const char* gpx_path, uint64_t source_hash) {
+#ifdef _WIN32
+    (void) run; (void) gpx_path; (void) source_hash;
+    fprintf(stderr, "[ERRORE] --watch non è disponibile su Windows.\n");
+    return 1;
+#else
+    int watch_fd = -1;
+#ifdef __linux__
+    char dir[256] = ".";
+    const char* base = strrchr(gpx_path, '/');
+    if (base != NULL) snprintf(dir, sizeof(dir), "%.*s", (int) (base - gpx_path), gpx_path);
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0 || inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "[ERROR] Could not watch `%s`\n", dir);
+        return 1;
+    }
+#endif
+    printf("[INFO] Watching `%s` for changes, Ctrl+C to stop\n", gpx_path);
 
-        fprintf(sink, "\\draw plot[smooth] coordinates{");
-        double max_ele = -DBL_MAX, min_ele = DBL_MAX;
-        double max_ele_x = 0.0, min_ele_x = 0.0;
-        {
-            double path_x = 0;
-            for (size_t i = 0; i < path_len; i ++) {
-                if (i > 0) path_x += distance(&path[i-1], &path[i]);
-                if (path[i].ele < min_ele) {
-                        min_ele = path[i].ele;
-                        min_ele_x = path_x;
-                }
-                if (path[i].ele > max_ele) {
-                        max_ele = path[i].ele;
-                        max_ele_x = path_x;
-                }
+    while (1) {
+        fflush(stdout);
+        wait_for_change(gpx_path, watch_fd);
+        const double start = monotonic_seconds();
+
+        if (load_source(gpx_path) != 0) continue;
+        const uint64_t hash = hash_bytes(HASH_SEED, source, source_size);
+        if (hash == source_hash) {
+            printf("[INFO] Watch: `%s` saved without changes\n", gpx_path);
+            continue;
+        }
+        source_hash = hash;
+        printf("[INFO] Watch: `%s` changed, updating\n", gpx_path);
+
+        // the pauses were given for the waypoints, which stay where they are in most edits
+        uint64_t kept_pauses[PAUSES_CAPACITY] = {0};
+        memcpy(kept_pauses, pauses, sizeof(pauses));
+        reset_track();
+        memcpy(pauses, kept_pauses, sizeof(pauses));
+
+        parse_gpx(fix_source((uint8_t*) source+1), gpx_path);
+        track_store(gpx_path, source_hash);
+        calculate_path_segments_data();
+        const int failed = emit(run, gpx_path, source_hash);
+        printf("[INFO] Watch: %s in %.2f s\n", failed ? "failed" : "updated", monotonic_seconds() - start);
+    }
+#endif
+}
 
-                if (i % index_step == 0 || i == path_len - 1)
-                    fprintf(sink, "(%f, %f) ",
-                        map(path_x, 0, km, 0, PLOT_MAX_X),
-                        map(path[i].ele, 0, 3000.0, 0, PLOT_MAX_Y));
-            }
+// A request to `--serve` is a few "<field> <value>" lines, an empty line and the GPX
+// file: `length` gives its size, `output` what to answer with (csv, json, bin, tex, pdf
+// or direct-pdf), `factor`, `start`, `pauses` and `map` are the options of the same
+// name. The answer is "OK <size>" and the file, or "ERROR <message>", on one line.
+#define SERVE_DIR CACHE_DIR"/serve"
+#define SERVE_TIMEOUT 30 // s, a client silent for this long is dropped and frees its worker
+
+int serve_error(FILE* out, const char* message, const char* value) {
+    fprintf(out, "ERROR %s: '%s'\n", message, value);
+    printf("[ERROR] Request %d: %s: '%s'\n", (int) getpid(), message, value);
+    return -1;
+}
+
+// Removes the files of a request and its directory.
+void remove_request_dir(const char* dir) {
+#ifndef _WIN32
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent* ent;
+    char path[256] = {0};
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        snprintf(path, 256, "%.64s/%.180s", dir, ent->d_name);
+        remove(path);
+    }
+    closedir(d);
+    rmdir(dir);
+#else
+    (void) dir;
+#endif
+}
+
+// Handles one request in a worker. The GPX file is kept in SERVE_DIR named after its
+// content, so its `.trk` is found by the next request for the same track; the outputs
+// are written to a directory of the request and go through the result cache.
+int serve_request(const int client) {
+    const time_t run_start = time(NULL);
+    FILE* in = fdopen(client, "rb");
+    FILE* out = fdopen(dup(client), "wb");
+    if (in == NULL || out == NULL) return -1;
+
+    RunOptions run = {0};
+    char output[16] = "csv";
+    size_t length = 0;
+    int result = 0;
+    char line[512] = {0};
+    while (result == 0 && fgets(line, sizeof(line), in) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') break;
+        char* value = strchr(line, ' ');
+        if (value != NULL) *value++ = '\0';
+        else value = line + strlen(line);
+
+        if (strcmp(line, "factor") == 0) {
+            FACTOR = strtod(value, NULL);
+            if (FACTOR <= 0) result = serve_error(out, "Invalid marching factor", value);
+        } else if (strcmp(line, "start") == 0) {
+            if (!parse_hhmm(value, &START_TIME)) result = serve_error(out, "Invalid start time", value);
+        } else if (strcmp(line, "pauses") == 0) {
+            parse_pauses(value);
+        } else if (strcmp(line, "map") == 0) {
+            run.include_map = 1;
+        } else if (strcmp(line, "output") == 0) {
+            snprintf(output, sizeof(output), "%s", value);
+        } else if (strcmp(line, "length") == 0) {
+            length = strtoull(value, NULL, 10);
+        } else {
+            result = serve_error(out, "Unknown field", line);
         }
-        fprintf(sink, "};\n");
+    }
 
-        double triangle_y = map(max_ele, 0, 3000.0, 0, PLOT_MAX_Y) - 0.25;
-        triangle_y = triangle_y < 0.0 ? 0.0 : triangle_y;
-        fprintf(sink, "\\draw[black!50] (%f,%f) node[draw,isosceles triangle,isosceles triangle apex angle=60,draw,rotate=90, anchor=apex, scale=0.33, fill=black!50] {};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y);
-        triangle_y = map(min_ele, 0, 3000.0, 0, PLOT_MAX_Y) + 0.25;
-        triangle_y = triangle_y > PLOT_MAX_Y ? PLOT_MAX_Y : triangle_y;
-        fprintf(sink, "\\draw[black!50] (%f,%f) node[draw,isosceles triangle,isosceles triangle apex angle=60,draw,rotate=270, anchor=apex, scale=0.33, fill=black!50] {};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), triangle_y);
-#if 0
-        double ele_progress = map(max_ele_x, 0, km, 0, 1.0);
-        if (ele_progress < 0.025) {
-            fprintf(sink, "\\node[anchor=north west] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
-        // } else if (ele_progress > 0.9) {
-        //     fprintf(sink, "\\node[anchor=north east] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
+    // a read error is in most cases SERVE_TIMEOUT running out
+    if (result == 0 && ferror(in)) {
+        snprintf(line, sizeof(line), "%d s", SERVE_TIMEOUT);
+        result = serve_error(out, "Request not received in time", line);
+    }
+
+    size_t export = EXPORTS_COUNT;
+    for (size_t k = 0; k < EXPORTS_COUNT; k++) {
+        if (strcmp(output, k == EXPORT_JSON ? "json" : export_extensions[k]) == 0) export = k;
+    }
+    if (export < EXPORTS_COUNT) {
+        run.exports[export] = 1;
+        run.no_document = 1;
+    } else if (strcmp(output, "pdf") == 0) {
+        run.build_pdf = 1;
+    } else if (strcmp(output, "direct-pdf") == 0) {
+        run.direct_pdf = 1;
+    } else if (result == 0 && strcmp(output, "tex") != 0) {
+        result = serve_error(out, "Unknown output", output);
+    }
+
+    if (result == 0 && (length == 0 || length >= MAX_SOURCE_LEN)) {
+        snprintf(line, sizeof(line), "%ld", length);
+        result = serve_error(out, "Invalid length", line);
+    }
+    if (result == 0 && fread(source, 1, length, in) != length) {
+        result = serve_error(out, "GPX file cut short", output);
+    }
+
+    char request_dir[64] = {0};
+    if (result == 0) {
+        // the same bytes as read from a file, so the caches are shared with the command line
+        source[length] = '\0';
+        source_size = length + 1;
+        uint64_t source_hash = hash_bytes(HASH_SEED, source, source_size);
+
+        make_dir(CACHE_DIR);
+        make_dir(SERVE_DIR);
+        char gpx_path[64] = {0};
+        snprintf(gpx_path, 64, SERVE_DIR"/%016lx.gpx", source_hash);
+        if (!file_exists(gpx_path)) {
+            char part_path[80] = {0};
+            part_name(part_path, 80, gpx_path);
+            FILE* fp = fopen(part_path, "wb");
+            const int written = fp != NULL && fwrite(source, 1, length, fp) == length;
+            if (fp != NULL) fclose(fp);
+            if (!written || rename_part(gpx_path) != 0) remove(part_path);
+        }
+
+        if (!track_load(gpx_path, &source_hash)) {
+            parse_gpx(fix_source((uint8_t*) source+1), gpx_path);
+            track_store(gpx_path, source_hash);
+        }
+        calculate_path_segments_data();
+
+        // the outputs are named after a GPX file that is never written
+        snprintf(request_dir, 64, SERVE_DIR"/%d", (int) getpid());
+        make_dir(request_dir);
+        char request_path[80] = {0};
+        snprintf(request_path, 80, "%s/request.gpx", request_dir);
+        snprintf(out_file_path, 128, "%s/request.%s", request_dir, run.direct_pdf ? "pdf" : "tex");
+        printf("[INFO] Request %d: `%s` as %s\n", (int) getpid(), gpx_path, output);
+
+        char answer_path[96] = {0};
+        if (export < EXPORTS_COUNT) snprintf(answer_path, 96, "%s/request.%s", request_dir, export_extensions[export]);
+        else snprintf(answer_path, 96, "%s/request.%s", request_dir, run.build_pdf || run.direct_pdf ? "pdf" : "tex");
+
+        if (emit(&run, request_path, source_hash) != 0 || !file_exists(answer_path)) {
+            result = serve_error(out, "Could not write the output", output);
         } else {
-            fprintf(sink, "\\node[anchor=north] at (%f,%f) {\\footnotesize %ld m};\n", map(max_ele_x, 0, km, 0, PLOT_MAX_X), map(max_ele, 0, 4000.0, 0, PLOT_MAX_Y) - 0.33, (uint64_t) (round(max_ele)));
+            fprintf(out, "OK %ld\n", file_size(answer_path));
+            result = copy_bytes(answer_path, 0, out);
         }
+    }
 
-        ele_progress = map(min_ele_x, 0, km, 0, 1.0);
-        if (ele_progress < 0.025) {
-            fprintf(sink, "\\node[anchor=south west] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
-        // } else if (ele_progress > 0.9) {
-        //     fprintf(sink, "\\node[anchor=south east] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
+    fclose(out);
+    fclose(in);
+    if (request_dir[0] != '\0') remove_request_dir(request_dir);
+    cache_gc(SERVE_DIR, run_start);
+    return result;
+}
+
+// Answers requests on a Unix socket, each in a worker process forked from the server,
+// at most `workers` at once. The workers share what the server prepared before the first
+// request, the LaTeX format, and the caches on disk: tracks, map sheets and results.
+int serve(const char* socket_path, const size_t workers) {
+#ifdef _WIN32
+    (void) socket_path; (void) workers;
+    fprintf(stderr, "[ERRORE] --serve non è disponibile su Windows.\n");
+    return 1;
+#else
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[ERRORE] Percorso del socket troppo lungo: '%s'.\n", socket_path);
+        return 1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    // the socket of a server that did not stop cleanly
+    struct stat st = {0};
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(server, 16) != 0) {
+        fprintf(stderr, "[ERROR] Could not listen on `%s`\n", socket_path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char fmt_path[256] = {0};
+    latex_format(fmt_path, 256);
+    printf("[INFO] Serving on `%s` with %ld workers\n", socket_path, workers);
+
+    size_t running = 0;
+    while (1) {
+        int status = 0;
+        while (running > 0 && waitpid(-1, &status, running >= workers ? 0 : WNOHANG) > 0) running--;
+
+        fflush(stdout);
+        const int client = accept(server, NULL, NULL);
+        if (client < 0) continue;
+        const struct timeval timeout = { .tv_sec = SERVE_TIMEOUT };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        const pid_t pid = fork();
+        if (pid == 0) {
+            close(server);
+            const int result = serve_request(client);
+            fflush(stdout);
+            _exit(result == 0 ? 0 : 1);
+        } else if (pid > 0) {
+            running++;
         } else {
-            fprintf(sink, "\\node[anchor=south] at (%f,%f) {\\footnotesize %ld m};\n", map(min_ele_x, 0, km, 0, PLOT_MAX_X), map(min_ele, 0, 4000.0, 0, PLOT_MAX_Y) + 0.33, (uint64_t) (round(min_ele)));
+            const char busy[] = "ERROR Could not start a worker\n";
+            send(client, busy, sizeof(busy) - 1, 0);
         }
+        close(client);
+    }
 #endif
+}
 
-        double x = 0;
-        for (size_t i = 0; i < waypoints_len; i++) {
-            waypoint_name(i, wp_name);
-            fprintf(sink, "\\filldraw[black] (%f,%f) circle (2pt) node[anchor=south west]{%.*s};\n", map(x, 0, km, 0, PLOT_MAX_X), map(waypoints[i].ele, 0, 3000.0, 0, PLOT_MAX_Y), 2, wp_name);
-            x += segments[i].dst;
+#define PREFETCH_CAPACITY 256
+uint64_t prefetch_ids[PREFETCH_CAPACITY] = {0};
+size_t prefetch_ids_len = 0;
+
+void collect_tile_ids(const double minE, const double minN, const double maxE, const double maxN) {
+    for (double e = minE; e < maxE + TILE_WIDTH; e += TILE_WIDTH / 2.0) {
+        for (double n = minN; n < maxN + TILE_HEIGHT; n += TILE_HEIGHT / 2.0) {
+            uint64_t id = lv95_to_tileid(e < maxE ? e : maxE, n < maxN ? n : maxN);
+            if (get_year(id) == 0) continue;
+
+            int known = 0;
+            for (size_t i = 0; i < prefetch_ids_len; i++) {
+                if (prefetch_ids[i] == id) known = 1;
+            }
+            if (known) continue;
+            assert(prefetch_ids_len < PREFETCH_CAPACITY && "Too many map sheets");
+            prefetch_ids[prefetch_ids_len++] = id;
         }
+    }
+}
 
-    fprintf(sink, "    \\end{tikzpicture}\\end{center}\n");
+int prefetch_tile(const size_t i) {
+    const uint64_t id = prefetch_ids[i];
+    if (download_tile(id) != 0) return -1;
+    for (uint64_t level = 0; level <= 5; level++) {
+        if (build_tile_level(id, level) != 0) return -1;
+    }
+    return 0;
+}
 
-    if (include_map)
-        print_map(sink);
-    
-    fprintf(sink, "\\end{document}\n");
+// Downloads and converts every sheet touching the area, so later documents never wait for them.
+int prefetch(char** gpx_files, const size_t gpx_files_len, const double bbox[4], const size_t workers) {
+    if (bbox != NULL) {
+        collect_tile_ids(bbox[0], bbox[1], bbox[2], bbox[3]);
+    }
+
+    for (size_t f = 0; f < gpx_files_len; f++) {
+        reset_track();
+        uint64_t source_hash = 0;
+        if (load_track(gpx_files[f], &source_hash) != 0) return 1;
+
+        double minE = DBL_MAX, minN = DBL_MAX, maxE = 0, maxN = 0;
+        for (size_t i = 0; i < path_len; i++) {
+            if (path[i].e < minE) minE = path[i].e;
+            if (path[i].e > maxE) maxE = path[i].e;
+            if (path[i].n < minN) minN = path[i].n;
+            if (path[i].n > maxN) maxN = path[i].n;
+        }
+        // the map frame adds a margin around the route
+        const double margin = (maxE - minE > maxN - minN ? maxE - minE : maxN - minN) * 0.5;
+        collect_tile_ids(minE - margin, minN - margin, maxE + margin, maxN + margin);
+    }
+
+    printf("[INFO] Prefetching %ld maps with %ld workers\n", prefetch_ids_len, workers);
+    size_t failed = parallel_run(prefetch_ids_len, prefetch_tile, workers);
+    if (failed > 0) {
+        fprintf(stderr, "[ERROR] Could not prefetch %ld maps.\n", failed);
+        return 1;
+    }
+    printf("[INFO] All maps are ready\n");
+    return 0;
 }
 
-void compile_latex() {
-    char command[256] = {0};
-    snprintf(command, 256, "xelatex -interaction=nonstopmode '%s'"
-#ifdef _WIN32
-    " > nul"
-#else
-    " > /dev/null"
+// The largest resident sizes of the process and of the programs it waited for, in kB.
+void peak_rss(uint64_t* self, uint64_t* children) {
+    *self = *children = 0;
+#ifndef _WIN32
+    struct rusage usage = {0};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) *self = (uint64_t) usage.ru_maxrss;
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0) *children = (uint64_t) usage.ru_maxrss;
+#ifdef __APPLE__
+    // in bytes there
+    *self /= 1024;
+    *children /= 1024;
 #endif
-    , out_file_path);
-    printf("[INFO] Compiling LaTeX document... ");
-    fflush(stdout);
-    system(command);
-    printf("done!\n");
+#endif
+}
+
+// Reports where the run spent its time, registered with `atexit` by --timings.
+void print_timings() {
+    const double total = monotonic_seconds() - run_started;
+    uint64_t rss = 0, children_rss = 0;
+    peak_rss(&rss, &children_rss);
+
+    if (TIMINGS == 1) {
+        printf("[INFO] Timings:\n");
+        printf("    %-16s %6s %10s %10s %12s\n", "stage", "calls", "seconds", "allocs", "bytes");
+        for (size_t k = 0; k < STAGES_COUNT; k++) {
+            const StageTiming* timing = &stage_timings[k];
+            if (timing->calls == 0) continue;
+            printf("    %-16s %6ld %10.3f %10ld %12ld\n", stage_names[k], timing->calls, timing->seconds, timing->allocs, timing->bytes);
+        }
+        printf("    %-16s %6s %10.3f %10ld %12ld\n", "total", "", total, alloc_count, alloc_bytes);
+        printf("    peak RSS: %.1f MB, programs run: %.1f MB\n", rss / 1024.0, children_rss / 1024.0);
+        return;
+    }
+
+    // the numbers are written without the locale, which LaTeX output switches on
+    String_Builder sb = {0};
+    sb_append_cstr(&sb, "{\"stages\":[");
+    for (size_t k = 0; k < STAGES_COUNT; k++) {
+        const StageTiming* timing = &stage_timings[k];
+        sb_appendf(&sb, "%s{\"name\":\"%s\",\"calls\":", k > 0 ? "," : "", stage_names[k]);
+        sb_append_u64(&sb, timing->calls);
+        sb_append_cstr(&sb, ",\"seconds\":");
+        sb_append_fixed(&sb, timing->seconds, 6);
+        sb_append_cstr(&sb, ",\"allocs\":");
+        sb_append_u64(&sb, timing->allocs);
+        sb_append_cstr(&sb, ",\"bytes\":");
+        sb_append_u64(&sb, timing->bytes);
+        sb_append_cstr(&sb, "}");
+    }
+    sb_append_cstr(&sb, "],\"seconds\":");
+    sb_append_fixed(&sb, total, 6);
+    sb_append_cstr(&sb, ",\"allocs\":");
+    sb_append_u64(&sb, alloc_count);
+    sb_append_cstr(&sb, ",\"bytes\":");
+    sb_append_u64(&sb, alloc_bytes);
+    sb_append_cstr(&sb, ",\"peak_rss_kb\":");
+    sb_append_u64(&sb, rss);
+    sb_append_cstr(&sb, ",\"children_peak_rss_kb\":");
+    sb_append_u64(&sb, children_rss);
+    sb_append_cstr(&sb, "}\n");
+
+    char path[160] = "tabellinator.timings.json";
+    if (out_file_path[0] != '\0') snprintf(path, 160, "%.*s.timings.json", (int) strlen(out_file_path)-4, out_file_path);
+    FILE* fp = fopen(path, "w");
+    if (fp != NULL) {
+        fwrite(sb.items, 1, sb.count, fp);
+        fclose(fp);
+        printf("[INFO] Timings written to `%s`\n", path);
+    } else {
+        fprintf(stderr, "[ERROR] Could not write `%s`\n", path);
+    }
+    sb_free(&sb);
 }
 
 void print_usage(const char* program) {
     printf("UTILIZZO: %s <path/to/file.gpx> [opzioni]\n", program);
+    printf("          %s --serve=<socket> [--jobs=<N>]\n", program);
+    printf("          %s --prefetch [--bbox=<E1>,<N1>,<E2>,<N2>] [file.gpx ...] [--jobs=<N>]\n", program);
     printf("\n");
     printf("Opzioni:    --pdf       Invoca automaticamente XeLaTeX per generare il file PDF.\n");
     printf("                        XeLaTeX deve essere installato perché ciò funzioni.\n");
+    printf("            --keep-tex  Con --pdf conserva anche il file .tex, che altrimenti\n");
+    printf("                        viene passato a XeLaTeX senza scriverlo su disco.\n");
+    printf("            --direct-pdf\n");
+    printf("                        Scrive direttamente il file PDF, senza LaTeX. Più\n");
+    printf("                        veloce, ma con una resa meno curata di --pdf.\n");
+    printf("            --csv[=<file>], --json[=<file>], --bin[=<file>]\n");
+    printf("                        Scrive anche la tabella di marcia come CSV, JSON (un\n");
+    printf("                        oggetto per riga) o binario. Con un file, i dati vengono\n");
+    printf("                        aggiunti in fondo a quelli già presenti.\n");
+    printf("            --no-document\n");
+    printf("                        Scrive solo le esportazioni, senza il documento.\n");
+    printf("            --factor=<kms/h>, --start=<hh:mm>, --pauses=<hh:mm>,...\n");
+    printf("                        Fattore di marcia, orario di partenza e pause ai punti\n");
+    printf("                        intermedi, che così non vengono chiesti.\n");
     printf("            --map       Scarica le mappe ufficiali svizzere e le include nel\n");
     printf("                        documento LaTeX. CURL e ImageMagick devono essere\n");
     printf("                        installati.\n");
+    printf("            --watch     Dopo il primo documento resta in attesa e lo rigenera\n");
+    printf("                        a ogni salvataggio del file GPX, rifacendo solo le\n");
+    printf("                        parti cambiate (cartina, profilo, compilazione).\n");
+    printf("            --repl      Dopo la lettura del percorso accetta dei comandi per\n");
+    printf("                        cambiare fattore, partenza e pause, ristampando ogni\n");
+    printf("                        volta la tabella di marcia; `emit` scrive i documenti.\n");
+    printf("            --preview   Invece del documento genera rapidamente un'immagine PNG\n");
+    printf("                        della cartina col percorso, senza LaTeX.\n");
+    printf("            --atlas[=<scala>]\n");
+    printf("                        Divide la cartina su più pagine a scala fissa lungo\n");
+    printf("                        il percorso (predefinito: 1:25000).\n");
+    printf("            --raster-route\n");
+    printf("                        Disegna il percorso direttamente nell'immagine della\n");
+    printf("                        cartina invece che con TikZ (compilazione più veloce).\n");
+    printf("            --native-profile\n");
+    printf("                        Disegna il profilo altimetrico come PDF vettoriale\n");
+    printf("                        invece che con TikZ (compilazione più veloce).\n");
+    printf("            --dpi=<N>   Risoluzione di stampa della cartina (predefinito: 300).\n");
+    printf("            --jpeg-quality=<N>\n");
+    printf("                        Qualità JPEG della cartina, da 1 a 100 (predefinito: 85).\n");
+    printf("            --cache-size=<MB>\n");
+    printf("                        Spazio massimo occupato dalle cartine ritagliate nella\n");
+    printf("                        cache (predefinito: 1024 MB).\n");
+    printf("            --memory-limit=<MB>\n");
+    printf("                        Memoria massima usata per convertire le cartine, oltre\n");
+    printf("                        la quale si usa il disco (predefinito: 1024 MB).\n");
+    printf("            --serve=<socket>\n");
+    printf("                        Resta in ascolto sul socket Unix e risponde alle\n");
+    printf("                        richieste di tabellinator-client, al massimo --jobs\n");
+    printf("                        alla volta.\n");
+    printf("            --prefetch  Scarica e converte in anticipo tutte le cartine dell'area\n");
+    printf("                        data con --bbox (coordinate LV95) o toccate dai file GPX.\n");
+    printf("            --jobs=<N>  Numero di cartine preparate in parallelo (predefinito: 4).\n");
+    printf("            --timings[=json]\n");
+    printf("                        Alla fine stampa il tempo, le allocazioni e la memoria\n");
+    printf("                        usati da ogni fase, o li scrive in file.timings.json.\n");
     printf("            -h,--help   Stampa il messaggio di aiuto, poi termina.\n");
 }
 
 int main(int argc, char* argv[]) {
+    run_started = monotonic_seconds();
     const char* program = *argv;
     char* file_path = NULL;
-    int build_pdf = 0;
-    int include_map = 0;
+    RunOptions run = {0};
+    int prefetch_maps = 0;
+    int preview = 0;
+    int interactive = 0;
+    int watch = 0;
+    const char* serve_path = NULL;
+    int has_factor = 0, has_start = 0, has_pauses = 0;
+    double bbox[4] = {0};
+    int has_bbox = 0;
+    char* gpx_files[PREFETCH_CAPACITY] = {0};
+    size_t gpx_files_len = 0;
 
     while (--argc > 0) {
         argv++;
 
-        if (strcmp(*argv+strlen(*argv)-4, ".gpx") == 0) {
+        if (strlen(*argv) > 4 && strcmp(*argv+strlen(*argv)-4, ".gpx") == 0) {
             file_path = *argv;
+            if (gpx_files_len < PREFETCH_CAPACITY) gpx_files[gpx_files_len++] = *argv;
+        } else if (strcmp(*argv, "--prefetch") == 0) {
+            prefetch_maps = 1;
+        } else if (strncmp(*argv, "--bbox=", 7) == 0) {
+            has_bbox = sscanf(*argv + 7, "%lf,%lf,%lf,%lf", &bbox[0], &bbox[1], &bbox[2], &bbox[3]) == 4;
+            if (!has_bbox) {
+                fprintf(stderr, "[ERRORE] Area non valida: '%s'.\n", *argv + 7);
+                return 1;
+            }
+        } else if (strncmp(*argv, "--jobs=", 7) == 0) {
+            JOBS = strtoull(*argv + 7, NULL, 10);
+            if (JOBS == 0) JOBS = 1;
+        } else if (strncmp(*argv, "--factor=", 9) == 0) {
+            FACTOR = strtod(*argv + 9, NULL);
+            has_factor = FACTOR > 0;
+            if (!has_factor) {
+                fprintf(stderr, "[ERRORE] Fattore di marcia non valido: '%s'.\n", *argv + 9);
+                return 1;
+            }
+        } else if (strncmp(*argv, "--start=", 8) == 0) {
+            uint64_t hours = 0, mins = 0;
+            has_start = sscanf(*argv + 8, "%lu:%lu", &hours, &mins) == 2;
+            if (!has_start) {
+                fprintf(stderr, "[ERRORE] Orario di partenza non valido: '%s'.\n", *argv + 8);
+                return 1;
+            }
+            START_TIME = hours * 60 + mins;
+        } else if (strncmp(*argv, "--pauses=", 9) == 0) {
+            parse_pauses(*argv + 9);
+            has_pauses = 1;
         } else if (strcmp(*argv, "--pdf") == 0) {
-            build_pdf = 1;
+            run.build_pdf = 1;
+        } else if (strcmp(*argv, "--direct-pdf") == 0) {
+            run.direct_pdf = 1;
+        } else if (strcmp(*argv, "--csv") == 0 || strncmp(*argv, "--csv=", 6) == 0) {
+            run.exports[EXPORT_CSV] = 1;
+            if ((*argv)[5] == '=') run.export_paths[EXPORT_CSV] = *argv + 6;
+        } else if (strcmp(*argv, "--json") == 0 || strncmp(*argv, "--json=", 7) == 0) {
+            run.exports[EXPORT_JSON] = 1;
+            if ((*argv)[6] == '=') run.export_paths[EXPORT_JSON] = *argv + 7;
+        } else if (strcmp(*argv, "--bin") == 0 || strncmp(*argv, "--bin=", 6) == 0) {
+            run.exports[EXPORT_BIN] = 1;
+            if ((*argv)[5] == '=') run.export_paths[EXPORT_BIN] = *argv + 6;
+        } else if (strcmp(*argv, "--no-document") == 0) {
+            run.no_document = 1;
+        } else if (strcmp(*argv, "--keep-tex") == 0) {
+            run.keep_tex = 1;
         } else if (strcmp(*argv, "--map") == 0) {
-            include_map = 1;
+            run.include_map = 1;
+        } else if (strcmp(*argv, "--timings") == 0) {
+            TIMINGS = 1;
+        } else if (strcmp(*argv, "--timings=json") == 0) {
+            TIMINGS = 2;
+        } else if (strncmp(*argv, "--serve=", 8) == 0) {
+            serve_path = *argv + 8;
+        } else if (strcmp(*argv, "--watch") == 0) {
+            watch = 1;
+            WATCH = 1;
+        } else if (strcmp(*argv, "--repl") == 0) {
+            interactive = 1;
+        } else if (strcmp(*argv, "--preview") == 0) {
+            preview = 1;
+        } else if (strcmp(*argv, "--atlas") == 0) {
+            ATLAS_SCALE = 25000;
+        } else if (strncmp(*argv, "--atlas=", 8) == 0) {
+            char* end = NULL;
+            ATLAS_SCALE = strtoull(*argv + 8, &end, 10);
+            if (*end != '\0' || ATLAS_SCALE < ATLAS_SCALE_MIN) {
+                fprintf(stderr, "[ERRORE] Scala dell'atlante non valida: '%s' (almeno %d).\n", *argv + 8, ATLAS_SCALE_MIN);
+                return 1;
+            }
+        } else if (strcmp(*argv, "--raster-route") == 0) {
+            RASTER_ROUTE = 1;
+        } else if (strcmp(*argv, "--native-profile") == 0) {
+            NATIVE_PROFILE = 1;
+        } else if (strncmp(*argv, "--dpi=", 6) == 0) {
+            TARGET_DPI = strtoull(*argv + 6, NULL, 10);
+            if (TARGET_DPI == 0) TARGET_DPI = 300;
+        } else if (strncmp(*argv, "--jpeg-quality=", 15) == 0) {
+            JPEG_QUALITY = strtoull(*argv + 15, NULL, 10);
+            if (JPEG_QUALITY == 0 || JPEG_QUALITY > 100) JPEG_QUALITY = 85;
+        } else if (strncmp(*argv, "--cache-size=", 13) == 0) {
+            CACHE_SIZE = strtoull(*argv + 13, NULL, 10);
+        } else if (strncmp(*argv, "--memory-limit=", 15) == 0) {
+            MEMORY_LIMIT = strtoull(*argv + 15, NULL, 10);
+            if (MEMORY_LIMIT < 64) MEMORY_LIMIT = 64;
         } else if (strcmp(*argv, "-h") == 0 || strcmp(*argv, "--help") == 0) {
             print_usage(program);
             return 0;
@@ -1311,53 +5824,77 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (TIMINGS) atexit(print_timings);
+    if (serve_path != NULL) return serve(serve_path, JOBS);
+
+    if (prefetch_maps) {
+        if (gpx_files_len == 0 && !has_bbox) {
+            fprintf(stderr, "[ERRORE] Non è stata data alcuna area o file GPX.\n");
+            print_usage(program);
+            return 1;
+        }
+        return prefetch(gpx_files, gpx_files_len, has_bbox ? bbox : NULL, JOBS);
+    }
+
     if (file_path == NULL) {
         fprintf(stderr, "[ERRORE] Non è stato dato alcun file GPX.\n");
         print_usage(program);
         return 1;
     }
-    snprintf(out_file_path, 128, "%.*s.tex", (int) strlen(file_path)-4, file_path);
+    snprintf(out_file_path, 128, "%.*s.%s", (int) strlen(file_path)-4, file_path, preview ? "png" : run.direct_pdf ? "pdf" : "tex");
 
-    {
+    // the parameters are changed with the commands of the REPL instead
+    const int ask = !preview && !interactive;
+    if (ask && (!has_factor || !has_start || !has_pauses)) printf("Vi prego d'inserire:\n");
+    if (ask && !has_factor) {
         double factor = 0;
-        uint64_t hours = 0, mins = 0;
-        printf("Vi prego d'inserire:\n");
-
         printf(" - Fattore di marcia (kms/h): ");
         scanf("%lf", &factor);
         if (factor > 0) FACTOR = factor;
-
+    }
+    if (ask && !has_start) {
+        uint64_t hours = 0, mins = 0;
         printf(" - Orario di partenza [hh:mm]: ");
         scanf("%zu:%zu", &hours, &mins);
         if ( (int64_t) hours >= 0 && (int64_t) mins >= 0) START_TIME = hours * 60 + mins;
         // printf("%f %ld:%ld\n\n\n", factor, hours, mins);
     }
 
-    if (load_source(file_path) != 0) {
-        return 1;
-    }
-
-    uint8_t* error_free_source = fix_source((uint8_t*) source+1);
-    // printf("%ld\n", error_free_source-(uint8_t*)source);
+#ifdef _WIN32
+    // XeLaTeX reads the document from the file there
+    run.keep_tex = 1;
+#endif
 
-    parse_gpx(error_free_source, file_path);
+    uint64_t source_hash = 0;
+    const int from_track = track_load(file_path, &source_hash);
+    if (!from_track) {
+        if (load_source(file_path) != 0) return 1;
+        source_hash = hash_bytes(HASH_SEED, source, source_size);
+    }
 
-    // Output table
-    // Output graph
-    // Output latex doc
-    FILE *out_file = fopen(out_file_path, "w");
-    if (out_file == NULL) {
-        out_file = stdout;
+    // with all the parameters given the run may end before parsing
+    if (ask && has_pauses && !watch) {
+        ResultArtifact artifacts[RESULT_ARTIFACTS_CAP] = {0};
+        const size_t artifacts_len = run_artifacts(&run, file_path, artifacts);
+        if (result_restore(run_key(&run, source_hash), artifacts, artifacts_len)) return 0;
     }
-    
-    print_latex_document(out_file, include_map);
 
-    // Create PDF
-    if (out_file != stdout) {
-        fclose(out_file);
+    if (!from_track) {
+        uint8_t* error_free_source = fix_source((uint8_t*) source+1);
+        // printf("%ld\n", error_free_source-(uint8_t*)source);
 
-        if (build_pdf) compile_latex();
+        parse_gpx(error_free_source, file_path);
+        track_store(file_path, source_hash);
     }
+    if (preview) return print_preview(out_file_path) == 0 ? 0 : 1;
+    if (ask && !has_pauses) ask_pauses();
 
-    return 0;
+    // Calculate distance and difference in altitude between Waypoints
+    // Calculate kms
+    calculate_path_segments_data();
+    if (interactive) return repl(&run, file_path, source_hash);
+
+    const int failed = emit(&run, file_path, source_hash);
+    if (watch) return watch_track(&run, file_path, source_hash);
+    return failed;
 }
\ No newline at end of file
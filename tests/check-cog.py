@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# Checks what the range request reader left behind against the sample sheet:
+#
+#   check-cog.py <sample.tif> <cache/cog> <windows dir>
+#
+# every cached block must hold the bytes of its tile in the sample, and every tile of
+# the windows given to ImageMagick must be one of the tiles of the sample.
+import os
+import re
+import struct
+import sys
+
+
+def read_tiff(path):
+    """The tiles of every directory of a little endian tiled TIFF: [(width, height, [bytes])]."""
+    data = open(path, "rb").read()
+    assert data[:4] == b"II*\x00", "%s: not a little endian TIFF" % path
+    ifds = []
+    (offset,) = struct.unpack_from("<I", data, 4)
+    while offset != 0:
+        (count,) = struct.unpack_from("<H", data, offset)
+        tags = {}
+        for i in range(count):
+            tag, kind, n, value = struct.unpack_from("<HHII", data, offset + 2 + 12 * i)
+            size = {3: 2, 4: 4}.get(kind, 1)
+            if n * size <= 4:
+                values = struct.unpack_from("<%d%s" % (n, "H" if kind == 3 else "I"), data, offset + 2 + 12 * i + 8)
+            else:
+                values = struct.unpack_from("<%d%s" % (n, "H" if kind == 3 else "I"), data, value)
+            tags[tag] = values
+        assert 324 in tags and 325 in tags, "%s: not tiled" % path
+        tiles = [data[o:o + c] for o, c in zip(tags[324], tags[325])]
+        ifds.append((tags[256][0], tags[257][0], tiles))
+        (offset,) = struct.unpack_from("<I", data, offset + 2 + 12 * count)
+    return ifds
+
+
+def main(sample_path, cog_dir, windows_dir):
+    sample = read_tiff(sample_path)
+    failures = 0
+
+    blocks = 0
+    for name in sorted(os.listdir(cog_dir)):
+        match = re.fullmatch(r"\d+-(\d+)-(\d+)\.bin", name)
+        if match is None:
+            continue
+        ifd, index = int(match.group(1)), int(match.group(2))
+        block = open(os.path.join(cog_dir, name), "rb").read()
+        if block != sample[ifd][2][index]:
+            print("FAIL: block %s differs from tile %d of directory %d" % (name, index, ifd))
+            failures += 1
+        blocks += 1
+
+    known = {tile for _, _, tiles in sample for tile in tiles}
+    windows = 0
+    for name in sorted(os.listdir(windows_dir)):
+        for width, height, tiles in read_tiff(os.path.join(windows_dir, name)):
+            for i, tile in enumerate(tiles):
+                if tile and tile not in known:
+                    print("FAIL: tile %d of %s (%dx%d) is not a tile of the sheet" % (i, name, width, height))
+                    failures += 1
+        windows += 1
+
+    if blocks == 0 or windows == 0:
+        print("FAIL: %d blocks and %d windows to check" % (blocks, windows))
+        failures += 1
+    print("%d blocks and %d windows checked, %d failures" % (blocks, windows, failures))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(*sys.argv[1:4]))
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Offline test of the range request reader of the map sheets: a local stand-in server
+# hands out sample-cog.tif for every sheet, tabellinator draws the preview of sample.gpx
+# from it, then the blocks it cached and the windows it gave to ImageMagick (a stub in
+# tests/bin) are checked against the sample. A second run must read everything from
+# the cache.
+#
+#   tests/cog-reader.sh [port]
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+program="$here/../tabellinator"
+port=${1:-8765}
+[ -x "$program" ] || { echo "Build tabellinator first, with nobuild"; exit 1; }
+
+work=$(mktemp -d)
+python3 "$here/tiles-server.py" "$port" "$here/sample-cog.tif" --log="$work/requests.log" &
+server=$!
+trap 'kill $server 2> /dev/null; rm -rf "$work"' EXIT
+until curl -s -f -I "http://127.0.0.1:$port/x.tif" > /dev/null; do sleep 0.1; done
+: > "$work/requests.log"
+
+cp "$here/sample.gpx" "$work/"
+mkdir "$work/windows"
+run() {
+    (cd "$work" && PATH="$here/bin:$PATH" TABELLINATOR_TEST_WINDOWS="$work/windows" \
+        TABELLINATOR_TILES_URL="http://127.0.0.1:$port" "$program" sample.gpx --preview)
+}
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+echo "== first run, blocks read from the server"
+run | tee "$work/run1.log"
+grep -q "Fetched .* map blocks" "$work/run1.log" || fail "no map blocks were fetched"
+python3 "$here/check-cog.py" "$here/sample-cog.tif" "$work/tabellinator-cache/cog" "$work/windows"
+if grep -q "^GET - " "$work/requests.log"; then fail "the whole sheet was downloaded"; fi
+if ls "$work/tabellinator-cache/cog" | grep -q "\.part$"; then fail "partial blocks were left behind"; fi
+served=$(awk '{ s += $3 } END { print s }' "$work/requests.log")
+size=$(wc -c < "$here/sample-cog.tif")
+[ "$served" -lt "$size" ] || fail "$served bytes read of a sheet of $size"
+echo "$served bytes read of a sheet of $size"
+
+echo "== second run, blocks read from the cache"
+rm -rf "$work/tabellinator-cache/crops" "$work/tabellinator-cache/maps" "$work/windows"/*
+requests=$(wc -l < "$work/requests.log")
+run | tee "$work/run2.log"
+if grep -q "Fetched" "$work/run2.log"; then fail "blocks were fetched again"; fi
+[ "$(wc -l < "$work/requests.log")" -eq "$requests" ] || fail "the server was asked again"
+python3 "$here/check-cog.py" "$here/sample-cog.tif" "$work/tabellinator-cache/cog" "$work/windows"
+
+echo "PASS"
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Writes sample-cog.tif, a small Cloud Optimized GeoTIFF standing in for a map sheet:
+# three levels (the sizes of pyramid levels 3 to 5 of a real sheet), 256 px deflate
+# tiles, all the directories at the start of the file. Every tile has its own content,
+# so a tile read from the wrong place shows. Only the standard library is needed.
+import random
+import struct
+import sys
+import zlib
+
+TILE = 256
+LEVELS = [(1750, 1200), (875, 600), (438, 300)]
+
+
+def tile_pixels(level, tx, ty, rng):
+    # blocks of 32 px with random shades: tiles of a few kB, like a map that is mostly plain
+    shades = [[rng.randrange(256) for _ in range(TILE // 32)] for _ in range(TILE // 32)]
+    rows = []
+    for y in range(TILE):
+        row = bytearray()
+        for x in range(TILE):
+            shade = shades[y // 32][x // 32]
+            row += bytes(((level * 80 + tx * 9) & 255, (x + ty * 17) & 255, shade))
+        rows.append(bytes(row))
+    return b"".join(rows)
+
+
+def main(path):
+    rng = random.Random(1234)
+    tiles = []  # per level, the compressed tiles row by row
+    for level, (width, height) in enumerate(LEVELS):
+        across, down = (width + TILE - 1) // TILE, (height + TILE - 1) // TILE
+        tiles.append([zlib.compress(tile_pixels(level, tx, ty, rng), 6) for ty in range(down) for tx in range(across)])
+
+    # header, then per level: IFD, BitsPerSample, TileOffsets, TileByteCounts
+    entries_count = 12
+    ifd_sizes = [2 + entries_count * 12 + 4 + 6 + 8 * len(t) for t in tiles]
+    data_start = 8 + sum(ifd_sizes)
+
+    out = bytearray(b"II*\x00" + struct.pack("<I", 8))
+    offset = data_start
+    ifd_offset = 8
+    for level, (width, height) in enumerate(LEVELS):
+        level_tiles = tiles[level]
+        arrays = ifd_offset + 2 + entries_count * 12 + 4
+        bits_offset, offsets_offset, counts_offset = arrays, arrays + 6, arrays + 6 + 4 * len(level_tiles)
+        entries = [
+            (254, 4, 1, 1 if level > 0 else 0),
+            (256, 4, 1, width),
+            (257, 4, 1, height),
+            (258, 3, 3, bits_offset),
+            (259, 3, 1, 8),
+            (262, 3, 1, 2),
+            (277, 3, 1, 3),
+            (284, 3, 1, 1),
+            (322, 3, 1, TILE),
+            (323, 3, 1, TILE),
+            (324, 4, len(level_tiles), offsets_offset),
+            (325, 4, len(level_tiles), counts_offset),
+        ]
+        next_ifd = ifd_offset + ifd_sizes[level] if level + 1 < len(LEVELS) else 0
+        out += struct.pack("<H", entries_count)
+        for tag, kind, count, value in entries:
+            packed = struct.pack("<HI", value, 0)[:4] if kind == 3 and count == 1 else struct.pack("<I", value)
+            out += struct.pack("<HHI", tag, kind, count) + packed
+        out += struct.pack("<I", next_ifd)
+        out += struct.pack("<HHH", 8, 8, 8)
+        tile_offsets = []
+        for tile in level_tiles:
+            tile_offsets.append(offset)
+            offset += len(tile)
+        out += struct.pack("<%dI" % len(level_tiles), *tile_offsets)
+        out += struct.pack("<%dI" % len(level_tiles), *[len(t) for t in level_tiles])
+        ifd_offset += ifd_sizes[level]
+
+    assert len(out) == data_start
+    for level_tiles in tiles:
+        for tile in level_tiles:
+            out += tile
+    with open(path, "wb") as fp:
+        fp.write(out)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1] if len(sys.argv) > 1 else "sample-cog.tif")
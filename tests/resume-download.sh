@@ -0,0 +1,64 @@
+#!/bin/sh
+# Offline test of the download of whole map sheets, the one used by --prefetch and when a
+# sheet cannot be read by range requests: the local stand-in server drops every transfer
+# after 100000 bytes, the download must resume where it stopped until the sheet is whole.
+# The levels of the sheet are created beforehand, so that no ImageMagick is needed.
+#
+#   tests/resume-download.sh [port]
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+program="$here/../tabellinator"
+port=${1:-8766}
+[ -x "$program" ] || { echo "Build tabellinator first, with nobuild"; exit 1; }
+
+work=$(mktemp -d)
+server=
+trap 'kill $server 2> /dev/null; rm -rf "$work"' EXIT
+start_server() {
+    [ -z "$server" ] || { kill $server; wait $server 2> /dev/null || true; }
+    python3 "$here/tiles-server.py" "$port" "$here/sample-cog.tif" --drop=100000 "$@" --log="$work/requests.log" &
+    server=$!
+    until curl -s "http://127.0.0.1:$port/" > /dev/null; do sleep 0.1; done
+    : > "$work/requests.log"
+}
+run() {
+    (cd "$work" && PATH="$here/bin:$PATH" TABELLINATOR_TILES_URL="${url:-http://127.0.0.1:$port}" \
+        "$program" --prefetch --bbox=2710000,1150000,2712000,1152000)
+}
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+check_sheet() {
+    cmp -s "$work/1253.tif" "$here/sample-cog.tif" || fail "the sheet differs from the sample"
+    if ls "$work" | grep -q "\.part$"; then fail "a partial download was left behind"; fi
+}
+for level in 0 1 2 3 4 5; do touch "$work/1253-$level.jpg"; done
+
+echo "== download cut every 100000 bytes"
+start_server
+run
+check_sheet
+if [ "$(grep -c "^GET - " "$work/requests.log")" -ne 1 ]; then fail "the download started over"; fi
+
+echo "== incomplete sheet left by an interrupted run, without HEAD"
+start_server --no-head
+head -c 150000 "$here/sample-cog.tif" > "$work/1253.tif"
+run
+check_sheet
+if grep -q "^GET - " "$work/requests.log"; then fail "the download started over"; fi
+
+echo "== complete partial download, without HEAD"
+mv "$work/1253.tif" "$work/1253.tif.part"
+: > "$work/requests.log"
+run
+check_sheet
+if grep -q "^GET" "$work/requests.log"; then fail "a complete sheet was downloaded again"; fi
+
+echo "== quotes in the address of the server"
+rm "$work/1253.tif"
+url="http://127.0.0.1:$port/\$(touch injected)/'\$(touch injected)'" run > /dev/null 2>&1 || true
+[ ! -e "$work/injected" ] || fail "the address of the server ran in the shell"
+
+echo "PASS"
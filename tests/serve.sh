@@ -0,0 +1,78 @@
+#!/bin/sh
+# Test of --serve: tabellinator listens on a socket in a temporary folder, every kind of
+# output of sample.gpx is asked twice at the same time with tabellinator-client and each
+# answer must be the same file written by a run from the command line. A request with an
+# unknown output must be answered with an error. Afterwards the results counted in
+# results.stats must match the requests and no temporary file may be left behind.
+#
+#   tests/serve.sh
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+program="$here/../tabellinator"
+client="$here/../tabellinator-client"
+[ -x "$program" ] && [ -x "$client" ] || { echo "Build tabellinator first, with nobuild"; exit 1; }
+
+work=$(mktemp -d)
+server=
+trap 'kill $server 2> /dev/null; rm -rf "$work"' EXIT
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+data="--factor=4 --start=8:00 --pauses="
+outputs="csv json bin direct-pdf"
+counted() {
+    if [ -e "$work/tabellinator-cache/results.stats" ]; then
+        awk '{ print $2 + $4 }' "$work/tabellinator-cache/results.stats"
+    else
+        echo 0
+    fi
+}
+
+echo "== command line runs"
+mkdir "$work/cli"
+cp "$here/sample.gpx" "$work/"
+cp "$here/sample.gpx" "$work/cli/"
+(cd "$work/cli" && "$program" sample.gpx $data --csv --json --bin --no-document && "$program" sample.gpx $data --direct-pdf) \
+    < /dev/null > "$work/cli.log" 2>&1 || fail "the command line run failed"
+mv "$work/cli/sample.jsonl" "$work/cli/sample.json"
+mv "$work/cli/sample.pdf" "$work/cli/sample.direct-pdf"
+
+echo "== concurrent requests"
+(cd "$work" && exec "$program" --serve="$work/serve.sock" --jobs=4) > "$work/serve.log" 2>&1 &
+server=$!
+until [ -S "$work/serve.sock" ]; do
+    kill -0 $server 2> /dev/null || fail "the server did not start"
+    sleep 0.1
+done
+before=$(counted)
+clients=
+for output in $outputs; do
+    for n in 1 2; do
+        "$client" "$work/serve.sock" "$work/sample.gpx" --output=$output $data -o "$work/answer-$n.$output" &
+        clients="$clients $!"
+    done
+done
+for pid in $clients; do
+    wait $pid || fail "a request was not answered"
+done
+for output in $outputs; do
+    for n in 1 2; do
+        cmp -s "$work/answer-$n.$output" "$work/cli/sample.$output" || fail "the $output answer differs from the command line"
+    done
+done
+
+echo "== unknown output"
+if "$client" "$work/serve.sock" "$work/sample.gpx" --output=nonsense $data -o "$work/answer.nonsense" 2> "$work/error.log"; then
+    fail "the unknown output was answered"
+fi
+grep -q "Unknown output" "$work/error.log" || fail "the unknown output was not answered with an error"
+[ ! -s "$work/answer.nonsense" ] || fail "the unknown output was answered with a file"
+
+echo "== results and temporary files"
+[ "$(($(counted) - before))" -eq 8 ] || fail "results.stats counts $(($(counted) - before)) results for 8 requests"
+[ -z "$(find "$work" -name "*.part")" ] || fail "a partial file was left behind"
+[ -z "$(find "$work/tabellinator-cache/serve" -mindepth 1 -type d)" ] || fail "the folder of a request was left behind"
+
+echo "PASS"
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+# A stand-in for the map sheet server, to run tabellinator offline: every request for a
+# `.tif` gets the same sample sheet, with HEAD and range requests like the real server.
+#
+#   tiles-server.py <port> <sample.tif> [--drop=<bytes>] [--no-head] [--log=<file>]
+#
+# --drop cuts every response after that many bytes, like a connection that drops in the
+# middle of a transfer. --no-head answers HEAD requests with an error, so the size of
+# the sheet is not known beforehand. --log appends one line per request: method, range,
+# bytes sent.
+import http.server
+import os
+import re
+import sys
+
+
+def main():
+    port, sample = int(sys.argv[1]), sys.argv[2]
+    drop, log_path, head = None, None, True
+    for arg in sys.argv[3:]:
+        if arg.startswith("--drop="):
+            drop = int(arg[7:])
+        elif arg == "--no-head":
+            head = False
+        elif arg.startswith("--log="):
+            log_path = arg[6:]
+
+    def log(line):
+        if log_path is not None:
+            with open(log_path, "a") as fp:
+                fp.write(line + "\n")
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def log_message(self, *args):
+            pass
+
+        def do_HEAD(self):
+            if not head or not self.path.endswith(".tif"):
+                self.send_error(404)
+                return
+            self.send_response(200)
+            self.send_header("Content-Length", str(os.path.getsize(sample)))
+            self.send_header("Accept-Ranges", "bytes")
+            self.end_headers()
+            log("HEAD - 0")
+
+        def do_GET(self):
+            if not self.path.endswith(".tif"):
+                self.send_error(404)
+                return
+            size = os.path.getsize(sample)
+            first, last, code = 0, size - 1, 200
+            match = re.match(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+            if match:
+                first = int(match.group(1))
+                last = min(int(match.group(2)), size - 1) if match.group(2) else size - 1
+                if first >= size:
+                    self.send_response(416)
+                    self.end_headers()
+                    return
+                code = 206
+            self.send_response(code)
+            self.send_header("Content-Length", str(last - first + 1))
+            if code == 206:
+                self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, size))
+            self.end_headers()
+
+            with open(sample, "rb") as fp:
+                fp.seek(first)
+                data = fp.read(last - first + 1)
+            if drop is not None and len(data) > drop:
+                data = data[:drop]
+                self.close_connection = True
+            self.wfile.write(data)
+            self.wfile.flush()
+            log("GET %s %d" % (match.group(0) if match else "-", len(data)))
+
+    http.server.ThreadingHTTPServer(("127.0.0.1", port), Handler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()